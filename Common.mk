@@ -20,6 +20,9 @@
 ###############################################################################
 # debug = 1 will include string debugging for terminal/sushi/sashimi
 debug = 0
+# profile = 1 times each phase of the packet scheduler and every SCSI command with the EClock,
+# and builds the scsidaynaprof tool to show the results
+profile = 0
 # compiler_vcc = 1 will trigger VBCC, else GCC
 compiler_vcc = 1
 
@@ -129,9 +132,27 @@ LDFLAGS =
 ###############################################################################
 # ASM based alternative to deviceheader.o would be romtag.o
 
-OBJECTS = deviceheader.o deviceinit.o device.o scsiwifi.o
+OBJECTS = deviceheader.o deviceinit.o device.o scsiwifi.o capture.o
 OBJECTS += $(ASMOBJECTS)
 
+# scsidaynalink measures the SCSI link on its own, with the device's SCSI code
+LINKTOOL = scsidaynalink
+LINKTOOLOBJECTS = scsidaynalink.o scsiwifi.o
+
+###############################################################################
+#
+# profile
+#
+###############################################################################
+ifeq ($(profile),1)
+CFLAGS  += -DPROFILE
+CFLAGS2 += -DPROFILE
+OBJECTS += profile.o
+LINKTOOLOBJECTS += profile.o
+TESTTOOL = scsidaynaprof
+EXTRACLEAN += scsidaynaprof
+endif
+
 # used for secondary build
 OBJECTS2 = $(patsubst %.o,%.2o,$(OBJECTS))
 
@@ -141,11 +162,11 @@ OBJECTS2 = $(patsubst %.o,%.2o,$(OBJECTS))
 #
 ###############################################################################
 
-all:	$(DEVICEID) $(DEVICEID2) $(TESTTOOL) $(TESTTOOL2)
+all:	$(DEVICEID) $(DEVICEID2) $(LINKTOOL) $(TESTTOOL) $(TESTTOOL2)
 
 clean:
-	rm -f $(OBJECTS) $(OBJECTS2)
-	rm -f $(DEVICEID) $(DEVICEID2) $(EXTRACLEAN)
+	rm -f $(OBJECTS) $(OBJECTS2) $(LINKTOOLOBJECTS)
+	rm -f $(DEVICEID) $(DEVICEID2) $(LINKTOOL) $(EXTRACLEAN)
 
 # not for cross compile :-)
 install: $(DEVICEID) $(DEVICEID2)
@@ -166,6 +187,14 @@ $(DEVICEID) : $(OBJECTS)
 	$(CCX) -c $(CFLAGS) $(DEFINES) $(IPATH) -o $@ $<
 
 
+# link benchmark tool
+$(LINKTOOL) : $(LINKTOOLOBJECTS)
+	$(LINKEXE) $(CFLAGS) $(IPATH) -o $@ $(LINKTOOLOBJECTS) $(LINKLIBS)
+
+# profile tool (only built with profile = 1)
+$(TESTTOOL) : scsidaynaprof.c control.h profile.h
+	$(LINKEXE) $(CFLAGS) $(IPATH) -o $@ scsidaynaprof.c
+
 # secondary ruleset (used for expnet, will be ignored if DEVICEID2 is empty)
 $(DEVICEID2) : $(OBJECTS2)
 	$(LINK) $(LDFLAGS) -o $@ $(OBJECTS2) $(LINKLIBS)
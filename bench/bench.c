@@ -0,0 +1,550 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Benchmarks the driver's AmigaNET batch handling on a Linux host, using frames from pcap files
+ *
+ * Usage: scsidaynabench [-s sizes] [-p packets] [-r reads] [-o orphans] [-k batches] [-w writes] [-n repeats] [-c] [-t] trace.pcap...
+ *
+ * Each trace is packed into received batches for every DATASIZE, which are unpacked by the driver's own dispatchRecvBatch
+ * for a stand in stack that keeps CMD_READs and S2_READORPHANs queued like Roadshow does. The same frames are then queued
+ * as CMD_WRITEs and packed into batches by batchCollect. Nothing goes near a SCSI bus, so this is the cost of the
+ * packet handling alone.
+ */
+
+// device.c is built in here rather than linked, so the things it keeps to itself (eg: struct TxBatch) can be used
+#include "device.c"
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_SIZES     8
+#define BENCH_MAX_FRAME     (HW_ETH_HDR_SIZE + 1504)    // Allows for a VLAN tag
+#define BENCH_BUFFER_SIZE   1536
+#define BENCH_MAC_SLOTS     64
+
+// A frame from a trace. bf_Slice is when it arrived, in 1/16ths of a second from the start of the trace
+struct BenchFrame {
+	UBYTE* bf_Data;
+	USHORT bf_Size;
+	ULONG bf_Slice;
+};
+
+struct BenchTrace {
+	const char* bt_Name;
+	UBYTE* bt_File;
+	struct BenchFrame* bt_Frames;
+	ULONG bt_Count;
+	ULONG bt_Bytes;
+	ULONG bt_Skipped;        // Frames that weren't ethernet, were cut short or were too big
+	UBYTE bt_MAC[HW_ADDRFIELDSIZE];   // Used as our address, the unicast destination seen most
+};
+
+// A received batch in AmigaNET format, at bb_Offset in the packed data
+struct BenchBatch {
+	ULONG bb_Offset;
+	ULONG bb_Length;
+	ULONG bb_Slice;
+};
+
+// A request owned by the stand in stack, with the buffer its data is copied to or from
+struct BenchRequest {
+	struct IOSana2Req br_Req;
+	USHORT br_Command;
+	USHORT br_Type;
+	UBYTE br_Buffer[BENCH_BUFFER_SIZE];
+};
+
+// How the run is set up, from the command line
+struct BenchOptions {
+	ULONG bo_Sizes[BENCH_MAX_SIZES];
+	USHORT bo_NumSizes;
+	USHORT bo_MaxPackets;     // What the firmware would report as the most packets in a batch
+	USHORT bo_Reads;          // CMD_READs kept queued for each packet type
+	USHORT bo_Orphans;        // S2_READORPHANs kept queued
+	USHORT bo_ReplyEvery;     // The stack picks up replies after this many received batches
+	USHORT bo_Writes;         // CMD_WRITEs the stack can have queued at once
+	USHORT bo_Repeats;
+	UBYTE bo_Compact;
+	UBYTE bo_AckThin;
+};
+
+// Counts from the stand in stack's copy hooks
+struct BenchCopies {
+	ULONG bc_Copies;
+	uint64_t bc_Bytes;
+};
+
+// What one direction of one run came to
+struct BenchResult {
+	uint64_t br_Nanoseconds;
+	ULONG br_Frames;
+	ULONG br_Batches;
+	ULONG br_Copies;
+	uint64_t br_CopyBytes;
+	ULONG br_Obtains;
+	ULONG br_Delivered;
+	ULONG br_Orphans;          // Frames no CMD_READ wanted
+	ULONG br_OrphanDrops;      // and no S2_READORPHAN was queued for either
+	ULONG br_Delays;
+	ULONG br_Filtered;         // Dropped by the broadcast filter or rate limit
+};
+
+// Packet types the stand in stack reads, as Roadshow does with IPv6 enabled
+static const USHORT readTypes[] = { 0x0800, 0x0806, 0x86DD };
+#define NUM_READ_TYPES (sizeof(readTypes) / sizeof(readTypes[0]))
+
+static struct BenchCopies copies;
+
+static BOOL copyToStack(void* to, void* from, long length) {
+	copies.bc_Copies++;
+	copies.bc_Bytes += length;
+	memcpy(to, from, length);
+	return TRUE;
+}
+
+static BOOL copyFromStack(void* to, void* from, long length) {
+	copies.bc_Copies++;
+	copies.bc_Bytes += length;
+	memcpy(to, from, length);
+	return TRUE;
+}
+
+static uint64_t nanoseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+static ULONG readLong(const UBYTE* data, BOOL swapped) {
+	return swapped ? ((ULONG)data[3] << 24) | ((ULONG)data[2] << 16) | ((ULONG)data[1] << 8) | data[0]
+		: ((ULONG)data[0] << 24) | ((ULONG)data[1] << 16) | ((ULONG)data[2] << 8) | data[3];
+}
+
+// Loads the ethernet frames from a pcap file, returns FALSE if it isn't one
+static BOOL loadTrace(const char* name, struct BenchTrace* trace) {
+	memset(trace, 0, sizeof(struct BenchTrace));
+	trace->bt_Name = name;
+
+	FILE* file = fopen(name, "rb");
+	if (!file) {
+		fprintf(stderr, "%s: can't open\n", name);
+		return FALSE;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	trace->bt_File = malloc(length > 0 ? length : 1);
+	if ((!trace->bt_File) || (length < 24) || (fread(trace->bt_File, 1, length, file) != (size_t)length)) {
+		fprintf(stderr, "%s: can't read\n", name);
+		fclose(file);
+		return FALSE;
+	}
+	fclose(file);
+
+	// Either byte order, with microsecond or nanosecond timestamps
+	const UBYTE* data = trace->bt_File;
+	ULONG magic = readLong(data, FALSE);
+	BOOL swapped = (magic == 0xD4C3B2A1) || (magic == 0x4D3CB2A1);
+	if (swapped) magic = readLong(data, TRUE);
+	if ((magic != 0xA1B2C3D4) && (magic != 0xA1B23C4D)) {
+		fprintf(stderr, "%s: not a pcap file (pcapng isn't supported)\n", name);
+		return FALSE;
+	}
+	const ULONG fractionPerSlice = (magic == 0xA1B23C4D) ? 62500000 : 62500;
+	if (readLong(&data[20], swapped) != 1) {
+		fprintf(stderr, "%s: not an ethernet capture\n", name);
+		return FALSE;
+	}
+
+	ULONG maxFrames = (length - 24) / 16;
+	trace->bt_Frames = malloc((maxFrames ? maxFrames : 1) * sizeof(struct BenchFrame));
+	if (!trace->bt_Frames) return FALSE;
+
+	UBYTE macs[BENCH_MAC_SLOTS][HW_ADDRFIELDSIZE];
+	ULONG macCounts[BENCH_MAC_SLOTS];
+	USHORT numMacs = 0;
+	ULONG firstSecond = 0;
+	long offset = 24;
+	while (offset + 16 <= length) {
+		const ULONG second = readLong(&data[offset], swapped);
+		const ULONG fraction = readLong(&data[offset + 4], swapped);
+		const ULONG captured = readLong(&data[offset + 8], swapped);
+		const ULONG original = readLong(&data[offset + 12], swapped);
+		offset += 16;
+		if (captured > (ULONG)(length - offset)) break;
+		UBYTE* frame = (UBYTE*)&data[offset];
+		offset += captured;
+
+		if ((captured != original) || (captured < HW_ETH_HDR_SIZE) || (captured > BENCH_MAX_FRAME)) {
+			trace->bt_Skipped++;
+			continue;
+		}
+		if (!trace->bt_Count) firstSecond = second;
+		struct BenchFrame* bf = &trace->bt_Frames[trace->bt_Count++];
+		bf->bf_Data = frame;
+		bf->bf_Size = captured;
+		bf->bf_Slice = ((second - firstSecond) << 4) + (fraction / fractionPerSlice);
+		trace->bt_Bytes += captured;
+
+		if (frame[0] & 0x01) continue;
+		USHORT i;
+		for (i=0; i<numMacs; i++)
+			if (!memcmp(macs[i], frame, HW_ADDRFIELDSIZE)) break;
+		if (i == numMacs) {
+			if (numMacs == BENCH_MAC_SLOTS) continue;
+			memcpy(macs[numMacs], frame, HW_ADDRFIELDSIZE);
+			macCounts[numMacs++] = 0;
+		}
+		macCounts[i]++;
+	}
+
+	USHORT most = 0;
+	for (USHORT i=1; i<numMacs; i++)
+		if (macCounts[i] > macCounts[most]) most = i;
+	if (numMacs) memcpy(trace->bt_MAC, macs[most], HW_ADDRFIELDSIZE);
+		else memcpy(trace->bt_MAC, "\x02\x00\x00\x00\x00\x01", HW_ADDRFIELDSIZE);
+	return TRUE;
+}
+
+// Packs a trace into received batches the way the firmware does, at most dataSize bytes and maxPackets frames each.
+// Returns the number of batches, with *packed set to the data they are in
+static ULONG packBatches(struct BenchTrace* trace, ULONG dataSize, USHORT maxPackets, BOOL compact, struct BenchBatch** batches, UBYTE** packed) {
+	*packed = malloc((trace->bt_Count ? trace->bt_Count : 1) * (BENCH_MAX_FRAME + 2 + AMIGANET_RECV_HEADER_SIZE));
+	*batches = malloc((trace->bt_Count ? trace->bt_Count : 1) * sizeof(struct BenchBatch));
+	if ((!*packed) || (!*batches)) return 0;
+
+	ULONG numBatches = 0;
+	ULONG offset = 0;
+	struct BenchBatch* batch = NULL;
+	USHORT count = 0;
+	for (ULONG i=0; i<trace->bt_Count; i++) {
+		struct BenchFrame* bf = &trace->bt_Frames[i];
+		const BOOL broadcast = !memcmp(bf->bf_Data, "\xFF\xFF\xFF\xFF\xFF\xFF", HW_ADDRFIELDSIZE);
+		const BOOL compactFrame = (compact) && ((broadcast) || (!memcmp(bf->bf_Data, trace->bt_MAC, HW_ADDRFIELDSIZE)));
+		const USHORT storedSize = compactFrame ? bf->bf_Size - HW_ADDRFIELDSIZE + 1 : bf->bf_Size;
+
+		if ((!batch) || (count >= maxPackets) || (batch->bb_Length + 2 + storedSize > dataSize)) {
+			if (batch) {
+				(*packed)[batch->bb_Offset] = count >> 8;
+				(*packed)[batch->bb_Offset + 1] = count & 0xFF;
+				(*packed)[batch->bb_Offset + 2] = 1;    // More to come
+				offset += batch->bb_Length;
+			}
+			batch = &(*batches)[numBatches++];
+			batch->bb_Offset = offset;
+			batch->bb_Length = AMIGANET_RECV_HEADER_SIZE;
+			batch->bb_Slice = bf->bf_Slice;
+			memset(&(*packed)[offset], 0, AMIGANET_RECV_HEADER_SIZE);
+			count = 0;
+		}
+
+		UBYTE* out = &(*packed)[batch->bb_Offset + batch->bb_Length];
+		out[0] = (storedSize >> 8) | (compactFrame ? (AMIGANET_COMPACT_HEADER >> 8) : 0);
+		out[1] = storedSize & 0xFF;
+		if (compactFrame) {
+			out[2] = broadcast ? AMIGANET_DEST_BROADCAST : AMIGANET_DEST_OURS;
+			memcpy(&out[3], &bf->bf_Data[HW_ADDRFIELDSIZE], bf->bf_Size - HW_ADDRFIELDSIZE);
+		} else memcpy(&out[2], bf->bf_Data, bf->bf_Size);
+		batch->bb_Length += 2 + storedSize;
+		count++;
+	}
+	if (batch) {
+		(*packed)[batch->bb_Offset] = count >> 8;
+		(*packed)[batch->bb_Offset + 1] = count & 0xFF;
+	}
+	return numBatches;
+}
+
+// Sets up unit 0 as the unit's task would for an AmigaNET target, with nothing queued
+static struct devunit* setupUnit(struct devbase* db, struct ScsiDaynaSettings* settings, struct BenchTrace* trace, struct BenchOptions* options) {
+	memset(db, 0, sizeof(struct devbase));
+	SCSIWifi_defaultSettings(settings);
+	settings->debug = 0;
+	settings->ackThin = options->bo_AckThin;
+	db->db_scsiSettings = settings;
+
+	struct devunit* du = &db->db_Units[0];
+	du->du_scsiSettings = settings;
+	NewList((struct List*)&du->du_Openers);
+	NewList(&du->du_WriteList);
+	NewList(&du->du_EventList);
+	NewList(&du->du_ReadOrphanList);
+	NewList(&du->du_WifiList);
+	InitSemaphore(&du->du_ReadListSem);
+	InitSemaphore(&du->du_WriteListSem);
+	InitSemaphore(&du->du_EventListSem);
+	InitSemaphore(&du->du_ReadOrphanListSem);
+	InitSemaphore(&du->du_WifiListSem);
+	InitSemaphore(&du->du_ProcSem);
+	memcpy(du->du_MAC, trace->bt_MAC, HW_ADDRFIELDSIZE);
+	du->du_online = 1;
+	du->du_currentWifiState = 1;
+	du->du_amigaNetMode = 1;
+	du->du_compactMode = options->bo_Compact;
+	du->du_maxBatchLimit = 0xFFFFFFFEUL;
+	du->du_maxPackets = options->bo_MaxPackets;
+	du->du_BcastFilter = settings->bcastFilter;
+	du->du_BcastRate = settings->bcastRate;
+	du->du_LearnAddress = du->du_BcastFilter;
+	return du;
+}
+
+// Opens the unit for the stand in stack
+static void openStack(struct devunit* du, struct BufferManagement* bm) {
+	memset(bm, 0, sizeof(struct BufferManagement));
+	bm->bm_CopyToBuffer = (BMFunc)copyToStack;
+	bm->bm_CopyFromBuffer = (BMFunc)copyFromStack;
+	NewList(&bm->bm_ReadList);
+	AddTail((struct List*)&du->du_Openers, (struct Node*)bm);
+	du->du_Unit.unit_OpenCnt++;
+}
+
+// Queues a request with the driver's BeginIO, as the stack would
+static void queueRequest(struct devbase* db, struct devunit* du, struct BufferManagement* bm, struct MsgPort* replyPort, struct BenchRequest* br) {
+	struct IOSana2Req* ior = &br->br_Req;
+	ior->ios2_Req.io_Message.mn_ReplyPort = replyPort;
+	ior->ios2_Req.io_Unit = (struct Unit*)du;
+	ior->ios2_Req.io_Command = br->br_Command;
+	ior->ios2_Req.io_Flags = 0;
+	ior->ios2_PacketType = br->br_Type;
+	ior->ios2_BufferManagement = bm;
+	if (br->br_Command != CMD_WRITE) {
+		ior->ios2_Data = br->br_Buffer;
+		ior->ios2_DataLength = BENCH_BUFFER_SIZE;
+	}
+	DevBeginIO(ior, db);
+}
+
+// Receives a trace at one DATASIZE. Replies are picked up every bo_ReplyEvery batches, and each read goes straight back
+static void benchReceive(struct BenchTrace* trace, struct BenchOptions* options, ULONG dataSize, struct BenchResult* result) {
+	struct devbase db;
+	struct ScsiDaynaSettings settings;
+	struct BufferManagement bm;
+	struct devunit* du = setupUnit(&db, &settings, trace, options);
+	UBYTE* packetData = NULL;
+	UBYTE* bondData = NULL;
+	struct BenchBatch* batches;
+	UBYTE* packed;
+
+	memset(result, 0, sizeof(struct BenchResult));
+	resizeBatchBuffers(&db, du, dataSize, &packetData, &bondData);
+	ULONG numBatches = packBatches(trace, du->du_maxPacketsSize, options->bo_MaxPackets, options->bo_Compact, &batches, &packed);
+	struct MsgPort* replyPort = CreateMsgPort();
+	ULONG numRequests = NUM_READ_TYPES * options->bo_Reads + options->bo_Orphans;
+	struct BenchRequest* requests = calloc(numRequests ? numRequests : 1, sizeof(struct BenchRequest));
+	if ((!packetData) || (!numBatches) || (!replyPort) || (!requests)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(RETURN_FAIL);
+	}
+
+	openStack(du, &bm);
+	for (ULONG i=0; i<numRequests; i++) {
+		struct BenchRequest* br = &requests[i];
+		br->br_Command = (i < NUM_READ_TYPES * options->bo_Reads) ? CMD_READ : S2_READORPHAN;
+		br->br_Type = (br->br_Command == CMD_READ) ? readTypes[i % NUM_READ_TYPES] : 0;
+		queueRequest(&db, du, &bm, replyPort, br);
+	}
+
+	const ULONG traceSlices = trace->bt_Frames[trace->bt_Count - 1].bf_Slice + 16;
+	ULONG sinceReplies = 0;
+	for (USHORT repeat=0; repeat<options->bo_Repeats; repeat++) {
+		for (ULONG i=0; i<numBatches; i++) {
+			struct BenchBatch* batch = &batches[i];
+			// The received data goes in the driver's own buffer, as it would from the SCSI bus
+			memcpy(packetData, &packed[batch->bb_Offset], batch->bb_Length);
+			du->du_BcastSlice = batch->bb_Slice + (repeat * traceSlices);
+
+			const ULONG unknown = du->du_DevStats.UnknownTypesReceived;
+			const ULONG overruns = du->du_DevStats.Overruns;
+			const ULONG filtered = du->du_ArpFiltered + du->du_BcastLimited;
+			const ULONG obtains = hostCounters.hc_Obtains;
+			const ULONG delays = hostCounters.hc_Delays;
+			const struct BenchCopies before = copies;
+			// Read before dispatching, compact headers have the first packet's destination rebuilt over the count
+			const USHORT frames = ((USHORT)packetData[0] << 8) | packetData[1];
+			const uint64_t start = nanoseconds();
+			result->br_Delivered += dispatchRecvBatch(&db, du, packetData, batch->bb_Length, AMIGANET_RECV_HEADER_SIZE);
+			result->br_Nanoseconds += nanoseconds() - start;
+			result->br_Copies += copies.bc_Copies - before.bc_Copies;
+			result->br_CopyBytes += copies.bc_Bytes - before.bc_Bytes;
+			result->br_Obtains += hostCounters.hc_Obtains - obtains;
+			result->br_Delays += hostCounters.hc_Delays - delays;
+			result->br_Orphans += du->du_DevStats.UnknownTypesReceived - unknown;
+			result->br_OrphanDrops += du->du_DevStats.Overruns - overruns;
+			result->br_Filtered += du->du_ArpFiltered + du->du_BcastLimited - filtered;
+			result->br_Frames += frames;
+			result->br_Batches++;
+
+			if (++sinceReplies >= options->bo_ReplyEvery) {
+				struct BenchRequest* br;
+				while ((br = (struct BenchRequest*)GetMsg(replyPort)) != NULL) {
+					if ((br->br_Command == S2_READORPHAN) && (!br->br_Req.ios2_Req.io_Error)) result->br_Delivered++;
+					queueRequest(&db, du, &bm, replyPort, br);
+				}
+				sinceReplies = 0;
+			}
+		}
+	}
+
+	free(requests);
+	DeleteMsgPort(replyPort);
+	freeDMABuffer(&db, packetData);
+	free(batches);
+	free(packed);
+}
+
+// Sends a trace at one DATASIZE. The stack keeps up to bo_Writes CMD_WRITEs queued and the batches are completed as if
+// the firmware took every packet
+static void benchSend(struct BenchTrace* trace, struct BenchOptions* options, ULONG dataSize, struct BenchResult* result) {
+	struct devbase db;
+	struct ScsiDaynaSettings settings;
+	struct BufferManagement bm;
+	struct devunit* du = setupUnit(&db, &settings, trace, options);
+	UBYTE* packetData = NULL;
+	UBYTE* bondData = NULL;
+	UBYTE flowPeek[FLOW_PEEK_SIZE];
+	UBYTE ackPeek[FLOW_PEEK_SIZE];
+
+	memset(result, 0, sizeof(struct BenchResult));
+	resizeBatchBuffers(&db, du, dataSize, &packetData, &bondData);
+	struct IOSana2Req** pendingSends = AllocVec(du->du_maxPackets * sizeof(struct IOSana2Req*), MEMF_PUBLIC);
+	struct MsgPort* replyPort = CreateMsgPort();
+	struct BenchRequest* requests = calloc(options->bo_Writes, sizeof(struct BenchRequest));
+	struct BenchRequest** idle = calloc(options->bo_Writes, sizeof(struct BenchRequest*));
+	if ((!packetData) || (!pendingSends) || (!replyPort) || (!requests) || (!idle)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(RETURN_FAIL);
+	}
+	openStack(du, &bm);
+	USHORT numIdle = options->bo_Writes;
+	for (USHORT i=0; i<numIdle; i++) idle[i] = &requests[i];
+
+	const ULONG total = trace->bt_Count * options->bo_Repeats;
+	ULONG next = 0;
+	ULONG done = 0;
+	while (done < total) {
+		struct BenchRequest* br;
+		while ((br = (struct BenchRequest*)GetMsg(replyPort)) != NULL) {
+			idle[numIdle++] = br;
+			done++;
+		}
+		while ((numIdle) && (next < total)) {
+			struct BenchFrame* bf = &trace->bt_Frames[next++ % trace->bt_Count];
+			br = idle[--numIdle];
+			br->br_Command = CMD_WRITE;
+			br->br_Type = ((USHORT)bf->bf_Data[12] << 8) | bf->bf_Data[13];
+			memcpy(br->br_Req.ios2_DstAddr, bf->bf_Data, HW_ADDRFIELDSIZE);
+			memcpy(br->br_Buffer, &bf->bf_Data[HW_ETH_HDR_SIZE], bf->bf_Size - HW_ETH_HDR_SIZE);
+			br->br_Req.ios2_Data = br->br_Buffer;
+			br->br_Req.ios2_DataLength = bf->bf_Size - HW_ETH_HDR_SIZE;
+			queueRequest(&db, du, &bm, replyPort, br);
+		}
+		if (!du->du_WriteList.lh_Head->ln_Succ) continue;
+
+		struct TxBatch batch;
+		const ULONG obtains = hostCounters.hc_Obtains;
+		const struct BenchCopies before = copies;
+		const uint64_t start = nanoseconds();
+		batchBegin(du, &batch, packetData, pendingSends, NULL);
+		batchCollect(&db, du, &batch, 1, &settings, flowPeek, ackPeek);
+		batchComplete(&db, du, &batch, batch.tb_Count, 0);
+		result->br_Nanoseconds += nanoseconds() - start;
+		result->br_Copies += copies.bc_Copies - before.bc_Copies;
+		result->br_CopyBytes += copies.bc_Bytes - before.bc_Bytes;
+		result->br_Obtains += hostCounters.hc_Obtains - obtains;
+		result->br_Frames += batch.tb_Count;
+		result->br_Batches++;
+		if ((!batch.tb_Count) && (!replyPort->mp_MsgList.lh_Head->ln_Succ)) {
+			fprintf(stderr, "%s: a frame wont fit in a %lu byte batch\n", trace->bt_Name, (unsigned long)du->du_maxPacketsSize);
+			break;
+		}
+	}
+	// Frames completed without being sent (eg: thinned ACKs) count as handled
+	result->br_Delivered = done;
+
+	free(idle);
+	free(requests);
+	DeleteMsgPort(replyPort);
+	FreeVec(pendingSends);
+	freeDMABuffer(&db, packetData);
+}
+
+static void printResult(const char* direction, ULONG dataSize, struct BenchResult* result) {
+	const double seconds = result->br_Nanoseconds / 1e9;
+	const double frames = result->br_Frames ? result->br_Frames : 1;
+	printf("%8lu  %-4s %8lu %7.1f %12.0f %8.2f %8.2f %8lu %8lu %8lu %8lu\n", (unsigned long)dataSize, direction,
+		(unsigned long)result->br_Batches, result->br_Batches ? result->br_Frames / (double)result->br_Batches : 0.0,
+		seconds > 0 ? result->br_Frames / seconds : 0.0, result->br_Copies / frames, result->br_Obtains / frames,
+		(unsigned long)result->br_Orphans, (unsigned long)result->br_OrphanDrops, (unsigned long)result->br_Delays,
+		(unsigned long)result->br_Filtered);
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: scsidaynabench [-s sizes] [-p packets] [-r reads] [-o orphans] [-k batches] [-w writes] [-n repeats] [-c] [-t] trace.pcap...\n"
+		"  -s  DATASIZE values to try, comma separated (default 4096,8192,16384,32768,65536)\n"
+		"  -p  most packets the firmware puts in a batch (default 64)\n"
+		"  -r  CMD_READs the stack keeps queued for each of IPv4, ARP and IPv6 (default 32)\n"
+		"  -o  S2_READORPHANs the stack keeps queued (default 2)\n"
+		"  -k  received batches between the stack picking up its replies (default 1)\n"
+		"  -w  CMD_WRITEs the stack can have queued (default 64)\n"
+		"  -n  times each trace is played (default 20)\n"
+		"  -c  use compact headers\n"
+		"  -t  thin TCP ACKs\n");
+	exit(RETURN_ERROR);
+}
+
+int main(int argc, char** argv) {
+	struct BenchOptions options = { { 4096, 8192, 16384, 32768, 65536 }, 5, 64, 32, 2, 1, 64, 20, 0, 0 };
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:p:r:o:k:w:n:ct")) != -1) {
+		switch (opt) {
+			case 's': {
+				options.bo_NumSizes = 0;
+				for (char* size = strtok(optarg, ","); (size) && (options.bo_NumSizes < BENCH_MAX_SIZES); size = strtok(NULL, ",")) {
+					ULONG value = strtoul(size, NULL, 0);
+					if (value < SCSIWIFI_PACKET_MAX_SIZE + 4) usage();
+					options.bo_Sizes[options.bo_NumSizes++] = value;
+				}
+				break;
+			}
+			case 'p': options.bo_MaxPackets = atoi(optarg); break;
+			case 'r': options.bo_Reads = atoi(optarg); break;
+			case 'o': options.bo_Orphans = atoi(optarg); break;
+			case 'k': options.bo_ReplyEvery = atoi(optarg); break;
+			case 'w': options.bo_Writes = atoi(optarg); break;
+			case 'n': options.bo_Repeats = atoi(optarg); break;
+			case 'c': options.bo_Compact = 1; break;
+			case 't': options.bo_AckThin = 1; break;
+			default: usage();
+		}
+	}
+	if ((optind >= argc) || (!options.bo_NumSizes) || (!options.bo_MaxPackets) || (!options.bo_ReplyEvery) || (!options.bo_Writes) || (!options.bo_Repeats)) usage();
+
+	int result = RETURN_OK;
+	for (int arg=optind; arg<argc; arg++) {
+		struct BenchTrace trace;
+		if ((!loadTrace(argv[arg], &trace)) || (!trace.bt_Count)) {
+			if (trace.bt_File) fprintf(stderr, "%s: no usable frames\n", argv[arg]);
+			result = RETURN_WARN;
+			free(trace.bt_File);
+			free(trace.bt_Frames);
+			continue;
+		}
+
+		printf("%s: %lu frames, %lu bytes, %lu skipped, played %u times, our address %02x:%02x:%02x:%02x:%02x:%02x\n", trace.bt_Name,
+			(unsigned long)trace.bt_Count, (unsigned long)trace.bt_Bytes, (unsigned long)trace.bt_Skipped, options.bo_Repeats,
+			trace.bt_MAC[0], trace.bt_MAC[1], trace.bt_MAC[2], trace.bt_MAC[3], trace.bt_MAC[4], trace.bt_MAC[5]);
+		printf("DATASIZE  Dir   Batches  Frames     Frames/s   Copies    Locks  Orphans  Dropped   Delays Filtered\n");
+		printf("                          /batch              /frame   /frame\n");
+		for (USHORT i=0; i<options.bo_NumSizes; i++) {
+			struct BenchResult rx, tx;
+			benchReceive(&trace, &options, options.bo_Sizes[i], &rx);
+			printResult("RX", options.bo_Sizes[i], &rx);
+			benchSend(&trace, &options, options.bo_Sizes[i], &tx);
+			printResult("TX", options.bo_Sizes[i], &tx);
+		}
+		printf("\n");
+		free(trace.bt_File);
+		free(trace.bt_Frames);
+	}
+	return result;
+}
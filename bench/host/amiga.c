@@ -0,0 +1,243 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Host versions of the AmigaOS calls the driver makes, for scsidaynabench
+ *
+ * Lists, messages and memory behave as they do on the Amiga. Semaphores, replies and delays are counted
+ * but never block, as the benchmark is single threaded. Anything that would need real hardware fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include "amiga.h"
+
+struct HostCounters hostCounters;
+
+// AllocVec keeps the size in front of the memory like exec does
+APTR AllocVec(ULONG size, ULONG flags) {
+	size_t* mem = (flags & MEMF_CLEAR) ? calloc(1, size + sizeof(size_t)) : malloc(size + sizeof(size_t));
+	if (!mem) return NULL;
+	mem[0] = size;
+	return &mem[1];
+}
+
+void FreeVec(APTR memory) {
+	if (memory) free(((size_t*)memory) - 1);
+}
+
+APTR AllocMem(ULONG size, ULONG flags) { return (flags & MEMF_CLEAR) ? calloc(1, size) : malloc(size); }
+void FreeMem(APTR memory, ULONG size) { free(memory); }
+ULONG AvailMem(ULONG flags) { return 0x7FFFFFFF; }
+ULONG TypeOfMem(APTR address) { return MEMF_PUBLIC | MEMF_FAST; }
+void CopyMem(const void* source, void* dest, ULONG size) { memmove(dest, source, size); }
+void CopyMemQuick(const void* source, void* dest, ULONG size) { memmove(dest, source, size); }
+APTR CachePreDMA(APTR address, ULONG* length, ULONG flags) { return address; }
+void CachePostDMA(APTR address, ULONG* length, ULONG flags) { }
+struct Library* OpenLibrary(const char* name, ULONG version) { return NULL; }
+void CloseLibrary(void* library) { }
+
+void NewList(struct List* list) {
+	list->lh_Head = (struct Node*)&list->lh_Tail;
+	list->lh_Tail = NULL;
+	list->lh_TailPred = (struct Node*)&list->lh_Head;
+}
+
+void AddHead(struct List* list, struct Node* node) {
+	node->ln_Succ = list->lh_Head;
+	node->ln_Pred = (struct Node*)&list->lh_Head;
+	list->lh_Head->ln_Pred = node;
+	list->lh_Head = node;
+}
+
+void AddTail(struct List* list, struct Node* node) {
+	node->ln_Succ = (struct Node*)&list->lh_Tail;
+	node->ln_Pred = list->lh_TailPred;
+	list->lh_TailPred->ln_Succ = node;
+	list->lh_TailPred = node;
+}
+
+void Insert(struct List* list, struct Node* node, struct Node* pred) {
+	if (!pred) {
+		AddHead(list, node);
+		return;
+	}
+	node->ln_Succ = pred->ln_Succ;
+	node->ln_Pred = pred;
+	pred->ln_Succ->ln_Pred = node;
+	pred->ln_Succ = node;
+}
+
+void Remove(struct Node* node) {
+	node->ln_Pred->ln_Succ = node->ln_Succ;
+	node->ln_Succ->ln_Pred = node->ln_Pred;
+}
+
+struct Node* RemHead(struct List* list) {
+	struct Node* node = list->lh_Head;
+	if (!node->ln_Succ) return NULL;
+	Remove(node);
+	return node;
+}
+
+struct Node* RemTail(struct List* list) {
+	struct Node* node = list->lh_TailPred;
+	if (!node->ln_Pred) return NULL;
+	Remove(node);
+	return node;
+}
+
+void InitSemaphore(struct SignalSemaphore* sem) {
+	memset(sem, 0, sizeof(struct SignalSemaphore));
+	NewList((struct List*)&sem->ss_WaitQueue);
+	sem->ss_QueueCount = -1;
+}
+
+void ObtainSemaphore(struct SignalSemaphore* sem) {
+	hostCounters.hc_Obtains++;
+	sem->ss_NestCount++;
+}
+
+void ObtainSemaphoreShared(struct SignalSemaphore* sem) { ObtainSemaphore(sem); }
+
+ULONG AttemptSemaphore(struct SignalSemaphore* sem) {
+	ObtainSemaphore(sem);
+	return 1;
+}
+
+void ReleaseSemaphore(struct SignalSemaphore* sem) {
+	if (sem->ss_NestCount <= 0) {
+		fprintf(stderr, "ReleaseSemaphore on a semaphore that isn't held\n");
+		abort();
+	}
+	sem->ss_NestCount--;
+}
+
+struct MsgPort* CreateMsgPort(void) {
+	struct MsgPort* port = calloc(1, sizeof(struct MsgPort));
+	if (!port) return NULL;
+	port->mp_Node.ln_Type = NT_MSGPORT;
+	NewList(&port->mp_MsgList);
+	return port;
+}
+
+void DeleteMsgPort(struct MsgPort* port) { free(port); }
+void AddPort(struct MsgPort* port) { }
+void RemPort(struct MsgPort* port) { }
+struct MsgPort* FindPort(const char* name) { return NULL; }
+
+void PutMsg(struct MsgPort* port, struct Message* msg) {
+	msg->mn_Node.ln_Type = NT_MESSAGE;
+	AddTail(&port->mp_MsgList, &msg->mn_Node);
+}
+
+struct Message* GetMsg(struct MsgPort* port) { return (struct Message*)RemHead(&port->mp_MsgList); }
+
+struct Message* WaitPort(struct MsgPort* port) {
+	return (port->mp_MsgList.lh_Head->ln_Succ) ? (struct Message*)port->mp_MsgList.lh_Head : NULL;
+}
+
+void ReplyMsg(struct Message* msg) {
+	hostCounters.hc_Replies++;
+	msg->mn_Node.ln_Type = NT_REPLYMSG;
+	if (msg->mn_ReplyPort) AddTail(&msg->mn_ReplyPort->mp_MsgList, &msg->mn_Node);
+}
+
+struct Task* FindTask(const char* name) {
+	static struct Task task;
+	return name ? NULL : &task;
+}
+
+BYTE SetTaskPri(struct Task* task, LONG priority) { return 0; }
+void Signal(struct Task* task, ULONG signals) { }
+ULONG Wait(ULONG signals) { return signals; }
+ULONG SetSignal(ULONG newSignals, ULONG mask) { return 0; }
+BYTE AllocSignal(LONG signal) { return -1; }
+void FreeSignal(LONG signal) { }
+void Forbid(void) { }
+void Permit(void) { }
+void Disable(void) { }
+void Enable(void) { }
+APTR CreateIORequest(struct MsgPort* port, ULONG size) { return NULL; }
+void DeleteIORequest(APTR ioReq) { }
+BYTE OpenDevice(const char* name, ULONG unit, struct IORequest* ioReq, ULONG flags) { return IOERR_OPENFAIL; }
+void CloseDevice(struct IORequest* ioReq) { }
+
+// There's no SCSI bus, so everything sent to a device fails
+BYTE DoIO(struct IORequest* ioReq) { return ioReq->io_Error = HFERR_NoBoard; }
+void SendIO(struct IORequest* ioReq) { ioReq->io_Error = HFERR_NoBoard; }
+struct IORequest* CheckIO(struct IORequest* ioReq) { return ioReq; }
+BYTE WaitIO(struct IORequest* ioReq) { return ioReq->io_Error; }
+LONG AbortIO(struct IORequest* ioReq) { return 0; }
+
+// Only used for the debug log, which the benchmark leaves off. The format is copied as it is
+void RawDoFmt(STRPTR format, APTR data, void (*putChProc)(void), APTR putChData) { strcpy((char*)putChData, format); }
+
+BPTR Open(const char* name, LONG mode) { return 0; }
+LONG Close(BPTR file) { return 1; }
+LONG Read(BPTR file, APTR buffer, LONG length) { return -1; }
+LONG Write(BPTR file, const void* buffer, LONG length) { return -1; }
+LONG FWrite(BPTR file, const void* buffer, ULONG blockLength, ULONG blocks) { return 0; }
+LONG Seek(BPTR file, LONG position, LONG mode) { return -1; }
+LONG Flush(BPTR file) { return 1; }
+LONG FPuts(BPTR file, const char* string) { return -1; }
+char* FGets(BPTR file, char* buffer, ULONG length) { return NULL; }
+BPTR Output(void) { return 0; }
+LONG PutStr(const char* string) { return fputs(string, stdout) < 0; }
+LONG VPrintf(const char* format, APTR args) { return -1; }
+LONG Printf(const char* format, ...) { return -1; }
+
+void Delay(LONG ticks) {
+	hostCounters.hc_Delays++;
+	hostCounters.hc_DelayTicks += ticks;
+}
+
+LONG IoErr(void) { return 0; }
+LONG SetIoErr(LONG result) { return 0; }
+void CurrentDir(BPTR lock) { }
+struct RDArgs* ReadArgs(const char* templ, LONG* array, struct RDArgs* args) { return NULL; }
+void FreeArgs(struct RDArgs* args) { }
+struct Process* CreateNewProcTags(ULONG tag, ...) { return NULL; }
+BOOL StartNotify(struct NotifyRequest* notify) { return FALSE; }
+void EndNotify(struct NotifyRequest* notify) { }
+struct DosList* LockDosList(ULONG flags) { return NULL; }
+void UnLockDosList(ULONG flags) { }
+struct DosList* NextDosEntry(struct DosList* list, ULONG flags) { return NULL; }
+
+ULONG GetTagData(Tag tag, ULONG defaultValue, struct TagItem* tagList) {
+	struct TagItem* item = FindTagItem(tag, tagList);
+	return item ? item->ti_Data : defaultValue;
+}
+
+struct TagItem* FindTagItem(Tag tag, struct TagItem* tagList) {
+	for (; (tagList) && (tagList->ti_Tag != TAG_DONE); tagList++)
+		if (tagList->ti_Tag == tag) return tagList;
+	return NULL;
+}
+
+LONG Stricmp(const char* a, const char* b) { return strcasecmp(a, b); }
+LONG Strnicmp(const char* a, const char* b, LONG length) { return strncasecmp(a, b, length); }
+UBYTE ToUpper(ULONG c) { return toupper(c); }
+
+void GetSysTime(struct timeval* dest) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dest->tv_secs = now.tv_sec;
+	dest->tv_micro = now.tv_nsec / 1000;
+}
+
+// A 709379Hz EClock like a PAL machine's
+ULONG ReadEClock(struct EClockVal* dest) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ticks = ((uint64_t)now.tv_sec * 709379) + (((uint64_t)now.tv_nsec * 709379) / 1000000000);
+	dest->ev_hi = ticks >> 32;
+	dest->ev_lo = (ULONG)ticks;
+	return 709379;
+}
+
+ULONG CallHookPkt(struct Hook* hook, APTR object, APTR message) {
+	return ((ULONG (*)(struct Hook*, APTR, APTR))hook->h_Entry)(hook, object, message);
+}
@@ -0,0 +1,271 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Just enough of the AmigaOS includes to build the driver's packet code on a Linux host for scsidaynabench
+ *
+ * Every Amiga include the driver uses is generated by the Makefile as a one line file that includes this.
+ * Types have their Amiga sizes except for pointers, which are whatever the host uses.
+ */
+#ifndef BENCH_AMIGA_H
+#define BENCH_AMIGA_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// The host has its own struct timeval, which has to be seen first so it's left alone
+#define timeval AmigaTimeval
+
+// Stand in for compiler.h, the register parameters mean nothing here
+#define _INC_ASMINTERFACE_H
+#define ASM
+#define ASMR(x)
+#define ASMREG(x)
+#define SAVEDS
+#define INLINE static inline
+#define STRUCTOFFSET(_a_,_b_) offsetof(struct _a_, _b_)
+#define __saveds
+#define __reg(x)
+
+typedef uint8_t UBYTE;
+typedef int8_t BYTE;
+typedef uint16_t UWORD, USHORT;
+typedef int16_t WORD, SHORT;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef void* APTR;
+typedef int16_t BOOL;
+typedef int32_t BPTR;
+typedef int32_t BSTR;
+typedef char* STRPTR;
+typedef void VOID;
+typedef ULONG Tag;
+
+#define TRUE 1
+#define FALSE 0
+#define TAG_DONE 0
+#define TAG_END 0
+#define TAG_USER 0x80000000UL
+
+struct TagItem { Tag ti_Tag; ULONG ti_Data; };
+struct Node { struct Node *ln_Succ, *ln_Pred; UBYTE ln_Type; BYTE ln_Pri; char* ln_Name; };
+struct MinNode { struct MinNode *mln_Succ, *mln_Pred; };
+struct List { struct Node *lh_Head, *lh_Tail, *lh_TailPred; UBYTE lh_Type, l_pad; };
+struct MinList { struct MinNode *mlh_Head, *mlh_Tail, *mlh_TailPred; };
+struct Task { struct Node tc_Node; ULONG tc_SigAlloc; APTR tc_UserData; };
+struct MsgPort { struct Node mp_Node; UBYTE mp_Flags; UBYTE mp_SigBit; void* mp_SigTask; struct List mp_MsgList; };
+struct Message { struct Node mn_Node; struct MsgPort* mn_ReplyPort; UWORD mn_Length; };
+struct Library { struct Node lib_Node; UBYTE lib_Flags; UBYTE lib_pad; UWORD lib_NegSize, lib_PosSize, lib_Version, lib_Revision; APTR lib_IdString; ULONG lib_Sum; UWORD lib_OpenCnt; };
+struct Device { struct Library dd_Library; };
+struct Unit { struct MsgPort unit_MsgPort; UBYTE unit_flags; UBYTE unit_pad; UWORD unit_OpenCnt; };
+struct IORequest { struct Message io_Message; struct Device* io_Device; struct Unit* io_Unit; UWORD io_Command; UBYTE io_Flags; BYTE io_Error; };
+struct IOStdReq { struct Message io_Message; struct Device* io_Device; struct Unit* io_Unit; UWORD io_Command; UBYTE io_Flags; BYTE io_Error; ULONG io_Actual, io_Length; APTR io_Data; ULONG io_Offset; };
+struct SignalSemaphore { struct Node ss_Link; WORD ss_NestCount; struct MinList ss_WaitQueue; APTR ss_Owner; WORD ss_QueueCount; };
+struct Process { struct Task pr_Task; struct MsgPort pr_MsgPort; };
+struct ExecBase { struct Library LibNode; UWORD VBlankFrequency; UWORD PowerSupplyFrequency; ULONG ex_EClockFrequency; UWORD AttnFlags; };
+struct UtilityBase;
+struct DosBase;
+struct RDArgs;
+struct timeval { ULONG tv_secs, tv_micro; };
+struct EClockVal { ULONG ev_hi, ev_lo; };
+struct timerequest { struct IORequest tr_node; struct timeval tr_time; };
+struct Hook { struct MinNode h_MinNode; ULONG (*h_Entry)(); ULONG (*h_SubEntry)(); APTR h_Data; };
+struct SCSICmd { UWORD* scsi_Data; ULONG scsi_Length, scsi_Actual; UBYTE* scsi_Command; UWORD scsi_CmdLength, scsi_CmdActual; UBYTE scsi_Flags, scsi_Status; UBYTE* scsi_SenseData; UWORD scsi_SenseLength, scsi_SenseActual; };
+struct FileInfoBlock { LONG fib_DiskKey; char pad[300]; };
+struct NotifyRequest { UBYTE* nr_Name; UBYTE* nr_FullName; ULONG nr_UserData; ULONG nr_Flags; union { struct { struct MsgPort* nr_Port; } nr_Msg; struct { struct Task* nr_Task; UBYTE nr_SignalNum; } nr_Signal; } nr_stuff; };
+struct NotifyMessage { struct Message nm_ExecMessage; ULONG nm_Class; UWORD nm_Code; struct NotifyRequest* nm_NReq; };
+struct Resident { UWORD rt_MatchWord; struct Resident* rt_MatchTag; APTR rt_EndSkip; UBYTE rt_Flags, rt_Version, rt_Type; BYTE rt_Pri; char* rt_Name; char* rt_IdString; APTR rt_Init; };
+struct DosList { BPTR dol_Next; LONG dol_Type; struct MsgPort* dol_Task; BPTR dol_Lock; BSTR dol_Handler; LONG dol_StackSize; LONG dol_Priority; BPTR dol_Startup; BPTR dol_SegList; BPTR dol_GlobVec; BSTR dol_Name; };
+struct FileSysStartupMsg { ULONG fssm_Unit; BSTR fssm_Device; BPTR fssm_Environ; ULONG fssm_Flags; };
+struct DosEnvec { ULONG de_TableSize, de_SizeBlock, de_SecOrg, de_Surfaces, de_SectorPerBlock, de_BlocksPerTrack, de_Reserved, de_PreAlloc, de_Interleave, de_LowCyl, de_HighCyl, de_NumBuffers, de_BufMemType, de_MaxTransfer, de_Mask; };
+
+#define NRF_SEND_MESSAGE 1
+#define NRF_SEND_SIGNAL 2
+#define NRF_NOTIFY_INITIAL 16
+#define HD_SCSICMD 28
+#define SCSIF_READ 1
+#define SCSIF_WRITE 0
+#define SCSIF_AUTOSENSE 2
+#define CMD_INVALID 0
+#define CMD_RESET 1
+#define CMD_READ 2
+#define CMD_WRITE 3
+#define CMD_UPDATE 4
+#define CMD_CLEAR 5
+#define CMD_STOP 6
+#define CMD_START 7
+#define CMD_FLUSH 8
+#define CMD_NONSTD 9
+#define IOB_QUICK 0
+#define IOF_QUICK 1
+#define NT_DEVICE 3
+#define NT_MSGPORT 4
+#define NT_MESSAGE 5
+#define NT_REPLYMSG 7
+#define PA_SIGNAL 0
+#define LIBF_SUMMING 1
+#define LIBF_CHANGED 2
+#define LIBF_SUMUSED 4
+#define LIBF_DELEXP 8
+#define IOERR_OPENFAIL (-1)
+#define IOERR_ABORTED (-2)
+#define IOERR_NOCMD (-3)
+#define IOERR_BADLENGTH (-4)
+#define IOERR_BADADDRESS (-5)
+#define IOERR_UNITBUSY (-6)
+#define IOERR_SELFTEST (-7)
+#define HFERR_SelfUnit 40
+#define HFERR_DMA 41
+#define HFERR_Phase 42
+#define HFERR_Parity 43
+#define HFERR_SelTimeout 44
+#define HFERR_BadStatus 45
+#define HFERR_NoBoard 50
+#define MEMF_ANY 0
+#define MEMF_PUBLIC 1
+#define MEMF_CHIP 2
+#define MEMF_FAST 4
+#define MEMF_24BITDMA 0x200
+#define MEMF_CLEAR 0x10000
+#define MODE_OLDFILE 1005
+#define MODE_NEWFILE 1006
+#define OFFSET_BEGINNING (-1)
+#define OFFSET_END 1
+#define RETURN_OK 0
+#define RETURN_WARN 5
+#define RETURN_ERROR 10
+#define RETURN_FAIL 20
+#define SIGBREAKF_CTRL_C (1<<12)
+#define SIGBREAKF_CTRL_D (1<<13)
+#define SIGBREAKF_CTRL_E (1<<14)
+#define SIGBREAKF_CTRL_F (1<<15)
+#define UNIT_MICROHZ 0
+#define UNIT_VBLANK 1
+#define TR_ADDREQUEST 9
+#define NP_Entry (TAG_USER + 1)
+#define NP_Name (TAG_USER + 2)
+#define NP_Priority (TAG_USER + 3)
+#define NP_StackSize (TAG_USER + 4)
+#define DMA_Continue 1
+#define DMA_ReadFromRAM 2
+#define DMA_NoModify 4
+#define AFF_68040 8
+#define AFF_68060 128
+#define RTC_MATCHWORD 0x4AFC
+#define RTF_AUTOINIT 0x80
+#define DLT_DEVICE 0
+#define LDF_READ 1
+#define LDF_DEVICES 4
+#define DE_BUFMEMTYPE 12
+#define DE_MAXTRANSFER 13
+#define DE_MASK 14
+#define BADDR(x) ((APTR)((uintptr_t)(x) << 2))
+#define OFFSET(a,b) offsetof(struct a,b)
+#define INITBYTE(a,b) 0,0,0
+#define INITWORD(a,b) 0,0,0
+
+// exec.library
+APTR AllocVec(ULONG size, ULONG flags);
+void FreeVec(APTR memory);
+APTR AllocMem(ULONG size, ULONG flags);
+void FreeMem(APTR memory, ULONG size);
+ULONG AvailMem(ULONG flags);
+ULONG TypeOfMem(APTR address);
+void CopyMem(const void* source, void* dest, ULONG size);
+void CopyMemQuick(const void* source, void* dest, ULONG size);
+APTR CachePreDMA(APTR address, ULONG* length, ULONG flags);
+void CachePostDMA(APTR address, ULONG* length, ULONG flags);
+struct Library* OpenLibrary(const char* name, ULONG version);
+void CloseLibrary(void* library);
+void NewList(struct List* list);
+void AddHead(struct List* list, struct Node* node);
+void AddTail(struct List* list, struct Node* node);
+void Insert(struct List* list, struct Node* node, struct Node* pred);
+void Remove(struct Node* node);
+struct Node* RemHead(struct List* list);
+struct Node* RemTail(struct List* list);
+void InitSemaphore(struct SignalSemaphore* sem);
+void ObtainSemaphore(struct SignalSemaphore* sem);
+void ObtainSemaphoreShared(struct SignalSemaphore* sem);
+ULONG AttemptSemaphore(struct SignalSemaphore* sem);
+void ReleaseSemaphore(struct SignalSemaphore* sem);
+struct MsgPort* CreateMsgPort(void);
+void DeleteMsgPort(struct MsgPort* port);
+void AddPort(struct MsgPort* port);
+void RemPort(struct MsgPort* port);
+struct MsgPort* FindPort(const char* name);
+void PutMsg(struct MsgPort* port, struct Message* msg);
+struct Message* GetMsg(struct MsgPort* port);
+struct Message* WaitPort(struct MsgPort* port);
+void ReplyMsg(struct Message* msg);
+struct Task* FindTask(const char* name);
+BYTE SetTaskPri(struct Task* task, LONG priority);
+void Signal(struct Task* task, ULONG signals);
+ULONG Wait(ULONG signals);
+ULONG SetSignal(ULONG newSignals, ULONG mask);
+BYTE AllocSignal(LONG signal);
+void FreeSignal(LONG signal);
+void Forbid(void);
+void Permit(void);
+void Disable(void);
+void Enable(void);
+APTR CreateIORequest(struct MsgPort* port, ULONG size);
+void DeleteIORequest(APTR ioReq);
+BYTE OpenDevice(const char* name, ULONG unit, struct IORequest* ioReq, ULONG flags);
+void CloseDevice(struct IORequest* ioReq);
+BYTE DoIO(struct IORequest* ioReq);
+void SendIO(struct IORequest* ioReq);
+struct IORequest* CheckIO(struct IORequest* ioReq);
+BYTE WaitIO(struct IORequest* ioReq);
+LONG AbortIO(struct IORequest* ioReq);
+void RawDoFmt(STRPTR format, APTR data, void (*putChProc)(void), APTR putChData);
+
+// dos.library
+BPTR Open(const char* name, LONG mode);
+LONG Close(BPTR file);
+LONG Read(BPTR file, APTR buffer, LONG length);
+LONG Write(BPTR file, const void* buffer, LONG length);
+LONG FWrite(BPTR file, const void* buffer, ULONG blockLength, ULONG blocks);
+LONG Seek(BPTR file, LONG position, LONG mode);
+LONG Flush(BPTR file);
+LONG FPuts(BPTR file, const char* string);
+char* FGets(BPTR file, char* buffer, ULONG length);
+BPTR Output(void);
+LONG PutStr(const char* string);
+LONG VPrintf(const char* format, APTR args);
+LONG Printf(const char* format, ...);
+void Delay(LONG ticks);
+LONG IoErr(void);
+LONG SetIoErr(LONG result);
+void CurrentDir(BPTR lock);
+struct RDArgs* ReadArgs(const char* templ, LONG* array, struct RDArgs* args);
+void FreeArgs(struct RDArgs* args);
+struct Process* CreateNewProcTags(ULONG tag, ...);
+BOOL StartNotify(struct NotifyRequest* notify);
+void EndNotify(struct NotifyRequest* notify);
+struct DosList* LockDosList(ULONG flags);
+void UnLockDosList(ULONG flags);
+struct DosList* NextDosEntry(struct DosList* list, ULONG flags);
+
+// utility.library, timer.device and amiga.lib
+ULONG GetTagData(Tag tag, ULONG defaultValue, struct TagItem* tagList);
+struct TagItem* FindTagItem(Tag tag, struct TagItem* tagList);
+LONG Stricmp(const char* a, const char* b);
+LONG Strnicmp(const char* a, const char* b, LONG length);
+UBYTE ToUpper(ULONG c);
+void GetSysTime(struct timeval* dest);
+ULONG ReadEClock(struct EClockVal* dest);
+ULONG CallHookPkt(struct Hook* hook, APTR object, APTR message);
+
+// What the benchmark counts, see amiga.c
+struct HostCounters {
+	ULONG hc_Obtains;        // ObtainSemaphore calls
+	ULONG hc_Replies;        // ReplyMsg calls
+	ULONG hc_Delays;         // Delay calls, each is a tick the real driver would have slept
+	ULONG hc_DelayTicks;
+};
+extern struct HostCounters hostCounters;
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Packet capture to a pcap file
+ *
+ * The scheduler copies frames into a ring with Capture_frame and a low priority task writes
+ * them out. There's only one writer and one reader of the ring, so it doesn't need locking,
+ * and if the file can't keep up frames are dropped rather than holding up the scheduler.
+ */
+
+#include <proto/exec.h>
+#include <exec/execbase.h>
+#include <proto/dos.h>
+#include <dos/dostags.h>
+#include <devices/timer.h>
+#include <proto/timer.h>
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <string.h>
+#include "macros.h"
+#include "debug.h"
+#include "capture.h"
+
+#define CAPTURE_RING_MASK  (CAPTURE_RING_SIZE - 1)
+
+// How often the writer task empties the ring, in ticks
+#define CAPTURE_WRITE_DELAY  5
+
+// Seconds between the Amiga epoch (1978) and the Unix one (1970)
+#define AMIGA_UNIX_EPOCH_OFFSET  252460800UL
+
+// pcap file header, we write it in 68k byte order and the magic number tells readers which that is
+struct PcapFileHeader {
+	ULONG magic;
+	UWORD versionMajor;
+	UWORD versionMinor;
+	LONG  thisZone;
+	ULONG sigFigs;
+	ULONG snapLen;
+	ULONG network;
+};
+
+// pcap header in front of each frame
+struct PcapRecordHeader {
+	ULONG tsSecs;
+	ULONG tsMicros;
+	ULONG capturedLength;
+	ULONG originalLength;
+};
+
+// Header in front of each frame in the ring. Records are kept 4 byte aligned, and a size of 0 means skip to the start of the ring
+struct CaptureRecord {
+	USHORT cr_Size;            // Whole record including this header
+	USHORT cr_Length;          // Frame size
+	struct EClockVal cr_Time;
+};
+
+// Internal capture data
+struct Capture {
+	struct ExecBase *cp_SysBase;
+	struct DosBase *cp_dosBase;
+	struct Library *cp_timerBase;
+	BPTR cp_File;
+	UBYTE* cp_Ring;
+	volatile ULONG cp_Head;             // Only changed by Capture_frame, both of these just keep counting up
+	volatile ULONG cp_Tail;             // Only changed by the writer task
+	volatile ULONG cp_Captured;
+	volatile ULONG cp_Dropped;
+	struct timeval cp_BaseTime;         // System time when cp_BaseEClock was read
+	struct EClockVal cp_BaseEClock;
+	ULONG cp_EFreq;
+	struct Process* cp_Proc;
+	struct SignalSemaphore cp_ProcSem;  // Held by the writer task for its entire lifetime
+};
+
+struct CaptureInit {
+	struct Message msg;
+	struct Capture* cap;
+};
+
+#define SysBase cap->cp_SysBase
+#define DOSBase cap->cp_dosBase
+#define TimerBase cap->cp_timerBase
+
+// 32x32 bit multiply with a 64 bit result, only using 16 bit multiplies as VBCC won't give us the helpers
+static void mul32(ULONG a, ULONG b, ULONG* hi, ULONG* lo) {
+	ULONG mid;
+	*lo = (ULONG)(UWORD)a * (UWORD)b;
+	*hi = (ULONG)(UWORD)(a >> 16) * (UWORD)(b >> 16);
+
+	mid = (ULONG)(UWORD)(a >> 16) * (UWORD)b;
+	*hi += mid >> 16;
+	mid <<= 16;
+	*lo += mid;
+	if (*lo < mid) (*hi)++;
+
+	mid = (ULONG)(UWORD)a * (UWORD)(b >> 16);
+	*hi += mid >> 16;
+	mid <<= 16;
+	*lo += mid;
+	if (*lo < mid) (*hi)++;
+}
+
+// Divides hi:lo by divisor a bit at a time, hi must be less than divisor. Couldn't get __ldivu either!
+static ULONG div64(ULONG hi, ULONG lo, ULONG divisor, ULONG* remainder) {
+	ULONG quotient = 0;
+	for (USHORT bit=0; bit<32; bit++) {
+		ULONG carry = hi & 0x80000000UL;
+		hi = (hi << 1) | (lo >> 31);
+		lo <<= 1;
+		quotient <<= 1;
+		if ((carry) || (hi >= divisor)) {
+			hi -= divisor;
+			quotient |= 1;
+		}
+	}
+	*remainder = hi;
+	return quotient;
+}
+
+// Converts an EClock reading into Unix time for the pcap file
+static void eclockToTime(struct Capture* cap, struct EClockVal* time, ULONG* secs, ULONG* micros) {
+	ULONG lo = time->ev_lo - cap->cp_BaseEClock.ev_lo;
+	ULONG hi = time->ev_hi - cap->cp_BaseEClock.ev_hi;
+	ULONG ticks, mhi, mlo;
+	if (time->ev_lo < cap->cp_BaseEClock.ev_lo) hi--;
+
+	*secs = div64(hi, lo, cap->cp_EFreq, &ticks);
+	mul32(ticks, 1000000UL, &mhi, &mlo);
+	*micros = div64(mhi, mlo, cap->cp_EFreq, &ticks) + cap->cp_BaseTime.tv_micro;
+	if (*micros >= 1000000UL) {
+		*micros -= 1000000UL;
+		(*secs)++;
+	}
+	*secs += cap->cp_BaseTime.tv_secs + AMIGA_UNIX_EPOCH_OFFSET;
+}
+
+// Writes everything currently in the ring to the file
+static void captureDrain(struct Capture* cap) {
+	ULONG tail = cap->cp_Tail;
+	ULONG written = 0;
+
+	while (tail != cap->cp_Head) {
+		ULONG pos = tail & CAPTURE_RING_MASK;
+		struct CaptureRecord* record = (struct CaptureRecord*)&cap->cp_Ring[pos];
+
+		if (record->cr_Size == 0) {
+			tail += CAPTURE_RING_SIZE - pos;
+		} else {
+			struct PcapRecordHeader header;
+			eclockToTime(cap, &record->cr_Time, &header.tsSecs, &header.tsMicros);
+			header.capturedLength = header.originalLength = record->cr_Length;
+			FWrite(cap->cp_File, &header, sizeof(header), 1);
+			FWrite(cap->cp_File, (UBYTE*)record + sizeof(struct CaptureRecord), record->cr_Length, 1);
+			tail += record->cr_Size;
+			written = 1;
+		}
+		cap->cp_Tail = tail;
+	}
+	if (written) Flush(cap->cp_File);
+}
+
+// The writer task
+__saveds void capture_proc() {
+	struct Capture* capture;
+	{
+		struct { struct ExecBase *cp_SysBase; } *cap = (void*)0x4;
+		struct Process* proc = (struct Process*)FindTask(NULL);
+		WaitPort(&proc->pr_MsgPort);
+		struct CaptureInit* init = (struct CaptureInit*)GetMsg(&proc->pr_MsgPort);
+		capture = init->cap;
+		// Held until we exit so Capture_close can wait for us
+		ObtainSemaphore(&capture->cp_ProcSem);
+		ReplyMsg((struct Message*)init);
+	}
+	struct Capture* cap = capture;
+
+	ULONG sigs = 0;
+	while (!(sigs & SIGBREAKF_CTRL_C)) {
+		captureDrain(cap);
+		Delay(CAPTURE_WRITE_DELAY);
+		sigs = SetSignal(0, SIGBREAKF_CTRL_C);
+	}
+	// Write out whatever was left
+	captureDrain(cap);
+
+	Forbid();
+	ReleaseSemaphore(&cap->cp_ProcSem);
+}
+
+// Stops the writer task and frees everything
+static void _Capture_close(struct Capture* cap) {
+	if (cap->cp_Proc) {
+		Signal((struct Task*)cap->cp_Proc, SIGBREAKF_CTRL_C);
+		// Wait for it to finish writing
+		ObtainSemaphore(&cap->cp_ProcSem);
+		ReleaseSemaphore(&cap->cp_ProcSem);
+		cap->cp_Proc = NULL;
+	}
+	if (cap->cp_File) Close(cap->cp_File);
+	if (cap->cp_Ring) FreeVec(cap->cp_Ring);
+	FreeVec(cap);
+}
+
+// Creates the pcap file and starts the writer task. Returns NULL if it failed
+CAPTUREHandle Capture_open(struct Capture_OpenData* openData) {
+	struct Capture* cap;
+	{
+		struct Capture capTmp;
+		cap = &capTmp;
+		cap->cp_SysBase = openData->sysBase;
+		// cap->cp_SysBase needs to be defined here for this to work!
+		cap = (struct Capture*)AllocVec(sizeof(struct Capture), MEMF_PUBLIC|MEMF_CLEAR);
+	}
+	if (!cap) return NULL;
+
+	cap->cp_SysBase = openData->sysBase;
+	cap->cp_dosBase = openData->dosBase;
+	cap->cp_timerBase = openData->timerBase;
+	InitSemaphore(&cap->cp_ProcSem);
+
+	cap->cp_Ring = (UBYTE*)AllocVec(CAPTURE_RING_SIZE, MEMF_PUBLIC);
+	if (!cap->cp_Ring) {
+		_Capture_close(cap);
+		return NULL;
+	}
+
+	cap->cp_File = Open(openData->fileName, MODE_NEWFILE);
+	if (!cap->cp_File) {
+		_Capture_close(cap);
+		return NULL;
+	}
+
+	struct PcapFileHeader header;
+	header.magic = 0xA1B2C3D4UL;
+	header.versionMajor = 2;
+	header.versionMinor = 4;
+	header.thisZone = 0;
+	header.sigFigs = 0;
+	header.snapLen = 65535;
+	header.network = 1;   // Ethernet
+	if (Write(cap->cp_File, &header, sizeof(header)) != sizeof(header)) {
+		_Capture_close(cap);
+		return NULL;
+	}
+
+	// Timestamps are EClock ticks from here
+	GetSysTime(&cap->cp_BaseTime);
+	cap->cp_EFreq = ReadEClock(&cap->cp_BaseEClock);
+
+	struct MsgPort *port = CreateMsgPort();
+	if (!port) {
+		_Capture_close(cap);
+		return NULL;
+	}
+	cap->cp_Proc = CreateNewProcTags(NP_Entry, capture_proc, NP_Name, openData->procName, NP_Priority, CAPTURE_TASK_PRIORITY, TAG_DONE);
+	if (cap->cp_Proc) {
+		struct CaptureInit init;
+		init.cap = cap;
+		init.msg.mn_Length = sizeof(init);
+		init.msg.mn_ReplyPort = port;
+		PutMsg(&cap->cp_Proc->pr_MsgPort, (struct Message*)&init);
+		WaitPort(port);
+	}
+	DeleteMsgPort(port);
+	if (!cap->cp_Proc) {
+		_Capture_close(cap);
+		return NULL;
+	}
+
+	return (CAPTUREHandle)cap;
+}
+
+// Stops the writer task once everything in the ring has been written, and closes the file
+void Capture_close(CAPTUREHandle capture) {
+	if (!capture) return;
+	_Capture_close((struct Capture*)capture);
+}
+
+// Copies a frame in two parts into the ring along with an EClock timestamp. Never waits - if the ring is full the frame is dropped and counted
+void Capture_framePrefixed(CAPTUREHandle capture, const UBYTE* prefix, USHORT prefixSize, const UBYTE* frame, USHORT frameSize) {
+	struct Capture* cap = (struct Capture*)capture;
+	ULONG head = cap->cp_Head;
+	ULONG pos = head & CAPTURE_RING_MASK;
+	ULONG toEnd = CAPTURE_RING_SIZE - pos;
+	ULONG size = (sizeof(struct CaptureRecord) + prefixSize + frameSize + 3) & ~3UL;
+	ULONG needed = size;
+
+	// Records never wrap, the rest of the ring is skipped instead
+	if (toEnd < size) needed += toEnd;
+	if ((head - cap->cp_Tail) + needed > CAPTURE_RING_SIZE) {
+		cap->cp_Dropped++;
+		return;
+	}
+	if (toEnd < size) {
+		((struct CaptureRecord*)&cap->cp_Ring[pos])->cr_Size = 0;
+		head += toEnd;
+		pos = 0;
+	}
+
+	struct CaptureRecord* record = (struct CaptureRecord*)&cap->cp_Ring[pos];
+	UBYTE* data = (UBYTE*)record + sizeof(struct CaptureRecord);
+	record->cr_Size = size;
+	record->cr_Length = prefixSize + frameSize;
+	ReadEClock(&record->cr_Time);
+	if (prefixSize) CopyMem((APTR)prefix, data, prefixSize);
+	CopyMem((APTR)frame, data + prefixSize, frameSize);
+
+	// Publish it to the writer
+	cap->cp_Head = head + size;
+	cap->cp_Captured++;
+}
+
+// Copies a frame into the ring along with an EClock timestamp
+void Capture_frame(CAPTUREHandle capture, const UBYTE* frame, USHORT frameSize) {
+	Capture_framePrefixed(capture, NULL, 0, frame, frameSize);
+}
+
+// Fetch how many frames have been captured and how many were dropped because the ring was full
+void Capture_stats(CAPTUREHandle capture, ULONG* captured, ULONG* dropped) {
+	struct Capture* cap = (struct Capture*)capture;
+	*captured = cap->cp_Captured;
+	*dropped = cap->cp_Dropped;
+}
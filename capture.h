@@ -0,0 +1,48 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Packet capture to a pcap file
+ *
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H 1
+
+#include "compiler.h"
+#include <exec/types.h>
+#include <exec/libraries.h>
+
+// Size of the ring the scheduler copies frames into. Must be a power of 2
+#define CAPTURE_RING_SIZE  (256UL * 1024UL)
+
+// Priority of the task that writes the ring out to the file, below the scheduler so it never slows it down
+#define CAPTURE_TASK_PRIORITY  -5
+
+// Capture handle - yeah you don't need to know what's inside
+typedef void* CAPTUREHandle;
+
+// Needs completing to start a capture
+struct Capture_OpenData {
+    struct ExecBase *sysBase;            // Library needs these
+    struct DosBase *dosBase;
+    struct Library *timerBase;           // from an open timer.device, for the EClock
+
+    char* fileName;                     // pcap file to create
+    char* procName;                     // Name for the writer task
+};
+
+// Creates the pcap file and starts the writer task. Returns NULL if it failed
+CAPTUREHandle Capture_open(struct Capture_OpenData* openData);
+
+// Stops the writer task once everything in the ring has been written, and closes the file
+void Capture_close(CAPTUREHandle capture);
+
+// Copies a frame into the ring along with an EClock timestamp. Never waits - if the ring is full the frame is dropped and counted.
+// Only ever call this from one task (the scheduler)
+void Capture_frame(CAPTUREHandle capture, const UBYTE* frame, USHORT frameSize);
+
+// As above, but the frame is in two parts, eg: a rebuilt header followed by the rest of the frame
+void Capture_framePrefixed(CAPTUREHandle capture, const UBYTE* prefix, USHORT prefixSize, const UBYTE* frame, USHORT frameSize);
+
+// Fetch how many frames have been captured and how many were dropped because the ring was full
+void Capture_stats(CAPTUREHandle capture, ULONG* captured, ULONG* dropped);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Control port messages, for programs that change settings while a unit is running
+ *
+ */
+#ifndef CONTROL_H
+#define CONTROL_H 1
+
+#include <exec/types.h>
+#include <exec/ports.h>
+
+/* Each open unit has a public message port for reading and changing its settings while it's running. Unit 0's is
+   called SCSIDAYNA_CONTROL_PORT, the others have the unit number on the end, eg: scsidayna.control.1 */
+#define SCSIDAYNA_CONTROL_PORT     "scsidayna.control"
+#define SCSIDAYNA_CTRL_GET         0
+#define SCSIDAYNA_CTRL_SET         1
+#define SCSIDAYNA_CTRL_PROFILE     2    /* Copy the profile (struct ScsiDaynaProfile) to sc_Data, and clear it if sc_Value isn't 0. Only in profile builds */
+
+/* Settings the control port can change, named as in the prefs file */
+#define SCSIDAYNA_SET_PRIORITY     0
+#define SCSIDAYNA_SET_DATASIZE     1
+#define SCSIDAYNA_SET_DEBUG        2
+#define SCSIDAYNA_SET_RXQUANTUM    3
+#define SCSIDAYNA_SET_TXQUANTUM    4
+#define SCSIDAYNA_SET_TXPRIORITY   5
+#define SCSIDAYNA_SET_ACKTHIN      6
+#define SCSIDAYNA_SET_BCASTFILTER  7
+#define SCSIDAYNA_SET_BCASTRATE    8
+
+/* Sent to the control port. Changes are applied by the unit's task between packet cycles, and last until the device is
+   expunged or the prefs file changes */
+struct ScsiDaynaControl {
+	struct Message sc_Msg;
+	UWORD sc_Command;          // SCSIDAYNA_CTRL_*
+	UWORD sc_Setting;          // SCSIDAYNA_SET_*
+	LONG sc_Value;             // The new value, and the current value on reply
+	LONG sc_Error;             // S2ERR_* code on reply
+	APTR sc_Data;              // Buffer for SCSIDAYNA_CTRL_PROFILE
+	ULONG sc_DataLength;
+};
+
+#endif
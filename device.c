@@ -24,6 +24,7 @@
 #include <proto/timer.h>
 #include <exec/types.h>
 #include <dos/dostags.h>
+#include <dos/notify.h>
 #include <exec/ports.h>
 #include <utility/tagitem.h>
 #include <exec/lists.h>
@@ -32,6 +33,8 @@
 #include <proto/utility.h>
 #include <exec/execbase.h>
 #include "scsiwifi.h"
+#include "capture.h"
+#include "profile.h"
 #include <stdlib.h>
 #include <string.h>
 #include "debug.h"
@@ -46,7 +49,8 @@
 #include "device.h"
 #include "macros.h"
 
-const UWORD dev_supportedcmds[] = { NSCMD_DEVICEQUERY, CMD_READ, CMD_WRITE, /*S2_SANA2HOOK, */S2_GETGLOBALSTATS, S2_BROADCAST, CMD_WRITE, S2_ONEVENT, S2_READORPHAN, S2_ONLINE, S2_OFFLINE, S2_GETSTATIONADDRESS, S2_DEVICEQUERY, S2_GETSPECIALSTATS, 0 };
+const UWORD dev_supportedcmds[] = { NSCMD_DEVICEQUERY, CMD_READ, CMD_WRITE, /*S2_SANA2HOOK, */S2_GETGLOBALSTATS, S2_BROADCAST, CMD_WRITE, S2_ONEVENT, S2_READORPHAN, S2_ONLINE, S2_OFFLINE, S2_GETSTATIONADDRESS, S2_DEVICEQUERY, S2_GETSPECIALSTATS, 
+	S2_SCSIDAYNA_WIFISCAN, S2_SCSIDAYNA_SCANRESULTS, S2_SCSIDAYNA_JOINNETWORK, S2_SCSIDAYNA_GETNETWORK, 0 };
 
 
 #include <proto/exec.h>
@@ -57,11 +61,123 @@ const UWORD dev_supportedcmds[] = { NSCMD_DEVICEQUERY, CMD_READ, CMD_WRITE, /*S2
 __saveds void frame_proc();
 char *frame_proc_name = "AmigaNetPacketScheduler";
 
-static UBYTE HW_MAC[] = {0x00,0x00,0x00,0x00,0x00,0x00};
+// Returned by read_frame and receivePacket when the opener's S2_PacketFilter rejected the frame
+#define RECV_FILTERED 2
+
+// How many times a failed batch send is retried, waiting 1, 2 then 4 ticks
+#define TX_RETRIES 3
+
+// Driver specific records returned by S2_GETSPECIALSTATS
+#define NUM_SPECIAL_STATS 9
+const ULONG specialStatTypes[NUM_SPECIAL_STATS] = { S2SS_SCSIDAYNA_ACKSTHINNED, S2SS_SCSIDAYNA_ARPREPLIES, S2SS_SCSIDAYNA_ARPDROPPED, S2SS_SCSIDAYNA_ARPFILTERED, S2SS_SCSIDAYNA_BCASTLIMITED,
+	S2SS_SCSIDAYNA_TXERRORS, S2SS_SCSIDAYNA_TXRETRIES, S2SS_SCSIDAYNA_TXQUEUEFULL, S2SS_SCSIDAYNA_TXDELAYDROP };
+char* specialStatNames[NUM_SPECIAL_STATS] = { "ACKs thinned", "ARP requests answered by the adapter", "ARP requests for other hosts dropped by the adapter",
+	"ARP requests for other hosts dropped", "Broadcasts dropped by the rate limit", "Batch send errors", "Batch send retries",
+	"Writes refused because the send queue was full", "Writes dropped because the send queue was slow" };
+
+// Queued writes are stamped with the EClock in their node name, which nothing else uses while they're queued
+#define TXQ_STAMP(ior) (*(ULONG*)&(ior)->ios2_Req.io_Message.mn_Node.ln_Name)
+// Bytes a queued write will send
+#define TXQ_SIZE(ior) ((ior)->ios2_DataLength + (((ior)->ios2_Req.io_Flags & SANA2IOF_RAW) ? 0 : HW_ETH_HDR_SIZE))
+
+// Lowest and highest values the control port accepts for each SCSIDAYNA_SET_* setting. A reloaded prefs file is clamped to them
+#define NUM_CONTROL_SETTINGS 9
+const LONG controlMin[NUM_CONTROL_SETTINGS] = { -128, SCSIWIFI_PACKET_MAX_SIZE + 4, 0, SCSIWIFI_PACKET_MAX_SIZE, SCSIWIFI_PACKET_MAX_SIZE, 0, 0, 0, 0 };
+const LONG controlMax[NUM_CONTROL_SETTINGS] = { 127, 0x7FFFFFFF, 255, 65535, 65535, TXPRIORITY_ARP|TXPRIORITY_ICMP|TXPRIORITY_ACK|TXPRIORITY_DNS, 1, 1, 65535 };
+
+// Packet buffers start and end on a 68040/68060 cache line, so flushing them never touches anything else
+#define DMA_BUFFER_ALIGN 16
+
+// Bytes of a packet looked at to find its flow (ethernet + IPv6 headers + the largest TCP header)
+#define FLOW_PEEK_SIZE 128
+
+// Classification of a queued write, cached in its ln_Pri by classifyPacket
+#define TXCLASS_DONE      0x80     // Has been classified
+#define TXCLASS_PRIORITY  0x40     // Goes in the priority queue
+#define TXCLASS_PUREACK   0x20     // TCP segment with only the ACK flag set and no data
+#define TXCLASS_HASHMASK  0x1F     // Flow hash, 0 for anything that isn't IP
+
+// A batch of packets being built for sending to one target in AmigaNET mode
+struct TxBatch {
+	UBYTE* tb_Data;                      // 2 bytes header at the front
+	UBYTE* tb_DataOut;
+	ULONG tb_SpaceRemaining;
+	USHORT tb_Count;
+	USHORT tb_MaxCount;
+	struct IOSana2Req** tb_PendingSends;    // if NULL requests are completed as soon as they're copied
+	struct IOSana2Req** tb_PendingSendsSave;
+	UBYTE tb_Full;
+};
+
+// An empty receive normally takes about the same time, so one that takes much longer had to wait for the controller,
+// which on a shared bus means the disk was busy
+struct BusShare {
+	ULONG bs_Baseline;      // EClock ticks of the quickest empty receive lately
+	ULONG bs_Margin;        // Extra ticks allowed before a receive counts as having waited, about 1ms
+	ULONG bs_Wait;          // Microseconds to wait between idle polls, doubling while the disk stays busy
+	ULONG bs_MaxWait;       // BUSSHARE in microseconds
+	UBYTE bs_Score;         // Goes up when receives wait and down when they don't
+	UBYTE bs_Busy;          // Set while the disk looks busy
+};
+
+#define BUS_SCORE_WAITED    4       // Added to the score by a receive that waited
+#define BUS_SCORE_BUSY      8       // Score where the disk counts as busy, it stops being busy when it's back to 0
+#define BUS_SCORE_MAX       16
+#define BUS_BUSY_BATCH      4096    // Largest batch while the disk is busy, so each of our commands holds the bus for less
+#define BUS_FIRST_WAIT      20000   // One vblank
+
+#define CODEL_INTERVAL      100     // ms
+#define CODEL_GAPS          16
+
+// CoDel (controlled delay) on the send queue. Once the oldest write has been waiting longer than the target for a
+// whole interval, it's dropped, then more are dropped closer and closer together until the wait is back under the
+// target. TCP slows down when its packets go missing, so the queue stays short without cutting bulk transfers
+struct CoDel {
+	ULONG cd_Target;        // EClock ticks a write can wait, from TXQDELAY. 0 if CoDel is off
+	ULONG cd_Interval;      // EClock ticks the wait has to stay over the target before dropping starts
+	ULONG cd_FirstAbove;    // When dropping starts if the wait stays over the target
+	ULONG cd_DropNext;      // When the next write is dropped
+	ULONG cd_Gaps[CODEL_GAPS]; // Time between drops, the interval divided by the square root of the drop count
+	USHORT cd_Count;        // Writes dropped since dropping started
+	USHORT cd_LastCount;    // cd_Count when dropping last started
+	UBYTE cd_Above;         // Set while the wait is over the target
+	UBYTE cd_Dropping;      // Set while writes are being dropped
+};
+
+// 65536/sqrt(n) for n = 1 to CODEL_GAPS, as there's no divide or square root to work them out with
+const USHORT codelInvSqrt[CODEL_GAPS] = { 65535, 46341, 37837, 32768, 29309, 26755, 24770, 23170, 21845, 20724, 19760, 18919, 18176, 17515, 16921, 16384 };
+
+// Free space in a target's transmit queue, from the last received batch header
+struct TxCredit {
+	USHORT tc_Slots;       // Packets
+	ULONG tc_Bytes;        // Bytes of batch data, 24 bits so batches over 64KB aren't held back
+};
+
+// How often a running Wifi scan is checked on, and when it's given up on, in 1/16ths of a second
+#define WIFI_SCAN_POLL      4
+#define WIFI_SCAN_TIMEOUT   (20 * 16)
+
+// The Wifi status is checked this often just after a join or the link changing, doubling up to the normal interval
+// as it stays the same. AUTOCONNECT joins again after the link has been down for WIFI_REJOIN. All in 1/16ths of a second
+#define WIFI_POLL_FAST      4
+#define WIFI_POLL_NORMAL    (5 * 16)
+#define WIFI_REJOIN         (15 * 16)
+
+// Last Wifi management results, kept by the unit's task so repeated queries don't need the SCSI bus
+struct WifiCache {
+	struct SCSIWifi_ScanResults wc_Scan;
+	struct SCSIWifi_NetworkEntry wc_Network;
+	UBYTE wc_ScanValid;
+	UBYTE wc_NetworkValid;
+	UBYTE wc_Scanning;          // Set while the firmware is scanning, only used by the unit's task
+	ULONG wc_ScanStarted;       // When the scan was started, in 1/16ths of a second
+	ULONG wc_ScanPolled;        // When it was last checked on
+};
 
 struct ProcInit {
    struct Message msg;
    struct devbase *db;
+   struct devunit *du;
    BOOL  error;
    UBYTE pad[2];
 };
@@ -80,6 +196,71 @@ void freeInit(DEVBASEP) {
 
 void DevTermIO( DEVBASEP, struct IORequest *ioreq );
 
+// Returns TRUE if the firmware receive filter is letting this packet type through
+BOOL filterPasses(DEVUNITP, ULONG packetType) {
+	for (USHORT i=0; i<du->du_FilterCount; i++)
+		if (du->du_FilterTypes[i] == packetType) return TRUE;
+	return FALSE;
+}
+
+// Fails and replies everything in the list, or only the requests belonging to bm if it's not NULL. The caller must hold the list's semaphore
+void rejectList(DEVBASEP, struct List* list, struct BufferManagement* bm, BYTE error, ULONG wireError) {
+	struct IOSana2Req *ior, *next;
+	for (ior = (struct IOSana2Req *)list->lh_Head; next = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = next) {
+		if ((bm) && (ior->ios2_BufferManagement != bm)) continue;
+		ior->ios2_Req.io_Error = error;
+		ior->ios2_WireError = wireError;
+		Remove((struct Node*)ior);
+		DevTermIO(db, (struct IORequest*)ior);
+	}
+}
+
+// Takes a write that has just been removed from du_WriteList off the queue totals. Call with du_WriteListSem held
+void txDequeued(DEVUNITP, struct IOSana2Req* ior) {
+	du->du_TxQueued--;
+	du->du_TxQueuedBytes -= TXQ_SIZE(ior);
+}
+
+// Counts the queue totals again, after writes were taken off it without txDequeued. Call with du_WriteListSem held
+void txRecount(DEVUNITP) {
+	du->du_TxQueued = 0;
+	du->du_TxQueuedBytes = 0;
+	for (struct IOSana2Req *ior = (struct IOSana2Req *)du->du_WriteList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
+		du->du_TxQueued++;
+		du->du_TxQueuedBytes += TXQ_SIZE(ior);
+	}
+}
+
+// Removes node from list if it's on it, returning FALSE if it wasn't. Call with the list's semaphore held
+BOOL removeIfQueued(struct List* list, struct Node* node) {
+	struct Node* queued;
+	for (queued = list->lh_Head; queued->ln_Succ; queued = queued->ln_Succ) {
+		if (queued == node) {
+			Remove(node);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// Copies the cached answer to a Wifi management request, returns FALSE if there isn't one. The caller must hold du_WifiListSem
+BOOL copyWifiResult(struct WifiCache* cache, struct IOSana2Req* ior) {
+	switch (ior->ios2_Req.io_Command) {
+		case S2_SCSIDAYNA_WIFISCAN:
+			if (!ior->ios2_StatData) return TRUE;
+			// fall through
+		case S2_SCSIDAYNA_SCANRESULTS:
+			if (!cache->wc_ScanValid) return FALSE;
+			memcpy(ior->ios2_StatData, &cache->wc_Scan, sizeof(struct SCSIWifi_ScanResults));
+			return TRUE;
+		case S2_SCSIDAYNA_GETNETWORK:
+			if (!cache->wc_NetworkValid) return FALSE;
+			memcpy(ior->ios2_StatData, &cache->wc_Network, sizeof(struct SCSIWifi_NetworkEntry));
+			return TRUE;
+	}
+	return FALSE;
+}
+
 // Simple logging to console window
 void logMessage(struct devbase* db, const char *message) {
 	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)db->db_scsiSettings;
@@ -104,6 +285,35 @@ void logMessagef(struct devbase* db, const char *messageFormat, ...) {
 	logMessage(db, buf);
 }
 
+// Logs the configuration a unit will use
+void logSettings(DEVBASEP, DEVUNITP) {
+	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)du->du_scsiSettings;
+	if (!((struct ScsiDaynaSettings*)db->db_scsiSettings)->debug) return;
+	logMessagef(db, "Loaded Configuration (Unit %ld):", du->du_UnitNum);
+	logMessagef(db, "	SCSI Device: %s", settings->deviceName);
+	if ((settings->deviceID<0) || (settings->deviceID>7)) logMessage(db, "	Unit ID: Auto Detect"); else logMessagef(db, "	Unit ID: %ld", settings->deviceID);
+	logMessagef(db, "	Priority: %ld", settings->taskPriority);
+	logMessagef(db, "	Max Transfer Size: %ld", settings->maxDataSize);
+	logMessagef(db, "	Mode: %ld", settings->scsiMode);
+	if ((settings->bondDeviceID >= 0) && (settings->bondDeviceID <= 7)) logMessagef(db, "	Bonded With Unit ID: %ld", settings->bondDeviceID);
+	if (settings->captureFile[0]) logMessagef(db, "	Capture To: %s", settings->captureFile);
+	logMessagef(db, "	Receive Filter: %s", settings->recvFilter ? "On" : "Off");
+	logMessagef(db, "	Receive/Send Quantum: %ld/%ld", settings->rxQuantum, settings->txQuantum);
+	logMessagef(db, "	Send Priority: %ld", settings->txPriority);
+	logMessagef(db, "	ACK Thinning: %s", settings->ackThin ? "On" : "Off");
+	logMessagef(db, "	ARP Offload: %s", settings->arpOffload ? "On" : "Off");
+	logMessagef(db, "	Broadcast Filter: %s, Rate Limit: %ld/sec", settings->bcastFilter ? "On" : "Off", settings->bcastRate);
+	if (settings->busShare) logMessagef(db, "	Bus Sharing: Up to %ldms", settings->busShare); else logMessage(db, "	Bus Sharing: Off");
+	logMessagef(db, "	Send Queue: %ld writes, %ld bytes, %ldms wait target", settings->txQueuePackets, settings->txQueueBytes, settings->txQueueDelay);
+	if (settings->autoConnect) {
+		logMessagef(db, "	Auto Connect Wifi: Yes");
+		logMessagef(db, "	SSID: %s", settings->ssid);
+		logMessagef(db, "	Key: %s", settings->key);
+	} else {
+		logMessagef(db, "	Auto Connect Wifi: No");
+	}
+}
+
 // Simple device init that saves all the real errors until later
 __saveds struct Device *DevInit( ASMR(d0) DEVBASEP ASMREG(d0), ASMR(a0) BPTR seglist ASMREG(a0), ASMR(a6) struct Library *_SysBase  ASMREG(a6) ) {	
 	db->db_SysBase = _SysBase;
@@ -111,10 +321,8 @@ __saveds struct Device *DevInit( ASMR(d0) DEVBASEP ASMREG(d0), ASMR(a0) BPTR seg
 	db->db_DOSBase = NULL;
 	db->db_UtilityBase = NULL;
 	db->db_scsiSettings = NULL;
-	db->db_online = 0;
 	db->db_decrementCountOnFail = 0;
 	db->db_debugConsole = 0;
-	db->db_amigaNetMode = 0;
   
 	DOSBase = OpenLibrary("dos.library", 36);
 	if (!DOSBase) {
@@ -129,8 +337,8 @@ __saveds struct Device *DevInit( ASMR(d0) DEVBASEP ASMREG(d0), ASMR(a0) BPTR seg
 		return 0;
 	}
 
-	// Load in the settings.  Theres a few
-	db->db_scsiSettings = AllocVec(sizeof(struct ScsiDaynaSettings),MEMF_CLEAR);
+	// Load in the settings.  Theres a few, and one set per unit
+	db->db_scsiSettings = AllocVec(sizeof(struct ScsiDaynaSettings) * SCSIDAYNA_MAX_UNITS,MEMF_CLEAR);
 	if (!db->db_scsiSettings) {
 		D(("scsidayna: Out of memory (settings)\n"));
 		freeInit(db);
@@ -138,212 +346,384 @@ __saveds struct Device *DevInit( ASMR(d0) DEVBASEP ASMREG(d0), ASMR(a0) BPTR seg
 	}
 	
 	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)db->db_scsiSettings;
-	if (SCSIWifi_loadSettings((void*)UtilityBase, (void*)DOSBase, settings))
-		D(("scsidayna: settings loaded")); 
-	else D(("scsidayna: Invalid or missing settings file, reverting to defaults\n"));
-	
-	// Log config on startup
-	if (settings->debug) {
-		logMessage(db, "Loaded Configuration:");
-		logMessagef(db, "	SCSI Device: %s", settings->deviceName);
-		if ((settings->deviceID<0) || (settings->deviceID>7)) logMessage(db, "	Unit ID: Auto Detect"); else logMessagef(db, "	Unit ID: %ld", settings->deviceID);
-		logMessagef(db, "	Priority: %ld", settings->taskPriority);
-		logMessagef(db, "	Max Transfer Size: %ld", settings->maxDataSize);
-		logMessagef(db, "	Mode: %ld", settings->scsiMode);
-		if (settings->autoConnect) {
-			logMessagef(db, "	Auto Connect Wifi: Yes");
-			logMessagef(db, "	SSID: %s", settings->ssid);
-			logMessagef(db, "	Key: %s", settings->key);
-		} else {
-			logMessagef(db, "	Auto Connect Wifi: No");
+	for (USHORT unit=0; unit<SCSIDAYNA_MAX_UNITS; unit++) {
+		struct devunit* du = &db->db_Units[unit];
+		du->du_UnitNum = unit;
+		du->du_scsiSettings = &settings[unit];
+		du->du_online = 0;
+		du->du_amigaNetMode = 0;
+
+		NewList((struct List*)&du->du_Openers);	InitSemaphore(&du->du_ReadListSem);
+		NewList(&du->du_WriteList);			InitSemaphore(&du->du_WriteListSem);
+		NewList(&du->du_EventList);			InitSemaphore(&du->du_EventListSem);
+		NewList(&du->du_ReadOrphanList); 	InitSemaphore(&du->du_ReadOrphanListSem);
+		NewList(&du->du_WifiList); 			InitSemaphore(&du->du_WifiListSem);
+		du->du_WifiCache = NULL;
+		InitSemaphore(&du->du_ProcSem);
+
+		// Each unit gets its own scheduler process, eg: AmigaNetPacketScheduler.1
+		strcpy(du->du_ProcName, frame_proc_name);
+		if (unit) {
+			USHORT len = strlen(du->du_ProcName);
+			du->du_ProcName[len] = '.';
+			du->du_ProcName[len+1] = '0' + unit;
+			du->du_ProcName[len+2] = '\0';
 		}
+
+		if (SCSIWifi_loadUnitSettings((void*)UtilityBase, (void*)DOSBase, &settings[unit], unit))
+			D(("scsidayna: settings loaded for unit %ld\n", unit)); 
+		else D(("scsidayna: Invalid or missing settings file, reverting to defaults\n"));
 	}
+	
+	// Log config on startup
+	logSettings(db, &db->db_Units[0]);
   
 	return (struct Device*)db;
 }
 
 // Return an error and clean up
-LONG returnError(struct devbase* db, struct IOSana2Req *ioreq, LONG errorCode) {
+LONG returnError(struct devbase* db, struct devunit* du, struct IOSana2Req *ioreq, LONG errorCode) {
 	ioreq->ios2_Req.io_Error = errorCode; 
 	ioreq->ios2_Req.io_Unit = (struct Unit *)0;   
 	ioreq->ios2_Req.io_Device = (struct Device *)0;	
 	if (db->db_decrementCountOnFail) {
 		db->db_decrementCountOnFail = 0;
 		db->db_Lib.lib_OpenCnt--;
+		if (du) du->du_Unit.unit_OpenCnt--;
 	}
 	return errorCode;
 }
 
-// Device open!
-__saveds LONG DevOpen( ASMR(a1) struct IOSana2Req *ioreq ASMREG(a1), ASMR(d0) ULONG unit ASMREG(d0), ASMR(d1) ULONG flags ASMREG(d1), ASMR(a6) DEVBASEP ASMREG(a6) ) {		
-	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)db->db_scsiSettings;
-	db->db_decrementCountOnFail = 0;		
-			
-    // promiscuous mode not supported
-	if ((flags & SANA2OPF_PROM) && (unit)) {
-		logMessagef(db, "DevOpen: SANA2OPF_PROM not supported on unit id %ld", unit);
-		return returnError(db, ioreq, IOERR_OPENFAIL);
-	}	
+// Returns TRUE if another open unit is already using this SCSI ID on the same SCSI driver
+BOOL deviceIDInUse(DEVBASEP, DEVUNITP, SHORT deviceID) {
+	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)du->du_scsiSettings;
+	for (USHORT unit=0; unit<SCSIDAYNA_MAX_UNITS; unit++) {
+		struct devunit* other = &db->db_Units[unit];
+		if ((other == du) || (!other->du_Unit.unit_OpenCnt)) continue;
+		struct ScsiDaynaSettings* otherSettings = (struct ScsiDaynaSettings*)other->du_scsiSettings;
+		if (((otherSettings->deviceID == deviceID) || (otherSettings->bondDeviceID == deviceID)) && (Stricmp(otherSettings->deviceName, settings->deviceName) == 0)) return TRUE;
+	}
+	return FALSE;
+}
 
-	if (strlen(settings->deviceName)<1) {
-		logMessage(db, "DevOpen: CSI device name not set");
-		return returnError(db, ioreq, IOERR_OPENFAIL);
+// Joins the AUTOCONNECT network. If the link was last up on it, the channel it was on goes in the request
+LONG joinConfiguredNetwork(DEVBASEP, DEVUNITP, SCSIWIFIDevice device) {
+	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)du->du_scsiSettings;
+	struct SCSIWifi_JoinRequest request;
+	memset(&request, 0, sizeof(request));
+	strcpy(request.ssid, settings->ssid);
+	strcpy(request.key, settings->key);
+	if ((du->du_LastChannel) && (strcmp(du->du_LastSSID, settings->ssid) == 0)) request.channel = du->du_LastChannel;
+	return SCSIWifi_joinNetwork(device, &request);
+}
+
+// Allocates a packet buffer where du_bufferMem says, aligned to whole cache lines. If that memory isn't
+// available it falls back to Fast RAM and then any public memory, as a slower transfer beats none
+UBYTE* allocDMABuffer(DEVBASEP, DEVUNITP, ULONG size) {
+	// Room to align it and to remember where the allocation started, rounded up so the buffer ends on a cache line too
+	ULONG allocSize = ((size + DMA_BUFFER_ALIGN - 1) & ~(ULONG)(DMA_BUFFER_ALIGN - 1)) + DMA_BUFFER_ALIGN - 1 + sizeof(APTR);
+	UBYTE* mem = NULL;
+
+	if (du->du_bufferMem == BUFFERMEM_24BIT) {
+		mem = AllocVec(allocSize, MEMF_PUBLIC | MEMF_FAST | MEMF_24BITDMA);
+		// Kickstarts before 3.0 don't know MEMF_24BITDMA and ignore it
+		if ((mem) && ((ULONG)mem + allocSize > 0x01000000UL)) {
+			FreeVec(mem);
+			mem = NULL;
+		}
+	}
+	if ((!mem) && (du->du_bufferMem != BUFFERMEM_ANY)) mem = AllocVec(allocSize, MEMF_PUBLIC | MEMF_FAST);
+	if (!mem) mem = AllocVec(allocSize, MEMF_PUBLIC);
+	if (!mem) return NULL;
+
+	// Only the low bits of the address matter, so this works wherever pointers are bigger than a ULONG
+	UBYTE* buffer = mem + sizeof(APTR);
+	buffer += (DMA_BUFFER_ALIGN - ((ULONG)buffer & (DMA_BUFFER_ALIGN - 1))) & (DMA_BUFFER_ALIGN - 1);
+	((APTR*)buffer)[-1] = mem;
+	return buffer;
+}
+
+// Frees a buffer from allocDMABuffer
+void freeDMABuffer(DEVBASEP, UBYTE* buffer) {
+	if (buffer) FreeVec(((APTR*)buffer)[-1]);
+}
+
+// Finds the fastest read mode that works through this controller. It's remembered for the SCSI driver so it's only
+// probed once, and each mode is marked before it's tried so one that hangs the machine is skipped next time. Without
+// the firmware's link test there's nothing that reads data of a chosen length, so the safe mode 1 is used instead
+USHORT probeScsiMode(DEVBASEP, DEVUNITP, SCSIWIFIDevice wifiDevice, USHORT capabilities) {
+	// The 24 byte padding costs the most, and is what was always used before
+	static const USHORT probeOrder[3] = { SCSIMODE_DAYNAPORT, SCSIMODE_ONEBLOCK, SCSIMODE_24BYTE };
+	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)du->du_scsiSettings;
+	USHORT probing;
+	USHORT mode = SCSIWifi_getRememberedMode(wifiDevice, settings->deviceName, &probing);
+	if ((mode != SCSIMODE_AUTO) && (!probing)) {
+		logMessagef(db, "DevOpen: Using Mode %ld found before for \"%s\"", mode, settings->deviceName);
+		return mode;
+	}
+	if (!(capabilities & SCSIWIFI_CAP_LINKTEST)) {
+		logMessage(db, "DevOpen: The firmware can't probe the Mode, using 1");
+		return SCSIMODE_24BYTE;
+	}
+
+	USHORT first = 0;
+	if (mode != SCSIMODE_AUTO) {
+		while ((first < 3) && (probeOrder[first] != mode)) first++;
+		first++;
+		logMessagef(db, "DevOpen: Probing Mode %ld didn't finish last time, skipping it", mode);
+		if (first >= 3) {
+			logMessage(db, "DevOpen: No modes left to probe, set MODE in the prefs file");
+			SCSIWifi_rememberMode(wifiDevice, settings->deviceName, SCSIMODE_24BYTE, 0);
+			return SCSIMODE_24BYTE;
+		}
+	}
+
+	UBYTE* buffer = allocDMABuffer(db, du, du->du_maxPacketsSize);
+	if (!buffer) {
+		logMessage(db, "DevOpen: Out of memory probing the Mode, using 1");
+		return SCSIMODE_24BYTE;
+	}
+	mode = SCSIMODE_AUTO;
+	for (USHORT i=first; i<3; i++) {
+		SCSIWifi_rememberMode(wifiDevice, settings->deviceName, probeOrder[i], 1);
+		if (SCSIWifi_probeMode(wifiDevice, probeOrder[i], buffer, du->du_maxPacketsSize)) {
+			mode = probeOrder[i];
+			break;
+		}
+		logMessagef(db, "DevOpen: Mode %ld failed the probe", probeOrder[i]);
+	}
+	freeDMABuffer(db, buffer);
+
+	// If nothing worked it's more likely the device than the mode, so it's probed again next time
+	SCSIWifi_rememberMode(wifiDevice, settings->deviceName, mode, 0);
+	if (mode == SCSIMODE_AUTO) {
+		logMessage(db, "DevOpen: No mode passed the probe, using 1");
+		return SCSIMODE_24BYTE;
+	}
+	logMessagef(db, "DevOpen: Probed Mode %ld for \"%s\"", mode, settings->deviceName);
+	return mode;
+}
+
+// Finds and checks the unit's SCSI target and starts its scheduler process. Called for the first opener of a unit
+LONG openUnit(DEVBASEP, DEVUNITP) {
+	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)du->du_scsiSettings;
+	if (du->du_UnitNum) logSettings(db, du);
+
+	SCSIWIFIDevice wifiDevice = NULL;
+	struct SCSIDevice_OpenData openData;
+	openData.sysBase = (struct ExecBase*)SysBase;
+	openData.utilityBase = (void*)UtilityBase;
+	openData.dosBase = (void*)DOSBase;
+	openData.deviceDriverName = settings->deviceName;
+	openData.deviceID = settings->deviceID;
+	openData.scsiMode = settings->scsiMode;
+	enum SCSIWifi_OpenResult scsiResult = sworOpenDeviceFailed;
+	USHORT capabilities = 0;
+
+	// Open it
+	if ((settings->deviceID<0) || (settings->deviceID>7)) {			
+		D(("scsidayna: Searching for DaynaPORT Device to Configure\n"));
+		// Highly likely it will be on 4 as its in the example so start there!
+		for (USHORT deviceID=4; deviceID<4+8; deviceID++) {
+			openData.deviceID = deviceID & 7;  
+			// Skip targets already driven by another unit, or bonded to this one
+			if ((openData.deviceID == settings->bondDeviceID) || (deviceIDInUse(db, du, openData.deviceID))) continue;
+			D(("scsidayna: Searching on DeviceID %ld\n", openData.deviceID));
+			wifiDevice = SCSIWifi_open(&openData, &scsiResult);
+			if (wifiDevice) {
+				settings->deviceID = openData.deviceID;
+				logMessagef(db, "DevOpen: Detected Network Device on Unit %ld", openData.deviceID );
+				break;
+			}
+		}
+	} else if (deviceIDInUse(db, du, settings->deviceID)) {
+		logMessagef(db, "DevOpen: SCSI device \"%s\" ID %ld is already in use by another unit\n", settings->deviceName, settings->deviceID);
+		return IOERR_UNITBUSY;
+	} else {			
+		wifiDevice = SCSIWifi_open(&openData, &scsiResult);
 	}
 		
-	db->db_Lib.lib_OpenCnt++; /* avoid Expunge, see below for separate "unit" open count */			
-	db->db_decrementCountOnFail = 1;
-	if (unit==0 && db->db_Lib.lib_OpenCnt==1) {		
-		SCSIWIFIDevice* wifiDevice = NULL;
-		struct SCSIDevice_OpenData openData;
-		openData.sysBase = (struct ExecBase*)SysBase;
-		openData.utilityBase = (void*)UtilityBase;
-		openData.dosBase = (void*)DOSBase;
-		openData.deviceDriverName = settings->deviceName;
-		openData.deviceID = settings->deviceID;
-		openData.scsiMode = settings->scsiMode;
-		enum SCSIWifi_OpenResult scsiResult;
+	if (!wifiDevice) {
+		switch (scsiResult) {
+			case sworOpenDeviceFailed: 	logMessagef(db, "DevOpen: Failed to open SCSI device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;  
+			case sworOutOfMem:  		logMessagef(db, "DevOpen: Out of memory opening SCSI device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
+			case sworInquireFail:      	logMessagef(db, "DevOpen: Inquiry of SCSI device failed \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
+			case sworNotDaynaDevice:   	logMessagef(db, "DevOpen: Device is not a DaynaPort SCSI device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
+			default: logMessagef(db, "DevOpen:  Unknown error occured opening device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
+		}
+		return IOERR_OPENFAIL;
+	}
 	
-		// Open it
-		if ((settings->deviceID<0) || (settings->deviceID>7)) {			
-			D(("scsidayna: Searching for DaynaPORT Device to Configure\n"));
-			// Highly likely it will be on 4 as its in the example so start there!
-			for (USHORT deviceID=4; deviceID<4+8; deviceID++) {
-				openData.deviceID = deviceID & 7;  
-				D(("scsidayna: Searching on DeviceID %ld\n", openData.deviceID));
-				wifiDevice = SCSIWifi_open(&openData, &scsiResult);
-				if (wifiDevice) {
-					settings->deviceID = openData.deviceID;
-					logMessagef(db, "DevOpen: Detected Network Device on Unit %ld", openData.deviceID );
-					break;
-				}
-			}
-		} else {			
-			wifiDevice = SCSIWifi_open(&openData, &scsiResult);
+	if (scsiResult == sworGreat) {
+		du->du_amigaNetMode = 1;
+		logMessagef(db, "DevOpen: AmigaNET Interface Detected"); 
+		// Device open. Fetch MAC address
+		struct SCSIWifi_DeviceInfo devInfo;
+		if (!SCSIWifi_getDeviceInfo(wifiDevice, &devInfo)) {
+			logMessagef(db, "DevOpen: Failed to fetch device info from Device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); 
+			SCSIWifi_close(wifiDevice);
+			return IOERR_OPENFAIL;
 		}
-			
-		if (!wifiDevice) {
-			switch (scsiResult) {
-				case sworOpenDeviceFailed: 	logMessagef(db, "DevOpen: Failed to open SCSI device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;  
-				case sworOutOfMem:  		logMessagef(db, "DevOpen: Out of memory opening SCSI device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
-				case sworInquireFail:      	logMessagef(db, "DevOpen: Inquiry of SCSI device failed \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
-				case sworNotDaynaDevice:   	logMessagef(db, "DevOpen: Device is not a DaynaPort SCSI device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
-				default: logMessagef(db, "DevOpen:  Unknown error occured opening device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); break;
-			}
-			return returnError(db, ioreq, IOERR_OPENFAIL);
+		// Take a copy of the MAC Address
+		memcpy(du->du_MAC, devInfo.macAddress, 6);
+		du->du_maxBatchLimit = devInfo.maxBatchSize;
+		du->du_maxPackets = devInfo.maxPackets;
+		D(("scsidayna: MAC Address stored, checking WIFI status\n"));
+		logMessagef(db, "DevOpen: Max Data Transfer Size: %ld  (limited to %ld), Max Packets: %ld",du->du_maxBatchLimit, settings->maxDataSize, du->du_maxPackets);
+		// A batch is one SCSI transfer, so it can't be bigger than the controller's MaxTransfer
+		ULONG maxTransfer = SCSIWifi_getMaxTransfer(wifiDevice, settings->deviceName);
+		if ((maxTransfer >= SCSIWIFI_PACKET_MAX_SIZE + 4) && (du->du_maxBatchLimit > maxTransfer)) {
+			if (settings->maxDataSize > maxTransfer) logMessagef(db, "DevOpen: Max Data Transfer Size limited to %ld by the controller's MaxTransfer", maxTransfer);
+			du->du_maxBatchLimit = maxTransfer;
+		}
+		// The limit is kept so DATASIZE can be changed while the unit is running
+		du->du_maxPacketsSize = (du->du_maxBatchLimit > settings->maxDataSize) ? settings->maxDataSize : du->du_maxBatchLimit;
+		// Ensure du->du_maxPacketsSize is even, rounding down so it stays inside the limits above
+		du->du_maxPacketsSize &= 0xFFFFFFFEUL;
+		if (du->du_maxPacketsSize > 0xFFFF) logMessage(db, "DevOpen: Using 10 byte commands for batches over 64KB");
+		du->du_compactMode = (devInfo.capabilities & SCSIWIFI_CAP_COMPACT) ? 1 : 0;
+		if (du->du_compactMode) logMessage(db, "DevOpen: Compact Packet Headers Supported");
+		du->du_txCredits = (devInfo.capabilities & SCSIWIFI_CAP_TXCREDIT) ? 1 : 0;
+		if (du->du_txCredits) logMessage(db, "DevOpen: Transmit Flow Control Supported");
+		capabilities = devInfo.capabilities;
+	} else {
+		du->du_amigaNetMode = 0;
+		du->du_compactMode = 0;
+		du->du_txCredits = 0;
+		du->du_maxPacketsSize = 0;
+		du->du_maxPackets = 0;
+		logMessagef(db, "DevOpen: Legacy Daynaport Interface Detected (Upgrade SCSI Firmware)"); 
+		// Device open. Fetch MAC address
+		struct SCSIWifi_MACAddress macAddress;
+		if (!SCSIWifi_getMACAddress(wifiDevice, &macAddress)) {
+			logMessagef(db, "DevOpen: Failed to fetch MAC Address from Device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); 
+			SCSIWifi_close(wifiDevice);
+			return IOERR_OPENFAIL;
 		}
+		// Take a copy of the MAC Address
+		D(("scsidayna: MAC Address stored, checking WIFI status\n"));
+		memcpy(du->du_MAC, macAddress.address, 6);
+	}				
+	logMessagef(db, "DevOpen: MAC Address %02lx:%02lx:%02lx:%02lx:%02lx:%02lx",du->du_MAC[0],du->du_MAC[1],du->du_MAC[2],du->du_MAC[3],du->du_MAC[4],du->du_MAC[5]); 
+
+	// Packet buffers go in Fast RAM, below 16MB if the controller's partitions say it can't DMA above that
+	du->du_bufferMem = (settings->bufferMem > BUFFERMEM_24BIT) ? BUFFERMEM_AUTO : settings->bufferMem;
+	if (du->du_bufferMem == BUFFERMEM_AUTO)
+		du->du_bufferMem = (SCSIWifi_getDMAMask(wifiDevice, settings->deviceName) & 0xFF000000UL) ? BUFFERMEM_FAST : BUFFERMEM_24BIT;
+	// The 040 and 060 copyback caches need flushing around DMA, which not every controller driver does
+	du->du_cacheDMA = (settings->cacheDMA == CACHEDMA_ON) || ((settings->cacheDMA == CACHEDMA_AUTO) && (((struct ExecBase*)SysBase)->AttnFlags & (AFF_68040 | AFF_68060)));
+	logMessagef(db, "DevOpen: Packet buffers in %s, %s the CPU caches around transfers", (du->du_bufferMem == BUFFERMEM_ANY) ? "any memory" : (du->du_bufferMem == BUFFERMEM_24BIT) ? "24-bit Fast RAM" : "Fast RAM", du->du_cacheDMA ? "flushing" : "not flushing");
+
+	// How packets are read through this controller, if MODE didn't say
+	if (settings->scsiMode == SCSIMODE_AUTO) settings->scsiMode = probeScsiMode(db, du, wifiDevice, capabilities);
 		
-		if (scsiResult == sworGreat) {
-			db->db_amigaNetMode = 1;
-			logMessagef(db, "DevOpen: AmigaNET Interface Detected"); 
-			// Device open. Fetch MAC address
-			struct SCSIWifi_DeviceInfo devInfo;
-			if (!SCSIWifi_getDeviceInfo(wifiDevice, &devInfo)) {
-				logMessagef(db, "DevOpen: Failed to fetch device info from Device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); 
-				SCSIWifi_close(wifiDevice);
-				return returnError(db, ioreq, IOERR_OPENFAIL);
-			}
-			// Take a copy of the MAC Address
-			memcpy(HW_MAC, devInfo.macAddress, 6);
-			db->db_maxPacketsSize = devInfo.maxPacketsSize;
-			db->db_maxPackets = devInfo.maxPackets;
-			D(("scsidayna: MAC Address stored, checking WIFI status\n"));
-			logMessagef(db, "DevOpen: Max Data Transfer Size: %ld  (limited to %ld), Max Packets: %ld",db->db_maxPacketsSize, settings->maxDataSize, db->db_maxPackets);
-			if (db->db_maxPacketsSize > settings->maxDataSize) db->db_maxPacketsSize = settings->maxDataSize;
-			// Ensure db->db_maxPacketsSize is even
-			if (db->db_maxPacketsSize&1) db->db_maxPacketsSize++;
+	
+	// Should we be attempting to connect to wifi?
+	if ((settings->autoConnect) && (strlen(settings->ssid))) {
+		// Fetch what the current network is
+		struct SCSIWifi_NetworkEntry currentNetwork;
+		if (!SCSIWifi_getNetwork(wifiDevice, &currentNetwork)) memset(&currentNetwork, 0, sizeof(struct SCSIWifi_NetworkEntry));
+		if (strcmp(currentNetwork.ssid, settings->ssid) == 0) {
+			logMessage(db, "DevOpen: Already Connected to Specified WIFI Network"); 
+			D(("scsidayna: Already connected to requested WIFI network\n"));
 		} else {
-			db->db_amigaNetMode = 0;
-			db->db_maxPacketsSize = 0;
-			db->db_maxPackets = 0;
-			logMessagef(db, "DevOpen: Legacy Daynaport Interface Detected (Upgrade SCSI Firmware)"); 
-			// Device open. Fetch MAC address
-			struct SCSIWifi_MACAddress macAddress;
-			if (!SCSIWifi_getMACAddress(wifiDevice, &macAddress)) {
-				logMessagef(db, "DevOpen: Failed to fetch MAC Address from Device \"%s\" ID %ld\n", settings->deviceName, settings->deviceID); 
-				SCSIWifi_close(wifiDevice);
-				return returnError(db, ioreq, IOERR_OPENFAIL);
-			}
-			// Take a copy of the MAC Address
-			D(("scsidayna: MAC Address stored, checking WIFI status\n"));
-			memcpy(HW_MAC, macAddress.address, 6);
-		}				
-		logMessagef(db, "DevOpen: MAC Address %02lx:%02lx:%02lx:%02lx:%02lx:%02lx",HW_MAC[0],HW_MAC[1],HW_MAC[2],HW_MAC[3],HW_MAC[4],HW_MAC[5]); 
-			
-		
-		// Should we be attempting to connect to wifi?
-		if ((settings->autoConnect) && (strlen(settings->ssid))) {
-			// Fetch what the current network is
-			struct SCSIWifi_NetworkEntry currentNetwork;
-			if (!SCSIWifi_getNetwork(wifiDevice, &currentNetwork)) memset(&currentNetwork, 0, sizeof(struct SCSIWifi_NetworkEntry));
-			if (strcmp(currentNetwork.ssid, settings->ssid) == 0) {
-				logMessage(db, "DevOpen: Already Connected to Specified WIFI Network"); 
-				D(("scsidayna: Already connected to requested WIFI network\n"));
-			} else {
-				struct SCSIWifi_JoinRequest request;
-				strcpy(request.ssid, settings->ssid);
-				strcpy(request.key, settings->key);
-				SCSIWifi_joinNetwork(wifiDevice, &request);
-				logMessage(db, "DevOpen: Requesting to Join WIFI Network"); 
-				D(("scsidayna: Attempting to connect to WIFI network\n"));     
+			joinConfiguredNetwork(db, du, wifiDevice);
+			logMessage(db, "DevOpen: Requesting to Join WIFI Network"); 
+			D(("scsidayna: Attempting to connect to WIFI network\n"));     
+		}
+	}
+	SCSIWifi_close(wifiDevice);		
+	D(("scsidayna: SCSI Device OK for %ld\n",du->du_UnitNum));
+	
+	du->du_online = 1;
+
+	struct ProcInit init;
+	struct MsgPort *port;
+
+	if (port = CreateMsgPort()) {
+		D(("scsidayna: Starting Server\n"));
+		if (du->du_Proc = CreateNewProcTags(NP_Entry, frame_proc, NP_Name, du->du_ProcName, NP_Priority, 0, NP_StackSize, 8192, TAG_DONE)) {
+			init.error = 1;
+			init.db = db;
+			init.du = du;
+			init.msg.mn_Length = sizeof(init);
+			init.msg.mn_ReplyPort = port;
+
+			D(("scsidayna: handover db: %lx\n",init.db));
+			PutMsg(&du->du_Proc->pr_MsgPort, (struct Message*)&init);
+			WaitPort(port);
+			DeleteMsgPort(port);
+
+			if (init.error) {
+				logMessagef(db,"DevOpen: Process startup error"); 
+				du->du_Proc = NULL;
+				return IOERR_OPENFAIL;
 			}
+		} else {
+			DeleteMsgPort(port);
+			logMessagef(db,"DevOpen: Couldn't create process"); 
+			return IOERR_OPENFAIL;
 		}
-		SCSIWifi_close(wifiDevice);		
-		D(("scsidayna: SCSI Device OK for %ld\n",unit));
-		
-		struct BufferManagement *bm;
-		if ((bm = (struct BufferManagement*)AllocVec(sizeof(struct BufferManagement), MEMF_CLEAR|MEMF_PUBLIC))) {
-			bm->bm_CopyToBuffer = (BMFunc)GetTagData(S2_CopyToBuff, 0, (struct TagItem *)ioreq->ios2_BufferManagement);
-			bm->bm_CopyFromBuffer = (BMFunc)GetTagData(S2_CopyFromBuff, 0, (struct TagItem *)ioreq->ios2_BufferManagement); 
+	} else {
+		logMessagef(db,"DevOpen: Failed to create message port"); 
+		return IOERR_OPENFAIL;
+	}
+	return 0;
+}
+
+// Device open!
+__saveds LONG DevOpen( ASMR(a1) struct IOSana2Req *ioreq ASMREG(a1), ASMR(d0) ULONG unit ASMREG(d0), ASMR(d1) ULONG flags ASMREG(d1), ASMR(a6) DEVBASEP ASMREG(a6) ) {		
+	db->db_decrementCountOnFail = 0;		
+
+	if (unit >= SCSIDAYNA_MAX_UNITS) {
+		logMessagef(db, "DevOpen: Unit %ld not supported", unit);
+		return returnError(db, NULL, ioreq, IOERR_OPENFAIL);
+	}
+	struct devunit* du = &db->db_Units[unit];
+	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)du->du_scsiSettings;
 			
-			ioreq->ios2_BufferManagement = (VOID *)bm;
-			ioreq->ios2_Req.io_Error = 0;
-			ioreq->ios2_Req.io_Unit = (struct Unit *)unit; // not a real pointer, but id integer
-			ioreq->ios2_Req.io_Device = (struct Device *)db;
-
-			NewList(&db->db_ReadList);			InitSemaphore(&db->db_ReadListSem);
-			NewList(&db->db_WriteList);			InitSemaphore(&db->db_WriteListSem);
-			NewList(&db->db_EventList);			InitSemaphore(&db->db_EventListSem);
-			NewList(&db->db_ReadOrphanList); 	InitSemaphore(&db->db_ReadOrphanListSem);
-
-			InitSemaphore(&db->db_ProcSem);
-			db->db_online = 1;
-
-			struct ProcInit init;
-			struct MsgPort *port;
-
-			if (port = CreateMsgPort()) {
-				D(("scsidayna: Starting Server\n"));
-				if (db->db_Proc = CreateNewProcTags(NP_Entry, frame_proc, NP_Name, frame_proc_name, NP_Priority, 0, TAG_DONE)) {
-					init.error = 1;
-					init.db = db;
-					init.msg.mn_Length = sizeof(init);
-					init.msg.mn_ReplyPort = port;
-
-					D(("scsidayna: handover db: %lx\n",init.db));
-					PutMsg(&db->db_Proc->pr_MsgPort, (struct Message*)&init);
-					WaitPort(port);
-
-					if (init.error) {
-						logMessagef(db,"DevOpen: Process startup error"); 
-						return returnError(db, ioreq, IOERR_OPENFAIL);
-					}
-				} else {
-					logMessagef(db,"DevOpen: Couldn't create process"); 
-					return returnError(db, ioreq, IOERR_OPENFAIL);
-				}
-				DeleteMsgPort(port);
-			} else {
-				logMessagef(db,"DevOpen: Failed to create message port"); 
-				return returnError(db, ioreq, IOERR_OPENFAIL);
-			}
+    // promiscuous mode not supported, the flag is ignored
+
+	if (strlen(settings->deviceName)<1) {
+		logMessage(db, "DevOpen: CSI device name not set");
+		return returnError(db, NULL, ioreq, IOERR_OPENFAIL);
+	}
+
+	// Every opener gets its own copy hooks and read queue
+	struct BufferManagement *bm = (struct BufferManagement*)AllocVec(sizeof(struct BufferManagement), MEMF_CLEAR|MEMF_PUBLIC);
+	if (!bm) {
+		logMessage(db, "DevOpen: Out of memory");
+		return returnError(db, NULL, ioreq, IOERR_OPENFAIL);
+	}
+	bm->bm_CopyToBuffer = (BMFunc)GetTagData(S2_CopyToBuff, 0, (struct TagItem *)ioreq->ios2_BufferManagement);
+	bm->bm_CopyFromBuffer = (BMFunc)GetTagData(S2_CopyFromBuff, 0, (struct TagItem *)ioreq->ios2_BufferManagement); 
+	bm->bm_PacketFilter = (struct Hook*)GetTagData(S2_PacketFilter, 0, (struct TagItem *)ioreq->ios2_BufferManagement);
+	NewList(&bm->bm_ReadList);
+		
+	db->db_Lib.lib_OpenCnt++; /* avoid Expunge, see below for separate "unit" open count */			
+	du->du_Unit.unit_OpenCnt++;
+	db->db_decrementCountOnFail = 1;
+	if (du->du_Unit.unit_OpenCnt==1) {		
+		LONG error = openUnit(db, du);
+		if (error) {
+			FreeVec(bm);
+			return returnError(db, du, ioreq, error);
 		}
 	}
+
+	ObtainSemaphore(&du->du_ReadListSem);
+	AddTail((struct List*)&du->du_Openers, (struct Node*)bm);
+	ReleaseSemaphore(&du->du_ReadListSem);
 		
+	ioreq->ios2_BufferManagement = (VOID *)bm;
+	ioreq->ios2_Req.io_Error = 0;
+	ioreq->ios2_Req.io_Unit = (struct Unit *)du;
+	ioreq->ios2_Req.io_Device = (struct Device *)db;
 	ioreq->ios2_Req.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
 	db->db_Lib.lib_Flags &= ~LIBF_DELEXP;
 	
 	D(("scsidayna: DevOpen\n"));
-	logMessage(db, "DevOpen: Ready"); 
+	logMessagef(db, "DevOpen: Unit %ld Ready", unit); 
 	return 0;
 }
 
@@ -354,16 +734,38 @@ __saveds BPTR DevClose( ASMR(a1) struct IORequest *ioreq ASMREG(a1), ASMR(a6) DE
 	if (!ioreq) return ret;
 	db->db_Lib.lib_OpenCnt--;
 
-	if (db->db_Lib.lib_OpenCnt == 0) {
-		if (db->db_Proc) {
-			D(("scsidayna: End Proc...\n"));
-			Signal((struct Task*)db->db_Proc, SIGBREAKF_CTRL_C);
-
-			// Wait for shutdown
-			ObtainSemaphore(&db->db_ProcSem);
-			ReleaseSemaphore(&db->db_ProcSem);
-			db->db_Proc = 0;
-		}   
+	struct devunit* du = (struct devunit*)ioreq->io_Unit;
+	if (du) {
+		// Remove this opener, failing anything it left queued
+		struct BufferManagement *bm = (struct BufferManagement *)((struct IOSana2Req*)ioreq)->ios2_BufferManagement;
+		ObtainSemaphore(&du->du_ReadListSem);
+		Remove((struct Node*)bm);
+		rejectList(db, &bm->bm_ReadList, NULL, IOERR_ABORTED, 0);
+		ReleaseSemaphore(&du->du_ReadListSem);
+		ObtainSemaphore(&du->du_ReadOrphanListSem);
+		rejectList(db, &du->du_ReadOrphanList, bm, IOERR_ABORTED, 0);
+		ReleaseSemaphore(&du->du_ReadOrphanListSem);
+		ObtainSemaphore(&du->du_WriteListSem);
+		rejectList(db, &du->du_WriteList, bm, IOERR_ABORTED, 0);
+		txRecount(du);
+		ReleaseSemaphore(&du->du_WriteListSem);
+		ObtainSemaphore(&du->du_WifiListSem);
+		rejectList(db, &du->du_WifiList, bm, IOERR_ABORTED, 0);
+		ReleaseSemaphore(&du->du_WifiListSem);
+		FreeVec(bm);
+
+		du->du_Unit.unit_OpenCnt--;
+		if (du->du_Unit.unit_OpenCnt == 0) {
+			if (du->du_Proc) {
+				D(("scsidayna: End Proc...\n"));
+				Signal((struct Task*)du->du_Proc, SIGBREAKF_CTRL_C);
+
+				// Wait for shutdown
+				ObtainSemaphore(&du->du_ProcSem);
+				ReleaseSemaphore(&du->du_ProcSem);
+				du->du_Proc = 0;
+			}   
+		}
 	}
 	
 	ioreq->io_Device = (0);
@@ -391,6 +793,7 @@ __saveds BPTR DevExpunge( ASMR(a6) DEVBASEP ASMREG(a6) ) {
 }
 
 __saveds VOID DevBeginIO( ASMR(a1) struct IOSana2Req *ioreq ASMREG(a1), ASMR(a6) DEVBASEP ASMREG(a6) ) {    
+	struct devunit* du = (struct devunit*)ioreq->ios2_Req.io_Unit;
 	ioreq->ios2_Req.io_Message.mn_Node.ln_Type = NT_MESSAGE;
 	ioreq->ios2_Req.io_Error = S2ERR_NO_ERROR;
 	ioreq->ios2_WireError = S2WERR_GENERIC_ERROR;
@@ -428,57 +831,71 @@ __saveds VOID DevBeginIO( ASMR(a1) struct IOSana2Req *ioreq ASMREG(a1), ASMR(a6)
 		break;
 		
 	case CMD_READ:
-		if (ioreq->ios2_BufferManagement == NULL) {
+		if (((struct BufferManagement*)ioreq->ios2_BufferManagement)->bm_CopyToBuffer == NULL) {
 			ioreq->ios2_Req.io_Error = S2ERR_BAD_ARGUMENT;
 			ioreq->ios2_WireError = S2WERR_BUFF_ERROR;
-		} else if (!db->db_currentWifiState) {
+		} else if (!du->du_currentWifiState) {
 			ioreq->ios2_Req.io_Error = S2ERR_OUTOFSERVICE;
 			ioreq->ios2_WireError = S2WERR_UNIT_OFFLINE;
 		} else {
 			ioreq->ios2_Req.io_Flags &= ~SANA2IOF_QUICK;
-			ObtainSemaphore(&db->db_ReadListSem);
-			AddTail((struct List*)&db->db_ReadList, (struct Node*)ioreq);
-			ReleaseSemaphore(&db->db_ReadListSem);
+			ObtainSemaphore(&du->du_ReadListSem);
+			AddTail(&((struct BufferManagement*)ioreq->ios2_BufferManagement)->bm_ReadList, (struct Node*)ioreq);
+			ReleaseSemaphore(&du->du_ReadListSem);
+			if ((du->du_FilterActive) && (!filterPasses(du, ioreq->ios2_PacketType))) du->du_FilterChanged = 1;
 			ioreq = NULL;
 		}
 		break;
 
 	case S2_GETGLOBALSTATS:
-		memcpy(ioreq->ios2_StatData, &db->db_DevStats, sizeof(struct Sana2DeviceStats));
+		memcpy(ioreq->ios2_StatData, &du->du_DevStats, sizeof(struct Sana2DeviceStats));
 		break;
 
 	case S2_BROADCAST:   
-		if (ioreq->ios2_DstAddr) {
-			memset(ioreq->ios2_DstAddr, 0xFF, HW_ADDRFIELDSIZE);
-		} else {
-			D(("bcast: invalid dst addr\n"));
-			ioreq->ios2_Req.io_Error = S2ERR_BAD_ADDRESS;
-			ioreq->ios2_WireError = S2WERR_BUFF_ERROR;
-		}
+		// ios2_DstAddr is an array in the request, so there's always somewhere to put it
+		memset(ioreq->ios2_DstAddr, 0xFF, HW_ADDRFIELDSIZE);
 		// fall through!	
 	case CMD_WRITE: 
-		if (ioreq->ios2_BufferManagement == NULL) {
+		if (((struct BufferManagement*)ioreq->ios2_BufferManagement)->bm_CopyFromBuffer == NULL) {
 			ioreq->ios2_Req.io_Error = S2ERR_BAD_ARGUMENT;
 			ioreq->ios2_WireError = S2WERR_BUFF_ERROR;
-		} else if (!db->db_currentWifiState) {
+		} else if (!du->du_currentWifiState) {
 			ioreq->ios2_Req.io_Error = S2ERR_OUTOFSERVICE;
 			ioreq->ios2_WireError = S2WERR_UNIT_OFFLINE;
 		} else {	
+			ObtainSemaphore(&du->du_WriteListSem);
+			// A full queue only makes every write wait longer, so the stack is told to back off instead
+			if (((du->du_TxQueueLimit) && (du->du_TxQueued >= du->du_TxQueueLimit)) ||
+				((du->du_TxQueueByteLimit) && (du->du_TxQueued) && (du->du_TxQueuedBytes + TXQ_SIZE(ioreq) > du->du_TxQueueByteLimit))) {
+				du->du_TxQueueFull++;
+				ReleaseSemaphore(&du->du_WriteListSem);
+				ioreq->ios2_Req.io_Error = S2ERR_NO_RESOURCES;
+				ioreq->ios2_WireError = S2WERR_GENERIC_ERROR;
+				break;
+			}
 			ioreq->ios2_Req.io_Flags &= ~SANA2IOF_QUICK;
 			ioreq->ios2_Req.io_Error = 0;
-			ObtainSemaphore(&db->db_WriteListSem);
+			ioreq->ios2_Req.io_Message.mn_Node.ln_Pri = 0;   // not classified yet
+			if (du->du_TimerBase) {
+				struct Library* TimerBase = du->du_TimerBase;
+				struct EClockVal now;
+				ReadEClock(&now);
+				TXQ_STAMP(ioreq) = now.ev_lo;
+			}
 			// The sending process reads from the head of the list,
 			// so add to the tail here, otherwise packets could go out in swapped order
-			AddTail((struct List*)&db->db_WriteList, (struct Node*)ioreq);
-			ReleaseSemaphore(&db->db_WriteListSem);
-			Signal((struct Task*)db->db_Proc, SIGBREAKF_CTRL_F);
+			AddTail((struct List*)&du->du_WriteList, (struct Node*)ioreq);
+			du->du_TxQueued++;
+			du->du_TxQueuedBytes += TXQ_SIZE(ioreq);
+			ReleaseSemaphore(&du->du_WriteListSem);
+			Signal((struct Task*)du->du_Proc, SIGBREAKF_CTRL_F);
 			ioreq = NULL;
 		}
 		break;
   
     case S2_ONEVENT:
-      if (((ioreq->ios2_WireError & S2EVENT_ONLINE) && (db->db_currentWifiState)) ||
-         ((ioreq->ios2_WireError & S2EVENT_OFFLINE) && (!db->db_currentWifiState))) {
+      if (((ioreq->ios2_WireError & S2EVENT_ONLINE) && (du->du_currentWifiState)) ||
+         ((ioreq->ios2_WireError & S2EVENT_OFFLINE) && (!du->du_currentWifiState))) {
            ioreq->ios2_Req.io_Error = 0;
            ioreq->ios2_WireError &= (S2EVENT_ONLINE|S2EVENT_OFFLINE);
            DevTermIO(db, (struct IORequest*)ioreq);
@@ -492,43 +909,43 @@ __saveds VOID DevBeginIO( ASMR(a1) struct IOSana2Req *ioreq ASMREG(a1), ASMR(a6)
       else {
         // Queue anything else 
         ioreq->ios2_Req.io_Flags &= ~SANA2IOF_QUICK;
-        ObtainSemaphore(&db->db_EventListSem);
-        AddTail((struct List*)&db->db_EventList, (struct Node*)ioreq);
-        ReleaseSemaphore(&db->db_EventListSem);
+        ObtainSemaphore(&du->du_EventListSem);
+        AddTail((struct List*)&du->du_EventList, (struct Node*)ioreq);
+        ReleaseSemaphore(&du->du_EventListSem);
         ioreq = NULL;
       }
       break;  
 
 	case S2_READORPHAN:
-		if (ioreq->ios2_BufferManagement == NULL) {
+		if (((struct BufferManagement*)ioreq->ios2_BufferManagement)->bm_CopyToBuffer == NULL) {
 			ioreq->ios2_Req.io_Error = S2ERR_BAD_ARGUMENT;
 			ioreq->ios2_WireError = S2WERR_BUFF_ERROR;
-		} else if (!db->db_currentWifiState) {
+		} else if (!du->du_currentWifiState) {
 			ioreq->ios2_Req.io_Error = S2ERR_OUTOFSERVICE;
 			ioreq->ios2_WireError = S2WERR_UNIT_OFFLINE;
 		} else {                      
 			ioreq->ios2_Req.io_Flags &= ~SANA2IOF_QUICK;
-			ObtainSemaphore(&db->db_ReadOrphanListSem);
-			AddTail((struct List*)&db->db_ReadOrphanList, (struct Node*)ioreq);
-			ReleaseSemaphore(&db->db_ReadOrphanListSem);
+			ObtainSemaphore(&du->du_ReadOrphanListSem);
+			AddTail((struct List*)&du->du_ReadOrphanList, (struct Node*)ioreq);
+			ReleaseSemaphore(&du->du_ReadOrphanListSem);
 			ioreq = NULL;
 		}
 		break;      
 
 	case S2_ONLINE:
-		db->db_online = 1;
+		du->du_online = 1;
 		break;
 
 	case S2_OFFLINE:
-		db->db_online = 0;
+		du->du_online = 0;
 		break;
 
 	case S2_CONFIGINTERFACE:   
 		break;
 
 	case S2_GETSTATIONADDRESS:
-		memcpy(ioreq->ios2_SrcAddr, HW_MAC, HW_ADDRFIELDSIZE); /* current */
-		memcpy(ioreq->ios2_DstAddr, HW_MAC, HW_ADDRFIELDSIZE); /* default */
+		memcpy(ioreq->ios2_SrcAddr, du->du_MAC, HW_ADDRFIELDSIZE); /* current */
+		memcpy(ioreq->ios2_DstAddr, du->du_MAC, HW_ADDRFIELDSIZE); /* default */
 		break;
 		
 	case S2_DEVICEQUERY: {
@@ -547,9 +964,39 @@ __saveds VOID DevBeginIO( ASMR(a1) struct IOSana2Req *ioreq ASMREG(a1), ASMR(a6)
 	case S2_GETSPECIALSTATS:
 		{
 		  struct Sana2SpecialStatHeader *s2ssh = (struct Sana2SpecialStatHeader *)ioreq->ios2_StatData;
+		  struct Sana2SpecialStatRecord *s2ssr = (struct Sana2SpecialStatRecord *)(s2ssh + 1);
+		  ULONG counts[NUM_SPECIAL_STATS] = {du->du_AcksThinned, du->du_ArpRepliesOffloaded, du->du_ArpRequestsDropped, du->du_ArpFiltered, du->du_BcastLimited, du->du_TxErrors, du->du_TxRetries,
+			  du->du_TxQueueFull, du->du_TxDelayDropped};
 		  s2ssh->RecordCountSupplied = 0;
+		  for (USHORT i=0; (i<NUM_SPECIAL_STATS) && (i<s2ssh->RecordCountMax); i++) {
+			  s2ssr[i].Type = specialStatTypes[i];
+			  s2ssr[i].Count = counts[i];
+			  s2ssr[i].String = specialStatNames[i];
+			  s2ssh->RecordCountSupplied++;
+		  }
 		}
 		break;
+
+	case S2_SCSIDAYNA_WIFISCAN:
+	case S2_SCSIDAYNA_SCANRESULTS:
+	case S2_SCSIDAYNA_JOINNETWORK:
+	case S2_SCSIDAYNA_GETNETWORK:
+		if ((!ioreq->ios2_StatData) && (ioreq->ios2_Req.io_Command != S2_SCSIDAYNA_WIFISCAN)) {
+			ioreq->ios2_Req.io_Error = S2ERR_BAD_ARGUMENT;
+			ioreq->ios2_WireError = S2WERR_NULL_POINTER;
+		} else {
+			ObtainSemaphore(&du->du_WifiListSem);
+			// Answer straight away if the result is cached, scans always go to the unit's task
+			if ((!du->du_WifiCache) || (ioreq->ios2_Req.io_Command == S2_SCSIDAYNA_WIFISCAN) || (!copyWifiResult((struct WifiCache*)du->du_WifiCache, ioreq))) {
+				ioreq->ios2_Req.io_Flags &= ~SANA2IOF_QUICK;
+				AddTail(&du->du_WifiList, (struct Node*)ioreq);
+				Signal((struct Task*)du->du_Proc, SIGBREAKF_CTRL_F);
+				ioreq = NULL;
+			}
+			ReleaseSemaphore(&du->du_WifiListSem);
+		}
+		break;
+
 			/*
 	case S2_SANA2HOOK:
 		{			
@@ -585,19 +1032,19 @@ __saveds VOID DevBeginIO( ASMR(a1) struct IOSana2Req *ioreq ASMREG(a1), ASMR(a6)
 }
 
 // SANA-2 Event management
-void DoEvent(DEVBASEP, long event) {
+void DoEvent(DEVBASEP, DEVUNITP, long event) {
 	struct IOSana2Req *ior, *ior2;
 	D(("event is %lx\n",event));
 
-	ObtainSemaphore(&db->db_EventListSem );
+	ObtainSemaphore(&du->du_EventListSem );
 
-	for(ior = (struct IOSana2Req *) db->db_EventList.lh_Head; (ior2 = (struct IOSana2Req *) ior->ios2_Req.io_Message.mn_Node.ln_Succ) != NULL; ior = ior2 ) {
+	for(ior = (struct IOSana2Req *) du->du_EventList.lh_Head; (ior2 = (struct IOSana2Req *) ior->ios2_Req.io_Message.mn_Node.ln_Succ) != NULL; ior = ior2 ) {
 		if (ior->ios2_WireError & event) {
 			Remove((struct Node*)ior);
 			DevTermIO(db, (struct IORequest *)ior);
 		}
 	}
-	ReleaseSemaphore(&db->db_EventListSem );
+	ReleaseSemaphore(&du->du_EventListSem );
 }
 
 __saveds LONG DevAbortIO( ASMR(a1) struct IORequest *ioreq ASMREG(a1), ASMR(a6) DEVBASEP ASMREG(a6) ) {
@@ -606,7 +1053,35 @@ __saveds LONG DevAbortIO( ASMR(a1) struct IORequest *ioreq ASMREG(a1), ASMR(a6)
 
 	D(("scsidayna: AbortIO on %lx\n",(ULONG)ioreq));
 
-	Remove((struct Node*)ioreq);
+	if ((ioreq->io_Command == CMD_WRITE) || (ioreq->io_Command == S2_BROADCAST)) {
+		// Writes being batched, sent or dropped by CoDel are already off the list, and are replied to by the unit's task
+		struct devunit* du = (struct devunit*)ioreq->io_Unit;
+		ObtainSemaphore(&du->du_WriteListSem);
+		BOOL queued = removeIfQueued(&du->du_WriteList, (struct Node*)ioreq);
+		if (queued) txDequeued(du, ios2);
+		ReleaseSemaphore(&du->du_WriteListSem);
+		if (!queued) return ret;
+	} else if ((ioreq->io_Command >= S2_SCSIDAYNA_WIFISCAN) && (ioreq->io_Command <= S2_SCSIDAYNA_GETNETWORK)) {
+		// The unit's task takes Wifi requests off the list while it works on them, and replies to them itself
+		struct devunit* du = (struct devunit*)ioreq->io_Unit;
+		ObtainSemaphore(&du->du_WifiListSem);
+		BOOL queued = removeIfQueued(&du->du_WifiList, (struct Node*)ioreq);
+		ReleaseSemaphore(&du->du_WifiListSem);
+		if (!queued) return ret;
+	} else if (ioreq->io_Command == CMD_READ) {
+		// The unit's task takes reads off their opener's list as frames are delivered to them
+		struct devunit* du = (struct devunit*)ioreq->io_Unit;
+		ObtainSemaphore(&du->du_ReadListSem);
+		BOOL queued = removeIfQueued(&((struct BufferManagement*)ios2->ios2_BufferManagement)->bm_ReadList, (struct Node*)ioreq);
+		ReleaseSemaphore(&du->du_ReadListSem);
+		if (!queued) return ret;
+	} else if (ioreq->io_Command == S2_READORPHAN) {
+		struct devunit* du = (struct devunit*)ioreq->io_Unit;
+		ObtainSemaphore(&du->du_ReadOrphanListSem);
+		BOOL queued = removeIfQueued(&du->du_ReadOrphanList, (struct Node*)ioreq);
+		ReleaseSemaphore(&du->du_ReadOrphanListSem);
+		if (!queued) return ret;
+	} else Remove((struct Node*)ioreq);
 
 	ioreq->io_Error = IOERR_ABORTED;
 	ios2->ios2_WireError = 0;
@@ -626,7 +1101,21 @@ void DevTermIO( DEVBASEP, struct IORequest *ioreq ) {
 }
 
 
-ULONG write_frame(struct IOSana2Req *req, UBYTE* frame, SCSIWIFIDevice scsiDevice, DEVBASEP) {
+// Picks up our IPv4 address from what's being sent, for ARP offload and the broadcast filter. The sender of our own ARP packets always
+// counts, the source of IPv4 packets is only used until one of those has been seen
+void learnAddress(DEVUNITP, USHORT packetType, UBYTE* payload, USHORT size) {
+	UBYTE* address;
+	if ((packetType == 0x0806) && (size >= 28) && (payload[2] == 0x08) && (payload[3] == 0x00) && (!memcmp(&payload[8], du->du_MAC, HW_ADDRFIELDSIZE))) address = &payload[14];
+	else if ((packetType == 0x0800) && (size >= 20) && (!(du->du_IPAddress[0] | du->du_IPAddress[1] | du->du_IPAddress[2] | du->du_IPAddress[3]))) address = &payload[12];
+	else return;
+	if (!(address[0] | address[1] | address[2] | address[3])) return;   // 0.0.0.0 while DHCP is running
+	if (memcmp(address, du->du_IPAddress, 4)) {
+		memcpy(du->du_IPAddress, address, 4);
+		du->du_IPAddressChanged = 1;
+	}
+}
+
+ULONG write_frame(struct IOSana2Req *req, UBYTE* frame, SCSIWIFIDevice scsiDevice, DEVBASEP, DEVUNITP) {
    USHORT sz=0;
    UBYTE* inputFrame = frame;
 
@@ -637,7 +1126,7 @@ ULONG write_frame(struct IOSana2Req *req, UBYTE* frame, SCSIWIFIDevice scsiDevic
       sz = req->ios2_DataLength + HW_ETH_HDR_SIZE;
       *((USHORT*)(frame+6+6)) = (USHORT)req->ios2_PacketType;
       memcpy(frame, req->ios2_DstAddr, HW_ADDRFIELDSIZE);
-      memcpy(frame+6, HW_MAC, HW_ADDRFIELDSIZE);
+      memcpy(frame+6, du->du_MAC, HW_ADDRFIELDSIZE);
       frame+=HW_ETH_HDR_SIZE;
    }
    
@@ -645,7 +1134,7 @@ ULONG write_frame(struct IOSana2Req *req, UBYTE* frame, SCSIWIFIDevice scsiDevic
    if(sz > SCSIWIFI_PACKET_MAX_SIZE) {
 	  req->ios2_Req.io_Error  = S2ERR_MTU_EXCEEDED;
 	  req->ios2_WireError = S2WERR_BUFF_ERROR;
-	  DoEvent(db, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
+	  DoEvent(db, du, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
 	  D(("MTU Buffer Exceeded"));
 	  return 0;
    }
@@ -653,7 +1142,7 @@ ULONG write_frame(struct IOSana2Req *req, UBYTE* frame, SCSIWIFIDevice scsiDevic
    // Skip if no packet
    if (sz < 1) {
 	   D(("Zero size packet rejected"));
-	   DoEvent(db, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
+	   DoEvent(db, du, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
 	   return 0;
    }
 
@@ -663,30 +1152,33 @@ ULONG write_frame(struct IOSana2Req *req, UBYTE* frame, SCSIWIFIDevice scsiDevic
 	if (!(*bm->bm_CopyFromBuffer)(frame, req->ios2_Data, req->ios2_DataLength)) {
 		req->ios2_Req.io_Error = S2ERR_SOFTWARE;
 		req->ios2_WireError = S2WERR_BUFF_ERROR;
-		DoEvent(db, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
+		DoEvent(db, du, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
 		D(("bm_CopyFromBuffer FAIL"));
 		return 0;
 	}
+	if (du->du_LearnAddress) learnAddress(du, ((USHORT)inputFrame[12] << 8) | (USHORT)inputFrame[13], inputFrame + HW_ETH_HDR_SIZE, sz - HW_ETH_HDR_SIZE);
 	
 	// Send it
 	if (SCSIWifi_sendFrame(scsiDevice, inputFrame, sz)) {
 		req->ios2_Req.io_Error = req->ios2_WireError = 0;
-		db->db_DevStats.PacketsSent++;
+		du->du_DevStats.PacketsSent++;
+		if (du->du_Capture) Capture_frame(du->du_Capture, inputFrame, sz);
 		return 1;
 	} else {
 		req->ios2_Req.io_Error = S2ERR_TX_FAILURE;
 		req->ios2_WireError = S2WERR_GENERIC_ERROR;
-		DoEvent(db, S2EVENT_ERROR | S2EVENT_TX | S2EVENT_HARDWARE);
+		DoEvent(db, du, S2EVENT_ERROR | S2EVENT_TX | S2EVENT_HARDWARE);
 		D(("SEND FAIL"));
 		return 0;
 	}
 }
 
-ULONG read_frame(DEVBASEP, struct IOSana2Req *req, UBYTE *frm, USHORT packetSize) {
+// Fills in a CMD_READ from a frame in SCSIWifi_receiveFrame format. Returns 1 if it worked, 0 if the copy failed (the
+// request still needs replying) or RECV_FILTERED if the opener's packet filter didn't want it (leave the request queued)
+ULONG read_frame(DEVBASEP, DEVUNITP, struct IOSana2Req *req, UBYTE *frm, USHORT packetSize) {
 	ULONG datasize;
 	BYTE *frame_ptr;
 	BOOL broadcast;
-	ULONG res = 0;
 
 	// This length includes 4 bytes for the CRC at the end, but we dont need that
 	ULONG sz   = ((ULONG)frm[0]<<8)|((ULONG)frm[1]);
@@ -706,12 +1198,15 @@ ULONG read_frame(DEVBASEP, struct IOSana2Req *req, UBYTE *frm, USHORT packetSize
 	}
 	req->ios2_DataLength = datasize;
 
-	// copy frame to device user (probably tcp/ip system)
+	// Let the stack's packet filter reject it before it's copied
 	struct BufferManagement *bm = (struct BufferManagement *)req->ios2_BufferManagement;
+	if ((bm->bm_PacketFilter) && (!CallHookPkt(bm->bm_PacketFilter, req, frame_ptr))) return RECV_FILTERED;
+
+	// copy frame to device user (probably tcp/ip system)
 	if (!(*bm->bm_CopyToBuffer)(req->ios2_Data, frame_ptr, datasize)) {
 		req->ios2_Req.io_Error = S2ERR_SOFTWARE;
 		req->ios2_WireError = S2WERR_BUFF_ERROR;
-		DoEvent(db, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
+		DoEvent(db, du, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
 		return 0;
 	}
   
@@ -732,12 +1227,11 @@ ULONG read_frame(DEVBASEP, struct IOSana2Req *req, UBYTE *frm, USHORT packetSize
 	return 1;
 }
 
-// Receive a packet
-ULONG receivePacket(DEVBASEP, UBYTE* packet, USHORT packetSize, struct IOSana2Req *req) {	
+// Receive a packet, returns the same as read_frame
+ULONG receivePacket(DEVBASEP, DEVUNITP, UBYTE* packet, USHORT packetSize, struct IOSana2Req *req) {	
 	ULONG datasize;
 	BYTE *frame_ptr;
 	BOOL broadcast;
-	ULONG res = 0;
 
 	req->ios2_PacketType = ((USHORT)packet[12]<<8)|((USHORT)packet[13]);
 
@@ -751,13 +1245,16 @@ ULONG receivePacket(DEVBASEP, UBYTE* packet, USHORT packetSize, struct IOSana2Re
 		req->ios2_Req.io_Flags = 0;
 	}
 	req->ios2_DataLength = datasize;
-	
-	// copy frame to device user (probably tcp/ip system)
+
+	// Let the stack's packet filter reject it before it's copied
 	struct BufferManagement *bm = (struct BufferManagement *)req->ios2_BufferManagement;
+	if ((bm->bm_PacketFilter) && (!CallHookPkt(bm->bm_PacketFilter, req, frame_ptr))) return RECV_FILTERED;
+
+	// copy frame to device user (probably tcp/ip system)
 	if (!(*bm->bm_CopyToBuffer)(req->ios2_Data, frame_ptr, datasize)) {
 		req->ios2_Req.io_Error = S2ERR_SOFTWARE;
 		req->ios2_WireError = S2WERR_BUFF_ERROR;
-		DoEvent(db, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
+		DoEvent(db, du, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
 		return 0;
 	}
   
@@ -779,41 +1276,940 @@ ULONG receivePacket(DEVBASEP, UBYTE* packet, USHORT packetSize, struct IOSana2Re
 }
 
 
-void rejectAllPackets(DEVBASEP) {
-  struct IOSana2Req *ior;
+void rejectAllPackets(DEVBASEP, DEVUNITP) {
+   D(("Reject all Packets\n"));
 
-  D(("Reject all Packets\n"));
+   ObtainSemaphore(&du->du_WriteListSem);
+   rejectList(db, &du->du_WriteList, NULL, S2ERR_OUTOFSERVICE, S2WERR_UNIT_OFFLINE);
+   du->du_TxQueued = 0;
+   du->du_TxQueuedBytes = 0;
+   ReleaseSemaphore(&du->du_WriteListSem);
 
-   ObtainSemaphore(&db->db_WriteListSem);
-   for (ior = (struct IOSana2Req *)db->db_WriteList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {      
-      ior->ios2_Req.io_Error = S2ERR_OUTOFSERVICE;
-      ior->ios2_WireError = S2WERR_UNIT_OFFLINE;
-      Remove((struct Node*)ior);
-      DevTermIO(db, (struct IORequest*)ior);
-   }
-   ReleaseSemaphore(&db->db_WriteListSem);
-
-   ObtainSemaphore(&db->db_ReadListSem);
-   for (ior = (struct IOSana2Req *)db->db_ReadList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
-      ior->ios2_Req.io_Error = S2ERR_OUTOFSERVICE;
-      ior->ios2_WireError = S2WERR_UNIT_OFFLINE;
-      Remove((struct Node*)ior);
-      DevTermIO(db, (struct IORequest*)ior);
-   }
-   ReleaseSemaphore(&db->db_ReadListSem);
-
-   ObtainSemaphore(&db->db_ReadOrphanListSem);
-   for (ior = (struct IOSana2Req *)db->db_ReadOrphanList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
-      ior->ios2_Req.io_Error = S2ERR_OUTOFSERVICE;
-      ior->ios2_WireError = S2WERR_UNIT_OFFLINE;
-      Remove((struct Node*)ior);
-      DevTermIO(db, (struct IORequest*)ior);
-   }
-   ReleaseSemaphore(&db->db_ReadOrphanListSem);   
+   ObtainSemaphore(&du->du_ReadListSem);
+   for (struct BufferManagement* bm = (struct BufferManagement*)du->du_Openers.mlh_Head; bm->bm_Node.mln_Succ; bm = (struct BufferManagement*)bm->bm_Node.mln_Succ)
+      rejectList(db, &bm->bm_ReadList, NULL, S2ERR_OUTOFSERVICE, S2WERR_UNIT_OFFLINE);
+   ReleaseSemaphore(&du->du_ReadListSem);
+
+   ObtainSemaphore(&du->du_ReadOrphanListSem);
+   rejectList(db, &du->du_ReadOrphanList, NULL, S2ERR_OUTOFSERVICE, S2WERR_UNIT_OFFLINE);
+   ReleaseSemaphore(&du->du_ReadOrphanListSem);   
 
    D(("Reject all Packets done\n"));
 }
 
+// Hands an orphaned frame to a S2_READORPHAN request. If its packet filter turns the frame down the request is put back
+void deliverOrphan(DEVBASEP, DEVUNITP, struct IOSana2Req *ior, UBYTE* packet, USHORT packetSize, BOOL legacyFrame) {
+	ULONG result = legacyFrame ? read_frame(db, du, ior, packet, packetSize) : receivePacket(db, du, packet, packetSize, ior);
+	if (result == RECV_FILTERED) {
+		ObtainSemaphore(&du->du_ReadOrphanListSem);
+		AddHead((struct List*)&du->du_ReadOrphanList, (struct Node*)ior);
+		ReleaseSemaphore(&du->du_ReadOrphanListSem);
+	} else DevTermIO(db, (struct IORequest *)ior);
+}
+
+// Hands a received frame to every opener with a CMD_READ waiting for its type. The frame is copied straight out of
+// the receive buffer by each opener's own CopyToBuff. legacyFrame is set if it's in SCSIWifi_receiveFrame format.
+// Returns how many openers were waiting for it, including any whose packet filter turned it down
+USHORT deliverToReaders(DEVBASEP, DEVUNITP, UBYTE* packet, USHORT packetSize, USHORT packetType, BOOL legacyFrame) {
+	USHORT wanted = 0;
+	USHORT delivered = 0;
+
+	ObtainSemaphore(&du->du_ReadListSem);
+	for (struct BufferManagement* bm = (struct BufferManagement*)du->du_Openers.mlh_Head; bm->bm_Node.mln_Succ; bm = (struct BufferManagement*)bm->bm_Node.mln_Succ) {
+		struct IOSana2Req *ior;
+		for (ior = (struct IOSana2Req *)bm->bm_ReadList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
+			if (ior->ios2_PacketType == packetType) {
+				ULONG result = legacyFrame ? read_frame(db, du, ior, packet, packetSize) : receivePacket(db, du, packet, packetSize, ior);
+				wanted++;
+				// A filtered frame isn't for this opener at all, so its request stays queued for the next one
+				if (result != RECV_FILTERED) {
+					Remove((struct Node*)ior);
+					DevTermIO(db, (struct IORequest *)ior);
+					delivered++;
+				}
+				break;
+			}
+		}
+	}
+	ReleaseSemaphore(&du->du_ReadListSem);
+
+	if (delivered) du->du_DevStats.PacketsReceived++;
+	return wanted;
+}
+
+// Decides if a received frame is passed on. Once our address is known ARP requests for other hosts are dropped, and
+// broadcast/multicast frames are rate limited per packet type so a storm can't swamp the machine
+BOOL rxAdmit(DEVUNITP, UBYTE* frame, USHORT size) {
+	if (!(frame[0] & 0x01)) return TRUE;   // Sent to us
+	const USHORT packetType = ((USHORT)frame[12] << 8) | (USHORT)frame[13];
+
+	if ((du->du_BcastFilter) && (packetType == 0x0806) && (size >= HW_ETH_HDR_SIZE + 28) && (frame[20] == 0) && (frame[21] == 1) &&
+		(du->du_IPAddress[0] | du->du_IPAddress[1] | du->du_IPAddress[2] | du->du_IPAddress[3]) &&
+		(memcmp(&frame[HW_ETH_HDR_SIZE + 24], du->du_IPAddress, 4))) {
+		du->du_ArpFiltered++;
+		return FALSE;
+	}
+	if (!du->du_BcastRate) return TRUE;
+
+	// Find this type's bucket, the last one is shared by any types that don't get their own
+	struct BcastBucket* bucket = du->du_BcastBuckets;
+	const ULONG full = (ULONG)du->du_BcastRate << 4;
+	for (USHORT i=0; i<SCSIDAYNA_BCAST_BUCKETS-1; i++, bucket++) {
+		if (bucket->bb_Type == packetType) break;
+		if (!bucket->bb_Type) {
+			bucket->bb_Type = packetType;
+			bucket->bb_Tokens = full;
+			bucket->bb_Slice = du->du_BcastSlice;
+			break;
+		}
+	}
+
+	// Top up by the rate for every 1/16th of a second gone by. Tokens are in 1/16ths of a frame
+	ULONG elapsed = du->du_BcastSlice - bucket->bb_Slice;
+	bucket->bb_Slice = du->du_BcastSlice;
+	if (elapsed >= 16) bucket->bb_Tokens = full; else {
+		while (elapsed--) bucket->bb_Tokens += du->du_BcastRate;
+		if (bucket->bb_Tokens > full) bucket->bb_Tokens = full;
+	}
+	if (bucket->bb_Tokens < 16) {
+		du->du_BcastLimited++;
+		return FALSE;
+	}
+	bucket->bb_Tokens -= 16;
+	return TRUE;
+}
+
+// Hands out a batch of received packets in AmigaNET format to the waiting readers. headerSize is AMIGANET_RECV_HEADER_SIZE
+// or AMIGANET_RECV_CREDIT_HEADER_SIZE. Returns how many were picked up by a CMD_READ
+USHORT dispatchRecvBatch(DEVBASEP, DEVUNITP, UBYTE* packetData, ULONG dataReceived, USHORT headerSize) {
+	USHORT counter = 0;
+	USHORT numPackets = ((USHORT)packetData[0] << 8) | (USHORT)packetData[1];						
+	UBYTE* dataStart = &packetData[headerSize];
+	dataReceived -= headerSize;
+							
+	// Receive packets
+	while (numPackets>0) {
+		if (dataReceived<4) {
+			logMessage(db,"PacketServer: Buffer underrun [1]");
+			break;
+		}
+		const USHORT sizeField = ((USHORT)dataStart[0]  << 8) | (USHORT)dataStart[1];
+		const USHORT storedSize = sizeField & ~AMIGANET_COMPACT_HEADER;
+		dataStart+= 2;
+		dataReceived-=2;
+		
+		if (storedSize > dataReceived) {
+			logMessage(db,"PacketServer: Buffer underrun [2]");
+			break;
+		}
+
+		// Compact header? The destination is replaced by a class byte, so rebuild it over the bytes before the
+		// source address. They've already been read (or are the previous packet which has been delivered)
+		UBYTE* frame = dataStart;
+		USHORT packetSize = storedSize;
+		if ((sizeField & AMIGANET_COMPACT_HEADER) && (storedSize > 1)) {
+			const UBYTE destClass = dataStart[0];
+			frame = dataStart + 1 - HW_ADDRFIELDSIZE;
+			packetSize = storedSize - 1 + HW_ADDRFIELDSIZE;
+			if (destClass == AMIGANET_DEST_BROADCAST) memset(frame, 0xFF, HW_ADDRFIELDSIZE);
+				else memcpy(frame, du->du_MAC, HW_ADDRFIELDSIZE);
+		}
+
+		// Check packet has minimum size for Ethernet header
+		if (packetSize < 14) {
+			logMessage(db,"PacketServer: Warn - Packet too small");
+			dataStart += storedSize;
+			dataReceived -= storedSize;
+			numPackets--;
+			continue;
+		}
+		
+		const USHORT packetType = ((USHORT)frame[12] << 8)| ((USHORT)frame[13]);							
+		//logMessagef(db,"PacketServer: Received Packet type %lx received, size=%ld", packetType, packetSize);
+		
+		if (du->du_Capture) Capture_frame(du->du_Capture, frame, packetSize);
+
+		// Dropped by the broadcast filter?
+		if (!rxAdmit(du, frame, packetSize)) {
+			dataStart += storedSize;
+			dataReceived -= storedSize;
+			numPackets--;
+			continue;
+		}
+		
+		// Nothing wanted it?
+		if (deliverToReaders(db, du, frame, packetSize, packetType, FALSE)) counter++; else {			
+			du->du_DevStats.UnknownTypesReceived++;
+			struct IOSana2Req *ior;
+			ObtainSemaphore(&du->du_ReadOrphanListSem);
+			ior = (struct IOSana2Req *)RemHead((struct List*)&du->du_ReadOrphanList);
+			ReleaseSemaphore(&du->du_ReadOrphanListSem);
+
+			if (!ior) {
+				// No orphan buffer - signal problem
+				DoEvent(db, du, S2EVENT_BUFF | S2EVENT_RX);  // Signal BEFORE dropping        
+				// Very brief delay (1-2 ticks) to let RoadShow post a buffer
+				Delay(1);
+				// Try ONE more time
+				ObtainSemaphore(&du->du_ReadOrphanListSem);
+				ior = (struct IOSana2Req *)RemHead((struct List*)&du->du_ReadOrphanList);
+				ReleaseSemaphore(&du->du_ReadOrphanListSem);        
+				if (!ior) {
+					// Still no buffer - drop it
+					logMessagef(db,"PacketServer: Warn - Orphaned packet not picked up of type %lx", packetType);
+					du->du_DevStats.Overruns++;
+					DoEvent(db, du, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE | S2EVENT_RX);
+				} else {
+					//logMessagef(db, "PacketServer: Buffer arrived after signal - packet saved");
+					deliverOrphan(db, du, ior, frame, packetSize, FALSE);
+				}
+			} else {
+				deliverOrphan(db, du, ior, frame, packetSize, FALSE);
+				//logMessagef(db,"PacketServer: Warn - Orphaned packet picked up of type %lx", packetType);
+			} 								
+		}
+		
+		dataReceived -= storedSize;
+		
+		numPackets--;
+		dataStart += storedSize;
+	}						
+	return counter;
+}
+
+// Start building a new batch of packets to send in AmigaNET mode. If credit isn't NULL the batch is kept within it
+void batchBegin(DEVUNITP, struct TxBatch* batch, UBYTE* data, struct IOSana2Req** pendingSends, struct TxCredit* credit) {
+	batch->tb_Data = data;
+	batch->tb_DataOut = &data[2];  // 2 bytes header at the front
+	batch->tb_SpaceRemaining = ((du->du_busyBatchLimit) && (du->du_busyBatchLimit < du->du_maxPacketsSize) ? du->du_busyBatchLimit : du->du_maxPacketsSize) - 2;
+	batch->tb_Count = 0;
+	batch->tb_MaxCount = du->du_maxPackets;
+	batch->tb_PendingSends = pendingSends;
+	batch->tb_PendingSendsSave = pendingSends;
+	if (credit) {
+		if (credit->tc_Bytes < batch->tb_SpaceRemaining) batch->tb_SpaceRemaining = credit->tc_Bytes;
+		if (credit->tc_Slots < batch->tb_MaxCount) batch->tb_MaxCount = credit->tc_Slots;
+	}
+	batch->tb_Full = !batch->tb_MaxCount;
+}
+
+// Copies a request into the batch and removes it from the write list. Returns 0 and marks the batch full
+// if it wont fit (the request is left queued), or -1 if the copy failed and the request was failed
+LONG batchAddPacket(DEVBASEP, DEVUNITP, struct TxBatch* batch, struct IOSana2Req* ior) {
+	USHORT sz = ior->ios2_DataLength;					
+	UBYTE* dataOut = batch->tb_DataOut;
+
+	// Calculate packet size
+	if (ior->ios2_Req.io_Flags & SANA2IOF_RAW) {
+		if (sz + 2 > batch->tb_SpaceRemaining) {
+			batch->tb_Full = 1;
+			return 0;
+		}
+		dataOut[0] = sz >> 8;
+		dataOut[1] = sz & 0xFF;
+		dataOut+=2;
+	} else {
+		// In compact mode the source address is left for the firmware to fill in
+		const USHORT headerSize = du->du_compactMode ? HW_ETH_HDR_SIZE - HW_ADDRFIELDSIZE : HW_ETH_HDR_SIZE;
+		USHORT storedSize = sz + headerSize;
+		if (storedSize + 2 > batch->tb_SpaceRemaining) {
+			batch->tb_Full = 1;
+			return 0;
+		}
+		if (du->du_compactMode) storedSize |= AMIGANET_COMPACT_HEADER;
+		dataOut[0] = storedSize >> 8;
+		dataOut[1] = storedSize & 0xFF;
+		dataOut+=2;
+
+		// Add ethernet header. Packets can start on an odd address so the type is written a byte at a time
+		memcpy(dataOut, ior->ios2_DstAddr, HW_ADDRFIELDSIZE);
+		if (!du->du_compactMode) memcpy(dataOut+6, du->du_MAC, HW_ADDRFIELDSIZE);
+		dataOut[headerSize-2] = (UBYTE)(ior->ios2_PacketType >> 8);
+		dataOut[headerSize-1] = (UBYTE)ior->ios2_PacketType;
+		dataOut += headerSize;
+	}
+	Remove((struct Node*)ior);
+	txDequeued(du, ior);
+
+	// Add the data
+	struct BufferManagement *bm = (struct BufferManagement *)ior->ios2_BufferManagement;				   
+	if (!(*bm->bm_CopyFromBuffer)(dataOut, ior->ios2_Data, sz)) {
+		ior->ios2_Req.io_Error = S2ERR_SOFTWARE;
+		ior->ios2_WireError = S2WERR_BUFF_ERROR;
+		DoEvent(db, du, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
+		D(("bm_CopyFromBuffer FAIL"));		
+		DevTermIO(db, (struct IORequest *)ior);
+		return -1;
+	}
+
+	if (du->du_LearnAddress) {
+		if (ior->ios2_Req.io_Flags & SANA2IOF_RAW) {
+			if (sz >= HW_ETH_HDR_SIZE) learnAddress(du, ((USHORT)dataOut[12] << 8) | (USHORT)dataOut[13], dataOut + HW_ETH_HDR_SIZE, sz - HW_ETH_HDR_SIZE);
+		} else learnAddress(du, (USHORT)ior->ios2_PacketType, dataOut, sz);
+	}
+
+	if (batch->tb_PendingSendsSave) {
+		*batch->tb_PendingSendsSave = ior; 
+		batch->tb_PendingSendsSave++;
+	} else {
+		ior->ios2_Req.io_Error = ior->ios2_WireError = 0;
+		du->du_DevStats.PacketsSent++;
+		DevTermIO(db, (struct IORequest *)ior);
+	}						
+	dataOut += sz;
+	batch->tb_SpaceRemaining -= dataOut - batch->tb_DataOut;
+	batch->tb_DataOut = dataOut;
+	batch->tb_Count++;
+	if (batch->tb_Count >= batch->tb_MaxCount) batch->tb_Full = 1;   // limit packet total
+	return 1;
+}
+
+// Copies count frames of a batch that has been sent into the capture, putting back any source address left out.
+// data points at the first frame's size field
+void captureBatch(DEVUNITP, UBYTE* data, USHORT count) {
+	for (USHORT i=0; i<count; i++) {
+		USHORT sizeField = ((USHORT)data[0] << 8) | (USHORT)data[1];
+		USHORT packetSize = sizeField & ~AMIGANET_COMPACT_HEADER;
+		if ((sizeField & AMIGANET_COMPACT_HEADER) && (packetSize >= HW_ADDRFIELDSIZE)) {
+			UBYTE header[HW_ADDRFIELDSIZE * 2];
+			memcpy(header, &data[2], HW_ADDRFIELDSIZE);
+			memcpy(&header[HW_ADDRFIELDSIZE], du->du_MAC, HW_ADDRFIELDSIZE);
+			Capture_framePrefixed(du->du_Capture, header, sizeof(header), &data[2+HW_ADDRFIELDSIZE], packetSize-HW_ADDRFIELDSIZE);
+		} else Capture_frame(du->du_Capture, &data[2], packetSize);
+		data += packetSize + 2;
+	}
+}
+
+// Completes the next count requests waiting on a batch, with error set to 0 if they were sent
+void batchComplete(DEVBASEP, DEVUNITP, struct TxBatch* batch, USHORT count, BYTE error) {
+	if (!batch->tb_PendingSends) return;    // They were completed as they were copied
+	struct IOSana2Req **end = batch->tb_PendingSends + count;
+	if (end > batch->tb_PendingSendsSave) end = batch->tb_PendingSendsSave;
+	for (; batch->tb_PendingSends < end; batch->tb_PendingSends++) {
+		struct IOSana2Req *ior = *batch->tb_PendingSends;
+		ior->ios2_Req.io_Error = error;
+		ior->ios2_WireError = error ? S2WERR_GENERIC_ERROR : 0;
+		DevTermIO(db, (struct IORequest *)ior);
+		if (error) DoEvent(db, du, S2EVENT_ERROR | S2EVENT_TX | S2EVENT_HARDWARE); else du->du_DevStats.PacketsSent++;
+	}
+}
+
+// Sends a batch to the device and completes the requests in it. If the send fails in a way that's worth retrying
+// (eg: a bus glitch) it's tried again after a short wait, leaving out any packets the firmware says it took
+void batchSend(DEVBASEP, DEVUNITP, SCSIWIFIDevice scsiDevice, struct TxBatch* batch) {
+	if (!batch->tb_Count) return;
+
+	UBYTE* data = batch->tb_Data;
+	USHORT remaining = batch->tb_Count;
+	for (USHORT attempt = 0; ; attempt++) {
+		data[0] = remaining >> 8;
+		data[1] = remaining & 0xFF;
+		if (SCSIWifi_AmigaNetSendFrames(scsiDevice, data, batch->tb_DataOut - data)) {
+			//logMessagef(db,"PacketServer: Sent %ld Packets (Total Size=%ld)", remaining, batch->tb_DataOut - data);
+			batchComplete(db, du, batch, remaining, 0);
+			if (du->du_Capture) captureBatch(du, &data[2], remaining);
+			return;
+		}
+
+		D(("SEND FAIL"));
+		struct SCSIWifi_Error error;
+		enum SCSIWifi_ErrorClass errorClass = SCSIWifi_getLastError(scsiDevice, &error);
+		du->du_TxErrors++;
+		logMessagef(db,"PacketServer: Warning - Send Failed to Device (error %ld, status %lx, sense %lx/%lx/%lx)", error.ioError, error.status, error.senseKey, error.asc, error.ascq);
+
+		// Drop the packets the firmware took. The rest are moved down rather than sent from where they are, as packets
+		// can start on odd addresses and some controllers (eg: WD33C93) can't DMA from those
+		if ((error.infoValid) && (error.information > 0) && (error.information < remaining)) {
+			USHORT accepted = (USHORT)error.information;
+			UBYTE* next = &data[2];
+			for (USHORT i=0; i<accepted; i++) next += ((((USHORT)next[0] << 8) | (USHORT)next[1]) & ~AMIGANET_COMPACT_HEADER) + 2;
+			batchComplete(db, du, batch, accepted, 0);
+			if (du->du_Capture) captureBatch(du, &data[2], accepted);
+			memmove(&data[2], next, batch->tb_DataOut - next);
+			batch->tb_DataOut -= next - &data[2];
+			remaining -= accepted;
+		}
+
+		if ((errorClass != swecTransient) || (attempt >= TX_RETRIES)) break;
+		du->du_TxRetries++;
+		Delay(1 << attempt);
+	}
+
+	batchComplete(db, du, batch, remaining, S2ERR_TX_FAILURE);
+}
+
+// Copies the start of a queued write into peek. Returns where its IP header starts, with length and packetType
+// set to how much of it was copied and its ethernet type
+UBYTE* peekPacket(struct IOSana2Req* ior, UBYTE* peek, USHORT* length, USHORT* packetType) {
+	USHORT size = ior->ios2_DataLength;
+	if (size > FLOW_PEEK_SIZE) size = FLOW_PEEK_SIZE;
+	*packetType = (USHORT)ior->ios2_PacketType;
+
+	struct BufferManagement *bm = (struct BufferManagement *)ior->ios2_BufferManagement;				   
+	if (!(*bm->bm_CopyFromBuffer)(peek, ior->ios2_Data, size)) size = 0;
+	if (ior->ios2_Req.io_Flags & SANA2IOF_RAW) {
+		if (size < HW_ETH_HDR_SIZE) size = HW_ETH_HDR_SIZE;
+		*packetType = ((USHORT)peek[12] << 8) | (USHORT)peek[13];
+		*length = size - HW_ETH_HDR_SIZE;
+		return peek + HW_ETH_HDR_SIZE;
+	}
+	*length = size;
+	return peek;
+}
+
+// Works out a queued write's flow, whether it goes in the priority queue and if it's a pure ACK, from the start of its IP header.
+// The result is cached in the request's ln_Pri (cleared by BeginIO) so each packet is only looked at once
+UBYTE classifyPacket(struct IOSana2Req* ior, UBYTE* peek, USHORT txPriority) {
+	UBYTE cls = (UBYTE)ior->ios2_Req.io_Message.mn_Node.ln_Pri;
+	if (cls & TXCLASS_DONE) return cls;
+
+	USHORT length, packetType;
+	UBYTE* ip = peekPacket(ior, peek, &length, &packetType);
+	UBYTE hash = 0;
+	UBYTE priority = 0;
+	cls = TXCLASS_DONE;
+
+	if (packetType == 0x0800) {
+		USHORT headerSize = (ip[0] & 0x0F) << 2;
+		if (length >= 20) {
+			UBYTE* transport = ip + headerSize;
+			BOOL whole = (!(ip[6] & 0x3F)) && (!ip[7]);   // Fragments dont carry the ports, so only the first 'whole' packet can use them
+			for (USHORT i=12; i<20; i++) hash ^= ip[i];
+			hash ^= ip[9];
+			if (((ip[9] == 6) || (ip[9] == 17)) && (whole) && (length >= headerSize + 4))
+				hash ^= transport[0] ^ transport[1] ^ transport[2] ^ transport[3];
+
+			if ((ip[9] == 1) && (txPriority & TXPRIORITY_ICMP)) priority = 1;
+			if ((ip[9] == 6) && (whole) && (length >= headerSize + 14)) {
+				// A pure ACK is just the headers, with none of SYN, FIN or RST set
+				USHORT totalLength = ((USHORT)ip[2] << 8) | (USHORT)ip[3];
+				if (totalLength == headerSize + ((transport[12] >> 4) << 2)) {
+					if (((transport[13] & 0x17) == 0x10) && (txPriority & TXPRIORITY_ACK)) priority = 1;
+					if (transport[13] == 0x10) cls |= TXCLASS_PUREACK;
+				}
+			}
+			if ((ip[9] == 17) && (whole) && (txPriority & TXPRIORITY_DNS) && (length >= headerSize + 4) &&
+				(((transport[0] == 0) && (transport[1] == 53)) || ((transport[2] == 0) && (transport[3] == 53)))) priority = 1;
+		}
+	} else if (packetType == 0x86DD) {
+		if (length >= 40) {
+			UBYTE* transport = ip + 40;
+			for (USHORT i=8; i<40; i++) hash ^= ip[i];
+			hash ^= ip[6];
+			if (((ip[6] == 6) || (ip[6] == 17)) && (length >= 44)) hash ^= transport[0] ^ transport[1] ^ transport[2] ^ transport[3];
+
+			if ((ip[6] == 58) && (txPriority & TXPRIORITY_ICMP)) priority = 1;
+			if ((ip[6] == 6) && (length >= 40 + 14)) {
+				USHORT payloadLength = ((USHORT)ip[4] << 8) | (USHORT)ip[5];
+				if (payloadLength == ((transport[12] >> 4) << 2)) {
+					if (((transport[13] & 0x17) == 0x10) && (txPriority & TXPRIORITY_ACK)) priority = 1;
+					if (transport[13] == 0x10) cls |= TXCLASS_PUREACK;
+				}
+			}
+			if ((ip[6] == 17) && (txPriority & TXPRIORITY_DNS) && (length >= 44) &&
+				(((transport[0] == 0) && (transport[1] == 53)) || ((transport[2] == 0) && (transport[3] == 53)))) priority = 1;
+		}
+	} else if ((packetType == 0x0806) && (txPriority & TXPRIORITY_ARP)) priority = 1;
+
+	cls |= (hash ^ (hash >> 5)) & TXCLASS_HASHMASK;
+	if (priority) cls |= TXCLASS_PRIORITY;
+	ior->ios2_Req.io_Message.mn_Node.ln_Pri = (BYTE)cls;
+	return cls;
+}
+
+// Returns TRUE if the pure ACK in later makes the earlier one pointless: same addresses, ports and window, a newer
+// ACK number, and the earlier one carries no SACK blocks. Duplicate ACKs are never thinned as they trigger fast retransmit
+BOOL ackSuperseded(struct IOSana2Req* earlier, struct IOSana2Req* later, UBYTE* earlierPeek, UBYTE* laterPeek) {
+	USHORT earlierLength, laterLength, earlierType, laterType, addrStart, headerSize;
+	UBYTE* earlierIp = peekPacket(earlier, earlierPeek, &earlierLength, &earlierType);
+	UBYTE* laterIp = peekPacket(later, laterPeek, &laterLength, &laterType);
+	if (earlierType != laterType) return FALSE;
+	if (earlierType == 0x0800) {
+		if (earlierLength < 20) return FALSE;
+		addrStart = 12;
+		headerSize = (earlierIp[0] & 0x0F) << 2;
+		if (headerSize != (laterIp[0] & 0x0F) << 2) return FALSE;
+	} else if (earlierType == 0x86DD) {
+		addrStart = 8;
+		headerSize = 40;
+	} else return FALSE;
+	if ((earlierLength < headerSize + 20) || (laterLength < headerSize + 20)) return FALSE;
+	if (memcmp(earlierIp + addrStart, laterIp + addrStart, headerSize - addrStart)) return FALSE;
+
+	UBYTE* earlierTcp = earlierIp + headerSize;
+	UBYTE* laterTcp = laterIp + headerSize;
+	if (memcmp(earlierTcp, laterTcp, 4)) return FALSE;                      // ports
+	if ((earlierTcp[14] != laterTcp[14]) || (earlierTcp[15] != laterTcp[15])) return FALSE;   // window
+	ULONG earlierAck = ((ULONG)earlierTcp[8] << 24) | ((ULONG)earlierTcp[9] << 16) | ((ULONG)earlierTcp[10] << 8) | (ULONG)earlierTcp[11];
+	ULONG laterAck = ((ULONG)laterTcp[8] << 24) | ((ULONG)laterTcp[9] << 16) | ((ULONG)laterTcp[10] << 8) | (ULONG)laterTcp[11];
+	if ((laterAck == earlierAck) || (laterAck - earlierAck >= 0x80000000UL)) return FALSE;
+
+	// Look through the options for SACK (kind 5). They all have to be in the peeked part
+	USHORT tcpSize = (earlierTcp[12] >> 4) << 2;
+	if (earlierLength < headerSize + tcpSize) return FALSE;
+	for (USHORT i=20; i<tcpSize; ) {
+		UBYTE kind = earlierTcp[i];
+		if (kind == 0) break;
+		if (kind == 1) { i++; continue; }
+		if ((kind == 5) || (i + 1 >= tcpSize) || (earlierTcp[i+1] < 2)) return FALSE;
+		i += earlierTcp[i+1];
+	}
+	return TRUE;
+}
+
+// Completes queued pure ACKs that a later pure ACK of the same connection has made pointless, without sending them.
+// Call with du_WriteListSem held
+void thinAcks(DEVBASEP, DEVUNITP, UBYTE* peek, UBYTE* laterPeek, USHORT txPriority) {
+	struct IOSana2Req *ior, *nextwrite, *later;
+	for (ior = (struct IOSana2Req *)du->du_WriteList.lh_Head; (nextwrite = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) != NULL; ior = nextwrite) {
+		UBYTE cls = classifyPacket(ior, peek, txPriority);
+		if (!(cls & TXCLASS_PUREACK)) continue;
+
+		// Find the next pure ACK with the same flow hash
+		for (later = nextwrite; later->ios2_Req.io_Message.mn_Node.ln_Succ; later = (struct IOSana2Req *)later->ios2_Req.io_Message.mn_Node.ln_Succ)
+			if ((classifyPacket(later, laterPeek, txPriority) & (TXCLASS_PUREACK | TXCLASS_HASHMASK)) == (cls & (TXCLASS_PUREACK | TXCLASS_HASHMASK))) break;
+		if (!later->ios2_Req.io_Message.mn_Node.ln_Succ) continue;
+
+		if (ackSuperseded(ior, later, peek, laterPeek)) {
+			Remove((struct Node*)ior);
+			txDequeued(du, ior);
+			ior->ios2_Req.io_Error = ior->ios2_WireError = 0;
+			du->du_AcksThinned++;
+			DevTermIO(db, (struct IORequest *)ior);
+		}
+	}
+}
+
+// Picks which of the two bonded targets a packet is sent on from its flow hash (IP addresses and ports).
+// Every packet of a flow lands on the same target, so TCP ordering is kept. Non-IP traffic uses the first target
+USHORT flowTarget(struct IOSana2Req* ior, UBYTE* peek, USHORT txPriority) {
+	UBYTE hash = classifyPacket(ior, peek, txPriority) & TXCLASS_HASHMASK;
+	hash ^= hash >> 4;
+	hash ^= hash >> 2;
+	hash ^= hash >> 1;
+	return hash & 1;
+}
+
+// Packs queued writes into the batches (one per target), priority packets first. flowPeek and ackPeek are FLOW_PEEK_SIZE
+// buffers to work in. Returns TRUE if anything was left queued
+BOOL batchCollect(DEVBASEP, DEVUNITP, struct TxBatch* batches, USHORT numTxTargets, struct ScsiDaynaSettings* settings, UBYTE* flowPeek, UBYTE* ackPeek) {
+	struct IOSana2Req *nextwrite;
+
+	ObtainSemaphore(&du->du_WriteListSem);
+	if (settings->ackThin) thinAcks(db, du, flowPeek, ackPeek, settings->txPriority);
+	// Priority packets (eg: ARP and ACKs) are packed first, unless an earlier packet of the same flow is still queued
+	if (settings->txPriority) {
+		ULONG flowsWaiting = 0;   // A bit for each flow hash with a packet left queued ahead
+		for (struct IOSana2Req *ior = (struct IOSana2Req *)du->du_WriteList.lh_Head; (nextwrite = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) != NULL; ior = nextwrite) {
+			UBYTE cls = classifyPacket(ior, flowPeek, settings->txPriority);
+			ULONG flowBit = 1UL << (cls & TXCLASS_HASHMASK);
+			if ((cls & TXCLASS_PRIORITY) && (!(flowsWaiting & flowBit))) {
+				struct TxBatch* batch = &batches[(numTxTargets > 1) ? flowTarget(ior, flowPeek, settings->txPriority) : 0];
+				if ((batch->tb_Full) || (!batchAddPacket(db, du, batch, ior))) flowsWaiting |= flowBit;
+			} else flowsWaiting |= flowBit;
+			if ((batches[0].tb_Full) && ((numTxTargets < 2) || (batches[1].tb_Full))) break;
+		}
+	}
+
+	// Collect packets until not enough data space or too many
+	for (struct IOSana2Req *ior = (struct IOSana2Req *)du->du_WriteList.lh_Head; (nextwrite = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) != NULL; ior = nextwrite) {
+		// In bonded mode each flow sticks to one target so its packets stay in order
+		struct TxBatch* batch = &batches[(numTxTargets > 1) ? flowTarget(ior, flowPeek, settings->txPriority) : 0];
+		if (!batch->tb_Full) batchAddPacket(db, du, batch, ior);
+		if ((batches[0].tb_Full) && ((numTxTargets < 2) || (batches[1].tb_Full))) break;
+	}
+	BOOL txPending = du->du_WriteList.lh_Head->ln_Succ != NULL;
+	ReleaseSemaphore(&du->du_WriteListSem);
+	return txPending;
+}
+
+// Rebuilds the firmware receive filter from the packet types the openers have CMD_READs queued for, and
+// sends it if it changed. Returns 0 if the firmware doesn't support filtering
+LONG updateRecvFilter(DEVBASEP, DEVUNITP, SCSIWIFIDevice* scsiDevices, USHORT numTargets, struct SCSIWifi_Filter* lastFilter) {
+	struct SCSIWifi_Filter filter;
+	filter.flags = SCSIWIFI_FILTER_BROADCAST;
+	filter.count = 0;
+	du->du_FilterChanged = 0;
+
+	ObtainSemaphore(&du->du_ReadListSem);
+	for (struct BufferManagement* bm = (struct BufferManagement*)du->du_Openers.mlh_Head; bm->bm_Node.mln_Succ; bm = (struct BufferManagement*)bm->bm_Node.mln_Succ) {
+		struct IOSana2Req *ior;
+		for (ior = (struct IOSana2Req *)bm->bm_ReadList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
+			USHORT i;
+			for (i=0; i<filter.count; i++)
+				if (filter.etherTypes[i] == ior->ios2_PacketType) break;
+			if (i < filter.count) continue;
+			if (filter.count == SCSIWIFI_FILTER_MAX_TYPES) {
+				filter.flags |= SCSIWIFI_FILTER_ALLTYPES;
+				break;
+			}
+			filter.etherTypes[filter.count++] = ior->ios2_PacketType;
+		}
+	}
+	ReleaseSemaphore(&du->du_ReadListSem);
+
+	// Nothing reading yet, don't lose anything while the stack starts up
+	if (!filter.count) filter.flags |= SCSIWIFI_FILTER_ALLTYPES;
+	if (filter.flags & SCSIWIFI_FILTER_ALLTYPES) filter.count = 0;
+	// IPv6 neighbour discovery needs multicast, and IPv4 has mDNS, IGMP etc on it
+	for (USHORT i=0; i<filter.count; i++)
+		if ((filter.etherTypes[i] == 0x86DD) || (filter.etherTypes[i] == 0x0800)) filter.flags |= SCSIWIFI_FILTER_MULTICAST;
+	if (filter.flags & SCSIWIFI_FILTER_ALLTYPES) filter.flags |= SCSIWIFI_FILTER_MULTICAST;
+
+	if ((filter.flags == lastFilter->flags) && (filter.count == lastFilter->count) && (memcmp(filter.etherTypes, lastFilter->etherTypes, filter.count * sizeof(UWORD)) == 0)) return 1;
+
+	for (USHORT target=0; target<numTargets; target++) {
+		if (!SCSIWifi_AmigaNetSetFilter(scsiDevices[target], &filter)) {
+			logMessage(db,"PacketServer: Firmware doesn't support receive filtering");
+			du->du_FilterActive = 0;
+			return 0;
+		}
+	}
+
+	// Stop BeginIO looking at the list while it changes
+	du->du_FilterActive = 0;
+	du->du_FilterCount = filter.count;
+	for (USHORT i=0; i<filter.count; i++) du->du_FilterTypes[i] = filter.etherTypes[i];
+	du->du_FilterActive = !(filter.flags & SCSIWIFI_FILTER_ALLTYPES);
+	*lastFilter = filter;
+
+	if (du->du_FilterActive) logMessagef(db,"PacketServer: Receive filter passing %ld packet types", filter.count);
+		else logMessage(db,"PacketServer: Receive filter passing all packet types");
+	return 1;
+}
+
+// Sends our IPv4 address to the firmware so it can answer ARP for it, or turns offloading off. The counters
+// restart when this is sent so arpStats is cleared. Returns 0 if the firmware doesn't support it
+LONG updateArpOffload(DEVBASEP, DEVUNITP, SCSIWIFIDevice* scsiDevices, USHORT numTargets, UBYTE enable, struct SCSIWifi_ArpStats* arpStats) {
+	struct SCSIWifi_ArpOffload offload;
+	du->du_IPAddressChanged = 0;
+	offload.enable = enable && (du->du_IPAddress[0] | du->du_IPAddress[1] | du->du_IPAddress[2] | du->du_IPAddress[3]);
+	offload._padding = 0;
+	memcpy(offload.ipAddress, du->du_IPAddress, 4);
+
+	for (USHORT target=0; target<numTargets; target++) {
+		if (!SCSIWifi_AmigaNetSetArpOffload(scsiDevices[target], &offload)) {
+			logMessage(db,"PacketServer: Firmware doesn't support ARP offload");
+			du->du_ArpOffload = 0;
+			// The broadcast filter still needs the address
+			du->du_LearnAddress = (du->du_ArpOffload) || (du->du_BcastFilter);
+			return 0;
+		}
+		arpStats[target].repliesSent = arpStats[target].requestsDropped = 0;
+	}
+	if (offload.enable) logMessagef(db,"PacketServer: ARP offload for %ld.%ld.%ld.%ld", offload.ipAddress[0], offload.ipAddress[1], offload.ipAddress[2], offload.ipAddress[3]);
+	return 1;
+}
+
+// Adds on how much the firmware's ARP offload counters have gone up since they were last read
+void readArpStats(DEVUNITP, SCSIWIFIDevice* scsiDevices, USHORT numTargets, struct SCSIWifi_ArpStats* arpStats) {
+	for (USHORT target=0; target<numTargets; target++) {
+		struct SCSIWifi_ArpStats stats;
+		if (!SCSIWifi_AmigaNetGetArpStats(scsiDevices[target], &stats)) continue;
+		du->du_ArpRepliesOffloaded += stats.repliesSent - arpStats[target].repliesSent;
+		du->du_ArpRequestsDropped += stats.requestsDropped - arpStats[target].requestsDropped;
+		arpStats[target] = stats;
+	}
+}
+
+// Replies to every queued Wifi management request for command with the cached result, or fails them with error. The
+// caller must hold du_WifiListSem
+void completeWifiRequests(DEVBASEP, DEVUNITP, UWORD command, BYTE error) {
+	struct IOSana2Req *ior, *next;
+	for (ior = (struct IOSana2Req *)du->du_WifiList.lh_Head; next = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = next) {
+		if (ior->ios2_Req.io_Command != command) continue;
+		Remove((struct Node*)ior);
+		if ((error) || (!copyWifiResult((struct WifiCache*)du->du_WifiCache, ior))) {
+			ior->ios2_Req.io_Error = error ? error : S2ERR_SOFTWARE;
+			ior->ios2_WireError = S2WERR_GENERIC_ERROR;
+		}
+		DevTermIO(db, (struct IORequest*)ior);
+	}
+}
+
+// Carries out the queued Wifi management requests on the main device. A scan is started and then checked on every
+// WIFI_SCAN_POLL, so packets keep flowing while the firmware scans. buffer is used for reading the status. Returns TRUE
+// if a network was joined
+BOOL serviceWifiRequests(DEVBASEP, DEVUNITP, SCSIWIFIDevice scsiDevice, struct SCSIWifi_NetworkEntry* buffer, ULONG timeSlice) {
+	struct WifiCache* cache = (struct WifiCache*)du->du_WifiCache;
+	struct IOSana2Req* ior;
+	UBYTE wantScan = 0, wantNetwork = 0, join;
+	BOOL joined = FALSE;
+
+	// Joins go one at a time in the order they were asked for
+	do {
+		join = 0;
+		ObtainSemaphore(&du->du_WifiListSem);
+		for (ior = (struct IOSana2Req *)du->du_WifiList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
+			if (ior->ios2_Req.io_Command == S2_SCSIDAYNA_JOINNETWORK) {
+				Remove((struct Node*)ior);
+				join = 1;
+				break;
+			}
+			if (ior->ios2_Req.io_Command == S2_SCSIDAYNA_GETNETWORK) wantNetwork = 1; else wantScan = 1;
+		}
+		ReleaseSemaphore(&du->du_WifiListSem);
+		if (join) {
+			struct SCSIWifi_JoinRequest request;
+			memcpy(&request, ior->ios2_StatData, sizeof(request));
+			request.ssid[sizeof(request.ssid) - 1] = '\0';
+			request.key[sizeof(request.key) - 1] = '\0';
+			if ((!request.channel) && (du->du_LastChannel) && (strcmp(du->du_LastSSID, request.ssid) == 0)) request.channel = du->du_LastChannel;
+			if (SCSIWifi_joinNetwork(scsiDevice, &request)) {
+				logMessagef(db,"PacketServer: Requesting to Join WIFI Network %s", request.ssid);
+				joined = TRUE;
+			} else {
+				ior->ios2_Req.io_Error = S2ERR_TX_FAILURE;
+				ior->ios2_WireError = S2WERR_GENERIC_ERROR;
+			}
+			// Whatever was cached is out of date now
+			ObtainSemaphore(&du->du_WifiListSem);
+			cache->wc_NetworkValid = 0;
+			ReleaseSemaphore(&du->du_WifiListSem);
+			DevTermIO(db, (struct IORequest*)ior);
+		}
+	} while (join);
+
+	if (wantNetwork) {
+		BOOL ok = SCSIWifi_getNetwork(scsiDevice, buffer);
+		ObtainSemaphore(&du->du_WifiListSem);
+		if (ok) {
+			memcpy(&cache->wc_Network, buffer, sizeof(struct SCSIWifi_NetworkEntry));
+			cache->wc_NetworkValid = 1;
+		}
+		completeWifiRequests(db, du, S2_SCSIDAYNA_GETNETWORK, ok ? 0 : S2ERR_TX_FAILURE);
+		ReleaseSemaphore(&du->du_WifiListSem);
+	}
+
+	if (cache->wc_Scanning) {
+		enum SCSIWifi_ScanStatus status;
+		if (timeSlice - cache->wc_ScanPolled < WIFI_SCAN_POLL) return joined;
+		cache->wc_ScanPolled = timeSlice;
+		if (!SCSIWifi_scanComplete(scsiDevice, &status)) status = swssError;
+		if (status == swssBusy) {
+			if (timeSlice - cache->wc_ScanStarted < WIFI_SCAN_TIMEOUT) return joined;
+			logMessage(db,"PacketServer: Wifi scan timed out");
+			status = swssError;
+		}
+		cache->wc_Scanning = 0;
+
+		// The old results go while the new ones are read straight into the cache
+		ObtainSemaphore(&du->du_WifiListSem);
+		cache->wc_ScanValid = 0;
+		ReleaseSemaphore(&du->du_WifiListSem);
+		BOOL ok = (status == swssComplete) && (SCSIWifi_getScanResults(scsiDevice, &cache->wc_Scan));
+		ObtainSemaphore(&du->du_WifiListSem);
+		cache->wc_ScanValid = ok;
+		completeWifiRequests(db, du, S2_SCSIDAYNA_WIFISCAN, ok ? 0 : S2ERR_TX_FAILURE);
+		completeWifiRequests(db, du, S2_SCSIDAYNA_SCANRESULTS, ok ? 0 : S2ERR_TX_FAILURE);
+		ReleaseSemaphore(&du->du_WifiListSem);
+		if (ok) logMessagef(db,"PacketServer: Wifi scan found %ld networks", cache->wc_Scan.count);
+	} else if (wantScan) {
+		enum SCSIWifi_ScanStatus status;
+		if (SCSIWifi_scan(scsiDevice, &status)) {
+			cache->wc_Scanning = 1;
+			cache->wc_ScanStarted = cache->wc_ScanPolled = timeSlice;
+		} else {
+			logMessage(db,"PacketServer: Failed to start a Wifi scan");
+			ObtainSemaphore(&du->du_WifiListSem);
+			completeWifiRequests(db, du, S2_SCSIDAYNA_WIFISCAN, S2ERR_TX_FAILURE);
+			completeWifiRequests(db, du, S2_SCSIDAYNA_SCANRESULTS, S2ERR_TX_FAILURE);
+			ReleaseSemaphore(&du->du_WifiListSem);
+		}
+	}
+	return joined;
+}
+
+// Changes one SCSIDAYNA_SET_* setting, which must already be inside controlMin and controlMax
+void applySetting(DEVBASEP, struct ScsiDaynaSettings* settings, UWORD setting, LONG value) {
+	switch (setting) {
+		case SCSIDAYNA_SET_PRIORITY:    settings->taskPriority = value; break;
+		case SCSIDAYNA_SET_DATASIZE:    settings->maxDataSize = value; break;
+		case SCSIDAYNA_SET_DEBUG:       ((struct ScsiDaynaSettings*)db->db_scsiSettings)->debug = value; break;
+		case SCSIDAYNA_SET_RXQUANTUM:   settings->rxQuantum = value; break;
+		case SCSIDAYNA_SET_TXQUANTUM:   settings->txQuantum = value; break;
+		case SCSIDAYNA_SET_TXPRIORITY:  settings->txPriority = value; break;
+		case SCSIDAYNA_SET_ACKTHIN:     settings->ackThin = value; break;
+		case SCSIDAYNA_SET_BCASTFILTER: settings->bcastFilter = value; break;
+		case SCSIDAYNA_SET_BCASTRATE:   settings->bcastRate = value; break;
+	}
+}
+
+// As applySetting, but a value outside the limits is clamped to them
+void applySettingClamped(DEVBASEP, struct ScsiDaynaSettings* settings, UWORD setting, LONG value) {
+	if (value < controlMin[setting]) value = controlMin[setting];
+	if (value > controlMax[setting]) value = controlMax[setting];
+	applySetting(db, settings, setting, value);
+}
+
+// Re-reads the prefs file after it changed. Only the settings the control port can change are taken, the rest still
+// need the device reloading
+void reloadSettings(DEVBASEP, DEVUNITP, struct ScsiDaynaSettings* settings) {
+	struct ScsiDaynaSettings* loaded = (struct ScsiDaynaSettings*)AllocVec(sizeof(struct ScsiDaynaSettings), MEMF_ANY);
+	if (!loaded) return;
+	if (SCSIWifi_loadUnitSettings((void*)UtilityBase, (void*)DOSBase, loaded, du->du_UnitNum)) {
+		applySettingClamped(db, settings, SCSIDAYNA_SET_PRIORITY, loaded->taskPriority);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_DATASIZE, loaded->maxDataSize);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_DEBUG, loaded->debug);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_RXQUANTUM, loaded->rxQuantum);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_TXQUANTUM, loaded->txQuantum);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_TXPRIORITY, loaded->txPriority);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_ACKTHIN, loaded->ackThin);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_BCASTFILTER, loaded->bcastFilter);
+		applySettingClamped(db, settings, SCSIDAYNA_SET_BCASTRATE, loaded->bcastRate);
+		logMessage(db,"PacketServer: Settings file changed, reloaded");
+		logSettings(db, du);
+	} else logMessage(db,"PacketServer: Settings file changed but isn't valid, ignored");
+	FreeVec(loaded);
+}
+
+// Reads or changes a setting for a message from the control port
+void controlSetting(DEVBASEP, struct ScsiDaynaSettings* settings, struct ScsiDaynaControl* ctrl) {
+	const LONG value = ctrl->sc_Value;
+	ctrl->sc_Error = S2ERR_NO_ERROR;
+	if ((ctrl->sc_Command > SCSIDAYNA_CTRL_SET) || (ctrl->sc_Setting >= NUM_CONTROL_SETTINGS)) {
+		ctrl->sc_Error = S2ERR_NOT_SUPPORTED;
+		return;
+	}
+	if (ctrl->sc_Command == SCSIDAYNA_CTRL_SET) {
+		if ((value < controlMin[ctrl->sc_Setting]) || (value > controlMax[ctrl->sc_Setting])) {
+			ctrl->sc_Error = S2ERR_BAD_ARGUMENT;
+			return;
+		}
+		applySetting(db, settings, ctrl->sc_Setting, value);
+		logMessagef(db,"PacketServer: Setting %ld changed to %ld", ctrl->sc_Setting, value);
+	}
+	switch (ctrl->sc_Setting) {
+		case SCSIDAYNA_SET_PRIORITY:    ctrl->sc_Value = settings->taskPriority; break;
+		case SCSIDAYNA_SET_DATASIZE:    ctrl->sc_Value = settings->maxDataSize; break;
+		case SCSIDAYNA_SET_DEBUG:       ctrl->sc_Value = ((struct ScsiDaynaSettings*)db->db_scsiSettings)->debug; break;
+		case SCSIDAYNA_SET_RXQUANTUM:   ctrl->sc_Value = settings->rxQuantum; break;
+		case SCSIDAYNA_SET_TXQUANTUM:   ctrl->sc_Value = settings->txQuantum; break;
+		case SCSIDAYNA_SET_TXPRIORITY:  ctrl->sc_Value = settings->txPriority; break;
+		case SCSIDAYNA_SET_ACKTHIN:     ctrl->sc_Value = settings->ackThin; break;
+		case SCSIDAYNA_SET_BCASTFILTER: ctrl->sc_Value = settings->bcastFilter; break;
+		case SCSIDAYNA_SET_BCASTRATE:   ctrl->sc_Value = settings->bcastRate; break;
+	}
+}
+
+// Swaps the batch buffers for ones of the size DATASIZE now asks for. If there isn't the memory the old ones are kept
+void resizeBatchBuffers(DEVBASEP, DEVUNITP, ULONG maxDataSize, UBYTE** packetData, UBYTE** bondData) {
+	ULONG size = ((du->du_maxBatchLimit > maxDataSize) ? maxDataSize : du->du_maxBatchLimit) & 0xFFFFFFFEUL;
+	if (size == du->du_maxPacketsSize) return;
+
+	UBYTE* newData = allocDMABuffer(db, du, size + 2);
+	UBYTE* newBondData = (*bondData) ? allocDMABuffer(db, du, size + 2) : NULL;
+	if ((!newData) || ((*bondData) && (!newBondData))) {
+		freeDMABuffer(db, newData);
+		freeDMABuffer(db, newBondData);
+		logMessagef(db,"PacketServer: Out of memory [5], Max Data Transfer Size stays at %ld", du->du_maxPacketsSize);
+		return;
+	}
+	freeDMABuffer(db, *packetData);
+	*packetData = newData;
+	if (*bondData) {
+		freeDMABuffer(db, *bondData);
+		*bondData = newBondData;
+	}
+	du->du_maxPacketsSize = size;
+	logMessagef(db,"PacketServer: Max Data Transfer Size now %ld", size);
+}
+
+// Sets up bus sharing. ms is the BUSSHARE setting, which is turned into microseconds with shifts as there's no 32-bit multiply
+void busShareInit(struct BusShare* bs, USHORT ms, ULONG eclockFreq) {
+	bs->bs_Baseline = 0;
+	bs->bs_Margin = eclockFreq >> 10;
+	bs->bs_MaxWait = ((ULONG)ms << 10) - ((ULONG)ms << 4) - ((ULONG)ms << 3);
+	bs->bs_Wait = BUS_FIRST_WAIT;
+	bs->bs_Score = 0;
+	bs->bs_Busy = 0;
+}
+
+// Counts how long an empty receive took. Returns TRUE if the disk has just started or stopped looking busy
+BOOL busShareSample(DEVUNITP, struct BusShare* bs, ULONG ticks) {
+	if ((!bs->bs_Baseline) || (ticks < bs->bs_Baseline)) bs->bs_Baseline = ticks;
+	if (ticks > (bs->bs_Baseline << 1) + bs->bs_Margin) {
+		bs->bs_Score += BUS_SCORE_WAITED;
+		if (bs->bs_Score > BUS_SCORE_MAX) bs->bs_Score = BUS_SCORE_MAX;
+	} else if (bs->bs_Score) bs->bs_Score--;
+
+	if ((!bs->bs_Busy) && (bs->bs_Score >= BUS_SCORE_BUSY)) {
+		bs->bs_Busy = 1;
+		du->du_busyBatchLimit = BUS_BUSY_BATCH;
+		return TRUE;
+	}
+	if ((bs->bs_Busy) && (!bs->bs_Score)) {
+		bs->bs_Busy = 0;
+		bs->bs_Wait = BUS_FIRST_WAIT;
+		du->du_busyBatchLimit = 0;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// value * by with shifts and adds, as there's no 32-bit multiply
+ULONG shiftMultiply(ULONG value, USHORT by) {
+	ULONG result = 0;
+	for (; by; by >>= 1, value <<= 1)
+		if (by & 1) result += value;
+	return result;
+}
+
+// Sets up CoDel for a target of ms milliseconds, 0 turns it off
+void codelInit(struct CoDel* cd, USHORT ms, ULONG eclockFreq) {
+	// freq/1000 is close enough to freq/1024 + freq/65536 + freq/131072
+	const ULONG ticksPerMs = (eclockFreq >> 10) + (eclockFreq >> 16) + (eclockFreq >> 17);
+	memset(cd, 0, sizeof(struct CoDel));
+	cd->cd_Target = shiftMultiply(ticksPerMs, ms);
+	cd->cd_Interval = shiftMultiply(ticksPerMs, CODEL_INTERVAL);
+	for (USHORT i=0; i<CODEL_GAPS; i++) {
+		// cd_Interval * codelInvSqrt[i] / 65536
+		ULONG gap = 0;
+		for (USHORT bit=0; bit<16; bit++)
+			if (codelInvSqrt[i] & (1 << bit)) gap += cd->cd_Interval >> (16 - bit);
+		cd->cd_Gaps[i] = gap;
+	}
+}
+
+// Drops writes from the head of the send queue while CoDel says so. now is the EClock's ev_lo
+void codelDequeue(DEVBASEP, DEVUNITP, struct CoDel* cd, ULONG now) {
+	ObtainSemaphore(&du->du_WriteListSem);
+	for (;;) {
+		struct IOSana2Req* ior = (struct IOSana2Req*)du->du_WriteList.lh_Head;
+		// Less than a packet waiting isn't a queue, however long it's been there
+		if ((!ior->ios2_Req.io_Message.mn_Node.ln_Succ) || (du->du_TxQueuedBytes <= SCSIWIFI_PACKET_MAX_SIZE) || ((LONG)(now - TXQ_STAMP(ior)) < (LONG)cd->cd_Target)) {
+			cd->cd_Above = 0;
+			cd->cd_Dropping = 0;
+			break;
+		}
+		if (!cd->cd_Above) {
+			cd->cd_Above = 1;
+			cd->cd_FirstAbove = now + cd->cd_Interval;
+			break;
+		}
+		if (!cd->cd_Dropping) {
+			if ((LONG)(now - cd->cd_FirstAbove) < 0) break;
+			// If it was dropping not long ago, carry on at about the rate it got to
+			const USHORT delta = cd->cd_Count - cd->cd_LastCount;
+			cd->cd_Count = ((delta > 1) && ((LONG)(now - cd->cd_DropNext) < (LONG)(cd->cd_Interval << 4))) ? delta : 1;
+			cd->cd_LastCount = cd->cd_Count;
+			cd->cd_DropNext = now;
+			cd->cd_Dropping = 1;
+		}
+		if ((LONG)(now - cd->cd_DropNext) < 0) break;
+
+		Remove((struct Node*)ior);
+		txDequeued(du, ior);
+		ior->ios2_Req.io_Error = S2ERR_NO_RESOURCES;
+		ior->ios2_WireError = S2WERR_GENERIC_ERROR;
+		du->du_TxDelayDropped++;
+		DevTermIO(db, (struct IORequest *)ior);
+		cd->cd_DropNext += cd->cd_Gaps[((cd->cd_Count < CODEL_GAPS) ? cd->cd_Count : CODEL_GAPS) - 1];
+		if (cd->cd_Count < 0xFFFF) cd->cd_Count++;
+	}
+	ReleaseSemaphore(&du->du_WriteListSem);
+}
+
 // This runs as a separate task!
 __saveds void frame_proc() {
 	D(("scsidayna_task: frame_proc()\n"));
@@ -829,17 +2225,19 @@ __saveds void frame_proc() {
 	}
 
 	struct devbase* db = init->db;
+	struct devunit* du = init->du;
 	// This semaphore must be obtained by this process before it replies its init message, and then
 	// hold it for its entire lifetime, otherwise the process exit won't be arbitrated properly.
-	ObtainSemaphore(&db->db_ProcSem);
+	ObtainSemaphore(&du->du_ProcSem);
   
 	// Temporary packet store
 	UBYTE* packetData;
 	struct IOSana2Req** pendingSends = NULL;
-	if (db->db_amigaNetMode) {	
-		 packetData = AllocVec(db->db_maxPacketsSize + 2, MEMF_PUBLIC);	
-		 pendingSends = (struct IOSana2Req**)AllocVec(db->db_maxPackets * sizeof(struct IOSana2Req*), MEMF_PUBLIC);	
-	} else packetData = AllocVec(SCSIWIFI_PACKET_MAX_SIZE + 6, MEMF_PUBLIC);	
+	if (du->du_amigaNetMode) {	
+		 packetData = allocDMABuffer(db, du, du->du_maxPacketsSize + 2);	
+		 pendingSends = (struct IOSana2Req**)AllocVec(du->du_maxPackets * sizeof(struct IOSana2Req*), MEMF_PUBLIC);	
+	} else packetData = allocDMABuffer(db, du, SCSIWIFI_PACKET_MAX_SIZE + 6);	
+	struct WifiCache* wifiCache = (struct WifiCache*)AllocVec(sizeof(struct WifiCache), MEMF_PUBLIC|MEMF_CLEAR);
 	
 	struct MsgPort timerPort;
 	timerPort.mp_Node.ln_Pri = 0;                       
@@ -855,9 +2253,9 @@ __saveds void frame_proc() {
 		if (time_req) errorDevOpen = OpenDevice("timer.device", UNIT_VBLANK, (struct IORequest *)time_req, 0);
 	}
 	
-	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)db->db_scsiSettings;
+	struct ScsiDaynaSettings* settings = (struct ScsiDaynaSettings*)du->du_scsiSettings;
 	
-	SCSIWIFIDevice* scsiDevice = NULL;
+	SCSIWIFIDevice scsiDevice = NULL;
 	struct SCSIDevice_OpenData openData;
 	openData.sysBase = (struct ExecBase*)SysBase;
 	openData.utilityBase = (void*)UtilityBase;
@@ -868,13 +2266,13 @@ __saveds void frame_proc() {
 	enum SCSIWifi_OpenResult scsiResult;
 	
 	D(("scsidayna: Opening SCSI Device\n"));
-	logMessagef(db,"PacketServer: Starting Wifi Device"); 
+	logMessagef(db,"PacketServer: Starting Wifi Device for Unit %ld", du->du_UnitNum); 
 	scsiDevice = SCSIWifi_open(&openData, &scsiResult);
 
-	if ((!packetData) || (errorDevOpen !=0) || (((char)timerPort.mp_SigBit) < 0) || (!time_req) | (!scsiDevice)) {
+	if ((!packetData) || (!wifiCache) || (errorDevOpen !=0) || (((char)timerPort.mp_SigBit) < 0) || (!time_req) | (!scsiDevice)) {
 		init->error = 1;
-		DoEvent(db, S2EVENT_OFFLINE);
-		db->db_online = 0;
+		DoEvent(db, du, S2EVENT_OFFLINE);
+		du->du_online = 0;
 		
 		if (!scsiDevice) {
 			switch (scsiResult) {
@@ -905,19 +2303,153 @@ __saveds void frame_proc() {
 		if (!packetData) {
 			logMessage(db,"PacketServer: Out of memory [1]");
 			D(("scsidayna_task: Out of memory [1]\n")); 
-		} else FreeVec(packetData);
+		} else freeDMABuffer(db, packetData);
+		if (wifiCache) FreeVec(wifiCache);
 				
 		if (((char)timerPort.mp_SigBit)>=0) FreeSignal(timerPort.mp_SigBit);
 		ReplyMsg((struct Message*)init);
 		Forbid();
-		ReleaseSemaphore(&db->db_ProcSem);
+		ReleaseSemaphore(&du->du_ProcSem);
 		D(("scsidayna_task: shutdown\n"));
 		return;
 	}
 
+	// Bonded mode - a second target on the same bus shares the transmit load
+	SCSIWIFIDevice scsiDevices[2] = {scsiDevice, NULL};
+	USHORT numTargets = 1;        // targets polled for received packets
+	USHORT numTxTargets = 1;      // targets currently used for sending (the bonded one drops out if its Wifi is down)
+	UBYTE* bondData = NULL;
+	struct IOSana2Req** bondPendingSends = NULL;
+	UBYTE flowPeek[FLOW_PEEK_SIZE];
+	UBYTE ackPeek[FLOW_PEEK_SIZE];
+	if ((settings->bondDeviceID >= 0) && (settings->bondDeviceID <= 7)) {
+		if (!du->du_amigaNetMode) {
+			logMessage(db,"PacketServer: Bonding requires the AmigaNET interface, ignoring BONDID");
+		} else if (settings->bondDeviceID == settings->deviceID) {
+			logMessage(db,"PacketServer: BONDID is the same as DEVICEID, ignoring it");
+		} else {
+			struct SCSIWifi_DeviceInfo devInfo;
+			openData.deviceID = settings->bondDeviceID;
+			scsiDevices[1] = SCSIWifi_open(&openData, &scsiResult);
+			if ((scsiDevices[1]) && ((scsiResult != sworGreat) || (!SCSIWifi_getDeviceInfo(scsiDevices[1], &devInfo)))) {
+				SCSIWifi_close(scsiDevices[1]);
+				scsiDevices[1] = NULL;
+			}
+			// Sending from two MACs with one IP address would keep changing the other machines' ARP caches
+			if ((scsiDevices[1]) && (memcmp(devInfo.macAddress, du->du_MAC, HW_ADDRFIELDSIZE))) {
+				logMessagef(db,"PacketServer: Bonded device ID %ld has a different MAC Address, bonding disabled", settings->bondDeviceID);
+				SCSIWifi_close(scsiDevices[1]);
+				scsiDevices[1] = NULL;
+			}
+			if (scsiDevices[1]) {
+				bondData = allocDMABuffer(db, du, du->du_maxPacketsSize + 2);
+				if (pendingSends) bondPendingSends = (struct IOSana2Req**)AllocVec(du->du_maxPackets * sizeof(struct IOSana2Req*), MEMF_PUBLIC);	
+				if ((!bondData) || ((pendingSends) && (!bondPendingSends))) {
+					logMessage(db,"PacketServer: Out of memory [4], bonding disabled");
+					freeDMABuffer(db, bondData);
+					bondData = NULL;
+					if (bondPendingSends) FreeVec(bondPendingSends);
+					bondPendingSends = NULL;
+					SCSIWifi_close(scsiDevices[1]);
+					scsiDevices[1] = NULL;
+				}
+			}
+			if (scsiDevices[1]) {
+				// Both have to work with the smaller of the two limits
+				if (devInfo.maxBatchSize < du->du_maxBatchLimit) du->du_maxBatchLimit = devInfo.maxBatchSize;
+				if (devInfo.maxBatchSize < du->du_maxPacketsSize) du->du_maxPacketsSize = devInfo.maxBatchSize & 0xFFFFFFFEUL;
+				if (devInfo.maxPackets < du->du_maxPackets) du->du_maxPackets = devInfo.maxPackets;
+				if (!(devInfo.capabilities & SCSIWIFI_CAP_COMPACT)) du->du_compactMode = 0;
+				if (!(devInfo.capabilities & SCSIWIFI_CAP_TXCREDIT)) du->du_txCredits = 0;
+				numTargets = numTxTargets = 2;
+				logMessagef(db,"PacketServer: Bonded with AmigaNET device ID %ld", settings->bondDeviceID);
+			} else logMessagef(db,"PacketServer: Failed to open bonded AmigaNET device ID %ld", settings->bondDeviceID);
+		}
+	}
+
+	// Both ends of the batches need to agree on the header format
+	if (du->du_compactMode) 
+		for (USHORT target=0; target<numTargets; target++) SCSIWifi_AmigaNetSetCompact(scsiDevices[target], 1);
+	if (du->du_txCredits) 
+		for (USHORT target=0; target<numTargets; target++) SCSIWifi_AmigaNetSetCredits(scsiDevices[target], 1);
+	if (du->du_cacheDMA)
+		for (USHORT target=0; target<numTargets; target++) SCSIWifi_setCacheDMA(scsiDevices[target], 1);
+	const USHORT recvHeaderSize = du->du_txCredits ? AMIGANET_RECV_CREDIT_HEADER_SIZE : AMIGANET_RECV_HEADER_SIZE;
+
+	// Transmit flow control, batches are kept within the space the firmware last said it had free
+	struct TxCredit txCredits[2];
+	for (USHORT target=0; target<2; target++) {
+		txCredits[target].tc_Slots = du->du_maxPackets;
+		txCredits[target].tc_Bytes = 0xFFFFFFFFUL;
+	}
+
 	// Helpful!
 	struct Library *TimerBase = (APTR) time_req->tr_node.io_Device;
 
+#ifdef PROFILE
+	// Time every phase of the cycle and every SCSI command
+	struct Profiler* profiler = (struct Profiler*)AllocVec(sizeof(struct Profiler), MEMF_PUBLIC);
+	if (profiler) {
+		Profile_reset(profiler, TimerBase);
+		for (USHORT target=0; target<numTargets; target++) SCSIWifi_setProfile(scsiDevices[target], TimerBase, &profiler->pr_Profile);
+		logMessage(db,"PacketServer: Profiling");
+	} else logMessage(db,"PacketServer: Out of memory [7], not profiling");
+#endif
+
+	// Capture everything crossing the SCSI link?
+	ULONG captureDropped = 0;
+	ULONG acksThinned = du->du_AcksThinned;
+	ULONG txQueueFull = du->du_TxQueueFull;
+	ULONG txDelayDropped = du->du_TxDelayDropped;
+	du->du_Capture = NULL;
+	if (settings->captureFile[0]) {
+		char captureProcName[40];
+		struct Capture_OpenData captureData;
+		strcpy(captureProcName, du->du_ProcName);
+		strcpy(captureProcName + strlen(captureProcName), ".Capture");
+		captureData.sysBase = (struct ExecBase*)SysBase;
+		captureData.dosBase = (void*)DOSBase;
+		captureData.timerBase = TimerBase;
+		captureData.fileName = settings->captureFile;
+		captureData.procName = captureProcName;
+		du->du_Capture = Capture_open(&captureData);
+		if (du->du_Capture) logMessagef(db,"PacketServer: Capturing to %s", settings->captureFile);
+			else logMessagef(db,"PacketServer: Failed to start capture to %s", settings->captureFile);
+	}
+
+	// Wifi management requests can be answered from the cache from now on
+	ObtainSemaphore(&du->du_WifiListSem);
+	du->du_WifiCache = wifiCache;
+	ReleaseSemaphore(&du->du_WifiListSem);
+
+	// Watch the prefs file, and offer a control port, so settings can change without closing the unit
+	struct NotifyRequest prefsNotify;
+	BYTE notifySignal = AllocSignal(-1);
+	BOOL notifying = FALSE;
+	if (notifySignal >= 0) {
+		memset(&prefsNotify, 0, sizeof(prefsNotify));
+		prefsNotify.nr_Name = (UBYTE*)"ENV:scsidayna.prefs";
+		prefsNotify.nr_Flags = NRF_SEND_SIGNAL;
+		prefsNotify.nr_stuff.nr_Signal.nr_Task = FindTask(NULL);
+		prefsNotify.nr_stuff.nr_Signal.nr_SignalNum = notifySignal;
+		notifying = StartNotify(&prefsNotify);
+	}
+	char controlName[24];
+	strcpy(controlName, SCSIDAYNA_CONTROL_PORT);
+	if (du->du_UnitNum) {
+		USHORT len = strlen(controlName);
+		controlName[len] = '.';
+		controlName[len+1] = '0' + du->du_UnitNum;
+		controlName[len+2] = '\0';
+	}
+	struct MsgPort* controlPort = CreateMsgPort();
+	if (controlPort) {
+		controlPort->mp_Node.ln_Name = controlName;
+		controlPort->mp_Node.ln_Pri = 0;
+		AddPort(controlPort);
+	} else logMessage(db,"PacketServer: Out of memory [6], no control port");
+	const ULONG settingsSignalMask = (notifying ? (1UL << notifySignal) : 0) | (controlPort ? (1UL << controlPort->mp_SigBit) : 0);
+
 	init->error = 0;
 	ReplyMsg((struct Message*)init);
 	unsigned long timerSignalMask = (1UL << timerPort.mp_SigBit);
@@ -926,327 +2458,425 @@ __saveds void frame_proc() {
 
 	ULONG recv = 0;
 	USHORT currentWifiState = 0;	
+
+	// Watch for the disk using the SCSI bus
+	struct BusShare busShare;
+	struct EClockVal busStart, busEnd;
+	busShareInit(&busShare, settings->busShare, ReadEClock(&busStart));
+	du->du_busyBatchLimit = 0;
+
+	// Keep the send queue short, by its length and by how long writes wait in it
+	struct CoDel codel;
+	struct EClockVal queueNow;
+	codelInit(&codel, settings->txQueueDelay, ReadEClock(&queueNow));
+	ObtainSemaphore(&du->du_WriteListSem);
+	du->du_TxQueueLimit = settings->txQueuePackets;
+	du->du_TxQueueByteLimit = settings->txQueueBytes;
+	du->du_TimerBase = TimerBase;
+	for (struct IOSana2Req *ior = (struct IOSana2Req *)du->du_WriteList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ)
+		TXQ_STAMP(ior) = queueNow.ev_lo;
+	txRecount(du);
+	ReleaseSemaphore(&du->du_WriteListSem);
+
+	// Bytes each direction gets per scheduling cycle
+	LONG rxDeficit = 0, txDeficit = 0;
+	LONG rxQuantum = (settings->rxQuantum < SCSIWIFI_PACKET_MAX_SIZE) ? SCSIWIFI_PACKET_MAX_SIZE : settings->rxQuantum;
+	LONG txQuantum = (settings->txQuantum < SCSIWIFI_PACKET_MAX_SIZE) ? SCSIWIFI_PACKET_MAX_SIZE : settings->txQuantum;
+
+	// Firmware receive filter, AmigaNET only. Sent the first time the unit goes online
+	struct SCSIWifi_Filter lastFilter;
+	USHORT useFilter = (du->du_amigaNetMode) && (settings->recvFilter);
+	du->du_FilterActive = 0;
+	du->du_FilterChanged = 0;
+
+	// ARP offload, AmigaNET only. Sent once our address is known and the unit is online
+	struct SCSIWifi_ArpStats arpStats[2];
+	USHORT arpOffloadOn = 0;      // If the firmware has been told to offload
+	du->du_ArpOffload = (du->du_amigaNetMode) && (settings->arpOffload);
+	du->du_IPAddressChanged = 0;
+	memset(du->du_IPAddress, 0, 4);   // The stack might come back with a different address
+
+	// Broadcast filter, the address it needs is picked up the same way
+	du->du_BcastFilter = settings->bcastFilter;
+	du->du_BcastRate = settings->bcastRate;
+	memset(du->du_BcastBuckets, 0, sizeof(du->du_BcastBuckets));
+	du->du_LearnAddress = (du->du_ArpOffload) || (du->du_BcastFilter);
+	ULONG arpFiltered = du->du_ArpFiltered;
+	ULONG bcastLimited = du->du_BcastLimited;
 	
 	// Change task priority
-	if (settings->taskPriority != 0) SetTaskPri((struct Task*)db->db_Proc,settings->taskPriority);      
+	if (settings->taskPriority != 0) SetTaskPri((struct Task*)du->du_Proc,settings->taskPriority);      
 
 	struct timeval timeLastWifiCheck = {0UL,0UL};
 	struct timeval timeWifiCheck = {0UL,0UL};
 	USHORT lastWifiStatus = 1;    // assume OK, although this should get overwritten straight away
+	ULONG lastWifiPoll = 0;       // When the status was last checked, in 1/16ths of a second
+	ULONG wifiDownSince = 0;      // When the link went down, or AUTOCONNECT last tried joining again
+	USHORT wifiPollInterval = WIFI_POLL_FAST;   // The join in DevOpen has only just been sent
 
 	D(("scsidayna_task: starting loop\n"));
 	while (!(recv & SIGBREAKF_CTRL_C)) {
-		struct IOSana2Req *nextwrite;
-		USHORT shouldBeEnabled = db->db_online;
+		USHORT shouldBeEnabled = du->du_online;
+		PROFILE_MARK(profiler, PROF_OTHER);
+		PROFILE_END_CYCLE(profiler);
+
+		// Settings changed through the prefs file or the control port are applied here, between cycles
+		const ULONG settingsSignals = (recv | SetSignal(0, settingsSignalMask)) & settingsSignalMask;
+		if (settingsSignals) {
+			struct ScsiDaynaControl* ctrl;
+			if ((notifying) && (settingsSignals & (1UL << notifySignal))) reloadSettings(db, du, settings);
+			if (controlPort) 
+				while (ctrl = (struct ScsiDaynaControl*)GetMsg(controlPort)) {
+#ifdef PROFILE
+					if (ctrl->sc_Command == SCSIDAYNA_CTRL_PROFILE) {
+						ctrl->sc_Error = S2ERR_NO_ERROR;
+						if ((!profiler) || (!ctrl->sc_Data) || (ctrl->sc_DataLength < sizeof(struct ScsiDaynaProfile))) ctrl->sc_Error = S2ERR_BAD_ARGUMENT; else {
+							memcpy(ctrl->sc_Data, &profiler->pr_Profile, sizeof(struct ScsiDaynaProfile));
+							if (ctrl->sc_Value) Profile_reset(profiler, TimerBase);
+						}
+					} else
+#endif
+					controlSetting(db, settings, ctrl);
+					ReplyMsg((struct Message*)ctrl);
+				}
+			SetTaskPri((struct Task*)du->du_Proc, settings->taskPriority);
+			rxQuantum = (settings->rxQuantum < SCSIWIFI_PACKET_MAX_SIZE) ? SCSIWIFI_PACKET_MAX_SIZE : settings->rxQuantum;
+			txQuantum = (settings->txQuantum < SCSIWIFI_PACKET_MAX_SIZE) ? SCSIWIFI_PACKET_MAX_SIZE : settings->txQuantum;
+			du->du_BcastFilter = settings->bcastFilter;
+			du->du_BcastRate = settings->bcastRate;
+			du->du_LearnAddress = (du->du_ArpOffload) || (du->du_BcastFilter);
+			if (du->du_amigaNetMode) resizeBatchBuffers(db, du, settings->maxDataSize, &packetData, &bondData);
+		}
 
 		GetSysTime(&timeWifiCheck);
-		// Every 5 seconds check WIFI status
-		if (abs(timeWifiCheck.tv_secs-timeLastWifiCheck.tv_secs)>=5) {
+		const ULONG timeSlice = (timeWifiCheck.tv_secs << 4) | (timeWifiCheck.tv_micro >> 16);   // 1/16ths of a second
+		du->du_BcastSlice = timeSlice;
+		// Check the WIFI status, quickly while the link is coming up or has just changed and every 5 seconds once it's settled
+		if (timeSlice - lastWifiPoll >= wifiPollInterval) {
+			PROFILE_MARK(profiler, PROF_WIFI_CHECK);
 			D(("scsidayna_task: Check WIFI Status\n"));
 			struct SCSIWifi_NetworkEntry wifi;
 			if (SCSIWifi_getNetwork(scsiDevice, &wifi)) {
-				if (wifi.rssi == 0) {
-					logMessage(db,"PacketServer: Wifi not connected");
-					D(("scsidayna_task: WIFI not connected\n"));
-					lastWifiStatus = 0;
-				} else {
-					lastWifiStatus = 1;
-					logMessagef(db,"PacketServer: Wifi Connected, Signal Strength: %ld dB\n", wifi.rssi);
-					D(("scsidayna_task: WIFI connected with strength %ld dB\n", wifi.rssi));
+				ObtainSemaphore(&du->du_WifiListSem);
+				memcpy(&wifiCache->wc_Network, &wifi, sizeof(wifi));
+				wifiCache->wc_NetworkValid = 1;
+				ReleaseSemaphore(&du->du_WifiListSem);
+				const USHORT connected = (wifi.rssi != 0) ? 1 : 0;
+				const BOOL changed = connected != lastWifiStatus;
+				if (connected) {
+					// Remembered so joining this network again can go straight to its channel
+					memcpy(du->du_LastSSID, wifi.ssid, sizeof(du->du_LastSSID));
+					du->du_LastSSID[sizeof(du->du_LastSSID) - 1] = '\0';
+					memcpy(du->du_LastBSSID, wifi.bssid, sizeof(du->du_LastBSSID));
+					if (wifi.channel) du->du_LastChannel = wifi.channel;
+				} else if (changed) wifiDownSince = timeSlice;
+				if ((changed) || (wifiPollInterval >= WIFI_POLL_NORMAL)) {
+					if (!connected) {
+						logMessage(db,"PacketServer: Wifi not connected");
+						D(("scsidayna_task: WIFI not connected\n"));
+					} else {
+						logMessagef(db,"PacketServer: Wifi Connected, Signal Strength: %ld dB\n", wifi.rssi);
+						D(("scsidayna_task: WIFI connected with strength %ld dB\n", wifi.rssi));
+					}
+				}
+				lastWifiStatus = connected;
+				if (changed) wifiPollInterval = WIFI_POLL_FAST; else {
+					wifiPollInterval <<= 1;
+					if (wifiPollInterval > WIFI_POLL_NORMAL) wifiPollInterval = WIFI_POLL_NORMAL;
+				}
+
+				// The access point may have restarted, and the firmware won't always find it again by itself
+				if ((!connected) && (settings->autoConnect) && (settings->ssid[0]) && (timeSlice - wifiDownSince >= WIFI_REJOIN)) {
+					if (du->du_LastChannel) logMessagef(db,"PacketServer: Joining WIFI Network %s again on channel %ld", settings->ssid, du->du_LastChannel);
+						else logMessagef(db,"PacketServer: Joining WIFI Network %s again", settings->ssid);
+					joinConfiguredNetwork(db, du, scsiDevice);
+					wifiDownSince = timeSlice;
+					wifiPollInterval = WIFI_POLL_FAST;
+				}
+			}
+			if (numTargets > 1) {
+				// Only send on the bonded device while it's connected too
+				if ((SCSIWifi_getNetwork(scsiDevices[1], &wifi)) && (wifi.rssi != 0)) numTxTargets = 2; else {
+					if (numTxTargets > 1) logMessage(db,"PacketServer: Bonded device Wifi not connected");
+					numTxTargets = 1;
 				}
 			}
+			lastWifiPoll = timeSlice;
+			PROFILE_MARK(profiler, PROF_OTHER);
+		}
+
+		// Every 5 seconds do the housekeeping
+		if (abs(timeWifiCheck.tv_secs-timeLastWifiCheck.tv_secs)>=5) {
+			PROFILE_MARK(profiler, PROF_WIFI_CHECK);
+			// Let the quickest receive creep up, in case it was a one off
+			busShare.bs_Baseline += busShare.bs_Baseline >> 3;
+			// Pick up packet types nobody reads any more
+			if (useFilter) du->du_FilterChanged = 1;
+			if (arpOffloadOn) readArpStats(du, scsiDevices, numTargets, arpStats);
+			if ((du->du_ArpFiltered != arpFiltered) || (du->du_BcastLimited != bcastLimited)) {
+				logMessagef(db,"PacketServer: Dropped %ld ARP requests for other hosts, %ld broadcasts over the rate limit", du->du_ArpFiltered - arpFiltered, du->du_BcastLimited - bcastLimited);
+				arpFiltered = du->du_ArpFiltered;
+				bcastLimited = du->du_BcastLimited;
+			}
+			if (du->du_AcksThinned != acksThinned) {
+				logMessagef(db,"PacketServer: %ld ACKs thinned", du->du_AcksThinned - acksThinned);
+				acksThinned = du->du_AcksThinned;
+			}
+			if ((du->du_TxQueueFull != txQueueFull) || (du->du_TxDelayDropped != txDelayDropped)) {
+				logMessagef(db,"PacketServer: Send queue refused %ld writes when full, dropped %ld that waited too long", du->du_TxQueueFull - txQueueFull, du->du_TxDelayDropped - txDelayDropped);
+				txQueueFull = du->du_TxQueueFull;
+				txDelayDropped = du->du_TxDelayDropped;
+			}
+			if (du->du_Capture) {
+				ULONG captured, dropped;
+				Capture_stats(du->du_Capture, &captured, &dropped);
+				if (dropped != captureDropped) logMessagef(db,"PacketServer: Capture dropped %ld frames (%ld captured)", dropped - captureDropped, captured);
+				captureDropped = dropped;
+			}
 			timeLastWifiCheck.tv_secs = timeWifiCheck.tv_secs;
+			PROFILE_MARK(profiler, PROF_OTHER);
 		}
 		if (!lastWifiStatus) shouldBeEnabled = 0;
 
+		// Wifi management goes between packet cycles so it never holds up the bus for long
+		if ((wifiCache->wc_Scanning) || (du->du_WifiList.lh_Head->ln_Succ)) {
+			struct SCSIWifi_NetworkEntry wifi;
+			// Watch closely for the link coming up after a join
+			if (serviceWifiRequests(db, du, scsiDevice, &wifi, timeSlice)) {
+				lastWifiPoll = timeSlice;
+				wifiPollInterval = WIFI_POLL_FAST;
+			}
+		}
+
 		// Handle state toggle - also goes offline if theres no connections
 		if (currentWifiState != shouldBeEnabled) {
 			D(("scsidayna_task: Wifi Status Changed\n"));
 			currentWifiState = shouldBeEnabled;
 			SCSIWifi_enable(scsiDevice, shouldBeEnabled); 
-			if (!shouldBeEnabled) rejectAllPackets(db);
-			if (shouldBeEnabled) GetSysTime(&db->db_DevStats.LastStart);
-			DoEvent(db, shouldBeEnabled ? S2EVENT_ONLINE : S2EVENT_OFFLINE);
-			db->db_currentWifiState = currentWifiState;
+			if (scsiDevices[1]) SCSIWifi_enable(scsiDevices[1], shouldBeEnabled); 
+			if (!shouldBeEnabled) rejectAllPackets(db, du);
+			if (shouldBeEnabled) GetSysTime(&du->du_DevStats.LastStart);
+			if ((shouldBeEnabled) && (useFilter)) {
+				// Always send it after enabling
+				lastFilter.flags = 0xFF;
+				du->du_FilterChanged = 1;
+			}
+			// The firmware shouldn't answer ARP for us while we're offline
+			if ((!shouldBeEnabled) && (arpOffloadOn)) {
+				readArpStats(du, scsiDevices, numTargets, arpStats);
+				updateArpOffload(db, du, scsiDevices, numTargets, 0, arpStats);
+				arpOffloadOn = 0;
+			}
+			if ((shouldBeEnabled) && (du->du_ArpOffload)) du->du_IPAddressChanged = 1;
+			DoEvent(db, du, shouldBeEnabled ? S2EVENT_ONLINE : S2EVENT_OFFLINE);
+			du->du_currentWifiState = currentWifiState;
+		}
+		if ((useFilter) && (currentWifiState) && (du->du_FilterChanged)) useFilter = updateRecvFilter(db, du, scsiDevices, numTargets, &lastFilter);
+		if ((du->du_ArpOffload) && (currentWifiState) && (du->du_IPAddressChanged) && (du->du_IPAddress[0] | du->du_IPAddress[1] | du->du_IPAddress[2] | du->du_IPAddress[3])) {
+			if (arpOffloadOn) readArpStats(du, scsiDevices, numTargets, arpStats);
+			arpOffloadOn = updateArpOffload(db, du, scsiDevices, numTargets, 1, arpStats);
 		}
     
 		if (currentWifiState) {
-			UBYTE morePackets = 0;
+			// Deficit round robin between receiving and sending. Each cycle both directions get their quantum of bytes,
+			// so neither can starve the other. A direction that runs dry doesn't get to bank what it didn't use
+			UBYTE rxPending = 0;
+			UBYTE txPending = 0;
+			UBYTE txBlocked = 0;
 			USHORT counter = 0;   
-			do {
-				
-				if (db->db_amigaNetMode) {					
-					ULONG dataReceived = SCSIWifi_AmigaNetRecvFrames(scsiDevice, packetData,db->db_maxPacketsSize);					
-					if (dataReceived<4) {
-						morePackets = 0;
-						D(("RECV FAILED\n"));
-						logMessage(db,"PacketServer: Warning - Batch Recv Failed from Device");
-						DoEvent(db, S2EVENT_ERROR | S2EVENT_HARDWARE | S2EVENT_RX);
-					} else {
-						USHORT numPackets = ((USHORT)packetData[0] << 8) | (USHORT)packetData[1];						
-						if (packetData[2]) morePackets=1; else morePackets=0;						
-						UBYTE* dataStart = &packetData[4];
-						dataReceived -= 4;
-												
-						// Receive packets
-						while (numPackets>0) {
-							if (dataReceived<4) {
-								logMessage(db,"PacketServer: Buffer underrun [1]");
-								break;
-							}
-							const USHORT packetSize = ((USHORT)dataStart[0]  << 8) | (USHORT)dataStart[1];
-							dataStart+= 2;
-							dataReceived-=2;
-							
-							// Check packet has minimum size for Ethernet header
-							if (packetSize < 14) {
-								logMessage(db,"PacketServer: Warn - Packet too small");
-								dataStart += packetSize;
-								dataReceived -= packetSize;
-								numPackets--;
-								continue;
-							}
-							
-							const USHORT packetType = ((USHORT)dataStart[12] << 8)| ((USHORT)dataStart[13]);							
-							//logMessagef(db,"PacketServer: Received Packet type %lx received, size=%ld", packetType, packetSize);
-							
-							if (packetSize > dataReceived) {
-								logMessage(db,"PacketServer: Buffer underrun [2]");
-								break;
-							}
-							
-							ObtainSemaphore(&db->db_ReadListSem);							
-							struct IOSana2Req *ior = NULL;						
-							for (ior = (struct IOSana2Req *)db->db_ReadList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
-								if (ior->ios2_PacketType == packetType) {
-									db->db_DevStats.PacketsReceived++;
-									Remove((struct Node*)ior);
-									receivePacket(db, dataStart, packetSize, ior);
-									DevTermIO(db, (struct IORequest *)ior);
-									counter++;
-									ior = NULL;
-									break;
-								}
-							}
-							ReleaseSemaphore(&db->db_ReadListSem);
-							
-							// Nothing wanted it?
-							if (ior) {			
-								db->db_DevStats.UnknownTypesReceived++;
-								ObtainSemaphore(&db->db_ReadOrphanListSem);
-								ior = (struct IOSana2Req *)RemHead((struct List*)&db->db_ReadOrphanList);
-								ReleaseSemaphore(&db->db_ReadOrphanListSem);
-
-								if (!ior) {
-									// No orphan buffer - signal problem
-									DoEvent(db, S2EVENT_BUFF | S2EVENT_RX);  // Signal BEFORE dropping        
-									// Very brief delay (1-2 ticks) to let RoadShow post a buffer
-									Delay(1);
-									// Try ONE more time
-									ObtainSemaphore(&db->db_ReadOrphanListSem);
-									ior = (struct IOSana2Req *)RemHead((struct List*)&db->db_ReadOrphanList);
-									ReleaseSemaphore(&db->db_ReadOrphanListSem);        
-									if (!ior) {
-										// Still no buffer - drop it
-										logMessagef(db,"PacketServer: Warn - Orphaned packet not picked up of type %lx", packetType);
-										db->db_DevStats.Overruns++;
-										DoEvent(db, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE | S2EVENT_RX);
-									} else {
-										//logMessagef(db, "PacketServer: Buffer arrived after signal - packet saved");
-										receivePacket(db, dataStart, packetSize, ior);
-										DevTermIO(db, (struct IORequest *)ior);
-									}
-								} else {
-									receivePacket(db, dataStart, packetSize, ior);
-									DevTermIO(db, (struct IORequest *)ior);  									
-									//logMessagef(db,"PacketServer: Warn - Orphaned packet picked up of type %lx", packetType);
-								} 								
+			rxDeficit += rxQuantum;
+			while (rxDeficit > 0) {
+				ULONG bytesReceived = 0;
+				rxPending = 0;
+				if (du->du_amigaNetMode) {					
+					for (USHORT target=0; target<numTargets; target++) {
+						PROFILE_MARK(profiler, PROF_RX_DOIO);
+						const ULONG readSize = ((du->du_busyBatchLimit) && (du->du_busyBatchLimit < du->du_maxPacketsSize)) ? du->du_busyBatchLimit : du->du_maxPacketsSize;
+						if (settings->busShare) ReadEClock(&busStart);
+						ULONG dataReceived = SCSIWifi_AmigaNetRecvFrames(scsiDevices[target], packetData, readSize);					
+						PROFILE_MARK(profiler, PROF_RX_DISPATCH);
+						if ((settings->busShare) && (dataReceived >= recvHeaderSize) && (!packetData[0]) && (!packetData[1])) {
+							ReadEClock(&busEnd);
+							if (busShareSample(du, &busShare, busEnd.ev_lo - busStart.ev_lo))
+								logMessage(db, busShare.bs_Busy ? "PacketServer: The disk is busy, sharing the SCSI bus" : "PacketServer: The disk has gone quiet");
+						}
+						if (dataReceived<recvHeaderSize) {
+							D(("RECV FAILED\n"));
+							logMessagef(db,"PacketServer: Warning - Batch Recv Failed from Device %ld", target);
+							DoEvent(db, du, S2EVENT_ERROR | S2EVENT_HARDWARE | S2EVENT_RX);
+						} else {
+							if (packetData[2]) rxPending=1;
+							if (du->du_txCredits) {
+								txCredits[target].tc_Slots = ((USHORT)packetData[4] << 8) | (USHORT)packetData[5];
+								txCredits[target].tc_Bytes = ((ULONG)packetData[6] << 8) | (ULONG)packetData[7];
+								// Only firmware that takes batches over 64KB fills in the top byte, for the rest it's reserved
+								if (du->du_maxBatchLimit > 0xFFFF) txCredits[target].tc_Bytes |= (ULONG)packetData[3] << 16;
 							}
-							
-							dataReceived -= packetSize;
-							
-							numPackets--;
-							dataStart += packetSize;
-						}						
-					}										
+							bytesReceived += dataReceived;
+							counter += dispatchRecvBatch(db, du, packetData, dataReceived, recvHeaderSize);
+						}
+					}
 				} else {
+					PROFILE_MARK(profiler, PROF_RX_DOIO);
+					if (settings->busShare) ReadEClock(&busStart);
 					USHORT packetSize = SCSIWifi_receiveFrame(scsiDevice, packetData, SCSIWIFI_PACKET_MAX_SIZE + 6);
+					PROFILE_MARK(profiler, PROF_RX_DISPATCH);
+					if ((settings->busShare) && (packetSize == 6)) {
+						ReadEClock(&busEnd);
+						if (busShareSample(du, &busShare, busEnd.ev_lo - busStart.ev_lo))
+							logMessage(db, busShare.bs_Busy ? "PacketServer: The disk is busy, sharing the SCSI bus" : "PacketServer: The disk has gone quiet");
+					}
 					if (packetSize) {    
-						morePackets = packetData[5];						
+						rxPending = packetData[5];						
+						bytesReceived = packetSize;
 
 						if (packetSize > 6) {
 							USHORT packet_type = ((USHORT)packetData[18]<<8)|((USHORT)packetData[19]);   
+							if (du->du_Capture) {
+								// Size includes the 4 byte CRC
+								USHORT frameSize = ((USHORT)packetData[0]<<8)|((USHORT)packetData[1]);
+								if (frameSize > 4) Capture_frame(du->du_Capture, packetData+6, frameSize-4);
+							}
 
-							ObtainSemaphore(&db->db_ReadListSem);
-							struct IOSana2Req *ior = NULL;						
-							for (ior = (struct IOSana2Req *)db->db_ReadList.lh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ; ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) {
-								if (ior->ios2_PacketType == packet_type) {
-									db->db_DevStats.PacketsReceived++;
-									Remove((struct Node*)ior);
-									read_frame(db, ior, packetData, packetSize);        
-									DevTermIO(db, (struct IORequest *)ior);
-									counter++;
-									ior = NULL;
-									break;
+							// Skip anything the broadcast filter drops
+							if ((packetSize < 6 + HW_ETH_HDR_SIZE) || (rxAdmit(du, packetData + 6, packetSize - 6))) {
+								// Nothing wanted it?
+								if (deliverToReaders(db, du, packetData, packetSize, packet_type, TRUE)) counter++; else {
+									du->du_DevStats.UnknownTypesReceived++;
+									struct IOSana2Req *ior;
+									ObtainSemaphore(&du->du_ReadOrphanListSem);
+									ior = (struct IOSana2Req *)RemHead((struct List*)&du->du_ReadOrphanList);
+									ReleaseSemaphore(&du->du_ReadOrphanListSem);
+									if (ior) {
+										deliverOrphan(db, du, ior, packetData, packetSize, TRUE);
+										D(("Orphan Packet Picked Up (proto %lx) !\n", packet_type));
+									} 
 								}
 							}
-							ReleaseSemaphore(&db->db_ReadListSem);
-							
-							// Nothing wanted it?
-							if (ior) {
-								db->db_DevStats.UnknownTypesReceived++;
-								ObtainSemaphore(&db->db_ReadOrphanListSem);
-								ior = (struct IOSana2Req *)RemHead((struct List*)&db->db_ReadOrphanList);
-								ReleaseSemaphore(&db->db_ReadOrphanListSem);
-								if (ior) {
-									read_frame(db, ior, packetData, packetSize);
-									DevTermIO(db, (struct IORequest *)ior);  
-									D(("Orphan Packet Picked Up (proto %lx) !\n", packet_type));
-								} 
-							}
 						}
 					} else {
-						morePackets = 0;
 						D(("RECV FAILED\n"));
 						logMessage(db,"PacketServer: Warning - Recv Failed from Device");
-						DoEvent(db, S2EVENT_ERROR | S2EVENT_HARDWARE | S2EVENT_RX);
+						DoEvent(db, du, S2EVENT_ERROR | S2EVENT_HARDWARE | S2EVENT_RX);
 					}
 				}
+				rxDeficit -= bytesReceived;
 
-				recv = SetSignal(0, SIGBREAKF_CTRL_C|SIGBREAKF_CTRL_F);
-				// Keep going until we're told theres no more data, or we need to send, or terminate
-			} while ((morePackets) && (!recv));
-
-			// Prevent delaying if there was data incoming
-			if (counter >= 2) morePackets = 1;
-						
-			if (db->db_amigaNetMode) {
-				// Batch packet sending
-				counter = 0;
-				UBYTE* dataOut = &packetData[2];  // 2 bytes header at the front
-				USHORT spaceRemaining = db->db_maxPacketsSize - 2;
-				struct IOSana2Req** pendingSendsSave = pendingSends;
-				struct IOSana2Req *nextwrite;
-				// Collect packets until not enough data space or too many
-				ObtainSemaphore(&db->db_WriteListSem);
-				struct IOSana2Req *ior = (struct IOSana2Req *)db->db_WriteList.lh_Head;
-			    while ((nextwrite = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ) != NULL) {
-					USHORT sz = ior->ios2_DataLength;					
-					UBYTE* rewind = dataOut;
-					const USHORT rewindSize = spaceRemaining;
-
-					// Calculate packet size
-				    if (ior->ios2_Req.io_Flags & SANA2IOF_RAW) {
-						if (sz + 2 > spaceRemaining) break;
-						dataOut[0] = sz >> 8;
-						dataOut[1] = sz & 0xFF;
-						dataOut+=2;
-						spaceRemaining -= 2;
-						
-				    } else {
-						USHORT fullSize = sz + HW_ETH_HDR_SIZE;
-						if (fullSize + 2 > spaceRemaining) break;
-						dataOut[0] = fullSize >> 8;
-						dataOut[1] = fullSize & 0xFF;
-						dataOut+=2;
-						spaceRemaining -= 2;
-
-						*((USHORT*)(dataOut+12)) = (USHORT)ior->ios2_PacketType;
-						// Add ethernet header
-						memcpy(dataOut, ior->ios2_DstAddr, HW_ADDRFIELDSIZE);
-						memcpy(dataOut+6, HW_MAC, HW_ADDRFIELDSIZE);
-						dataOut += HW_ETH_HDR_SIZE;
-						spaceRemaining -= HW_ETH_HDR_SIZE;
-				    }
-				    // Add the data
-				    struct BufferManagement *bm = (struct BufferManagement *)ior->ios2_BufferManagement;				   
-					if (!(*bm->bm_CopyFromBuffer)(dataOut, ior->ios2_Data, sz)) {
-						ior->ios2_Req.io_Error = S2ERR_SOFTWARE;
-						ior->ios2_WireError = S2WERR_BUFF_ERROR;
-						DoEvent(db, S2EVENT_ERROR | S2EVENT_BUFF | S2EVENT_SOFTWARE);
-						D(("bm_CopyFromBuffer FAIL"));		
-						dataOut = rewind;		
-						spaceRemaining = rewindSize;					
-						Remove((struct Node*)ior);
-						DevTermIO(db, (struct IORequest *)ior);
-					} else {						
-						if (pendingSendsSave) {
-							*pendingSendsSave = ior; 
-							pendingSendsSave++;
-						} else {
-							ior->ios2_Req.io_Error = ior->ios2_WireError = 0;
-							db->db_DevStats.PacketsSent++;
-							DevTermIO(db, (struct IORequest *)ior);
-						}						
-						Remove((struct Node*)ior);
-						dataOut += sz;
-						spaceRemaining -= sz;
-						counter++;
-					}
-					if (counter>=db->db_maxPackets) break;   // limit packet total
-					ior = nextwrite;
-				}
-				ReleaseSemaphore(&db->db_WriteListSem);
-				// Now actually transmit them
-				if (counter) {
-					const USHORT totalSize = dataOut-packetData;
-					packetData[0] = counter >> 8;
-					packetData[1] = counter & 0xFF;
-					if (!SCSIWifi_AmigaNetSendFrames(scsiDevice, packetData, totalSize)) {
-						D(("SEND FAIL"));
-						logMessage(db,"PacketServer: Warning - Send Failed to Device");
-						if (pendingSends) {							
-							for (struct IOSana2Req **req = pendingSends; req<pendingSendsSave; req++) {							
-								(*req)->ios2_Req.io_Error = S2ERR_TX_FAILURE; (*req)->ios2_WireError = S2WERR_GENERIC_ERROR;
-								DevTermIO(db, (struct IORequest *)(*req));
-								DoEvent(db, S2EVENT_ERROR | S2EVENT_TX | S2EVENT_HARDWARE);
-							}
+				// Keep going until we're told theres no more data, the quantum is used up, or terminate
+				if ((!rxPending) || (SetSignal(0, 0) & SIGBREAKF_CTRL_C)) break;
+			}
+			if (!rxPending) rxDeficit = 0;
+
+			if ((codel.cd_Target) && ((du->du_TxQueued) || (codel.cd_Above))) {
+				PROFILE_MARK(profiler, PROF_TX_BUILD);
+				ReadEClock(&queueNow);
+				codelDequeue(db, du, &codel, queueNow.ev_lo);
+			}
+			txDeficit += txQuantum;
+			while (txDeficit > 0) {
+				ULONG bytesSent = 0;
+				PROFILE_MARK(profiler, PROF_TX_BUILD);
+				if (du->du_amigaNetMode) {
+					// Batch packet sending
+					struct TxBatch batches[2];
+					batchBegin(du, &batches[0], packetData, pendingSends, du->du_txCredits ? &txCredits[0] : NULL);
+					if (numTxTargets > 1) batchBegin(du, &batches[1], bondData, bondPendingSends, du->du_txCredits ? &txCredits[1] : NULL);
+
+					txPending = batchCollect(db, du, batches, numTxTargets, settings, flowPeek, ackPeek);
+
+					// Now actually transmit them
+					PROFILE_MARK(profiler, PROF_TX_DOIO);
+					for (USHORT target=0; target<numTxTargets; target++) {
+						if (!batches[target].tb_Count) continue;
+						const ULONG batchSize = batches[target].tb_DataOut - batches[target].tb_Data;
+						bytesSent += batchSize;
+						if (du->du_txCredits) {
+							// Use up the credit until the next receive says how much is free
+							txCredits[target].tc_Slots -= batches[target].tb_Count;
+							if (batchSize - 2 >= txCredits[target].tc_Bytes) txCredits[target].tc_Bytes = 0; else txCredits[target].tc_Bytes -= batchSize - 2;
 						}
-					} else {
-						//logMessagef(db,"PacketServer: Sent %ld Packets (Total Size=%ld)", counter, totalSize);
-						if (pendingSends) {
-							for (struct IOSana2Req **req = pendingSends; req<pendingSendsSave; req++) {												
-								(*req)->ios2_Req.io_Error = (*req)->ios2_WireError = 0;
-								DevTermIO(db, (struct IORequest *)(*req));								
+						batchSend(db, du, scsiDevices[target], &batches[target]);
+					}
+					// Out of credit? Leave the rest queued so the stack sees the backpressure
+					if ((txPending) && (!bytesSent)) txBlocked = 1;
+				} else {
+					// Send a packet, a priority one first if nothing from its flow is queued ahead of it
+					ObtainSemaphore(&du->du_WriteListSem);
+					if (settings->ackThin) thinAcks(db, du, flowPeek, ackPeek, settings->txPriority);
+					struct IOSana2Req *ior = NULL;
+					if (settings->txPriority) {
+						ULONG flowsWaiting = 0;
+						for (struct IOSana2Req *next = (struct IOSana2Req *)du->du_WriteList.lh_Head; next->ios2_Req.io_Message.mn_Node.ln_Succ; next = (struct IOSana2Req *)next->ios2_Req.io_Message.mn_Node.ln_Succ) {
+							UBYTE cls = classifyPacket(next, flowPeek, settings->txPriority);
+							ULONG flowBit = 1UL << (cls & TXCLASS_HASHMASK);
+							if ((cls & TXCLASS_PRIORITY) && (!(flowsWaiting & flowBit))) {
+								ior = next;
+								Remove((struct Node*)ior);
+								break;
 							}
+							flowsWaiting |= flowBit;
 						}
-						db->db_DevStats.PacketsSent+=counter;
 					}
+					if (!ior) ior = (struct IOSana2Req *)RemHead(&du->du_WriteList);
+					if (ior) {
+						txDequeued(du, ior);
+						bytesSent = ior->ios2_DataLength;
+						if (!(ior->ios2_Req.io_Flags & SANA2IOF_RAW)) bytesSent += HW_ETH_HDR_SIZE;
+						PROFILE_MARK(profiler, PROF_TX_DOIO);
+						write_frame(ior, packetData, scsiDevice, db, du);
+						DevTermIO(db, (struct IORequest *)ior);
+					}
+					txPending = du->du_WriteList.lh_Head->ln_Succ != NULL;
+					ReleaseSemaphore(&du->du_WriteListSem);
 				}
-			} else {
-				// Send packets
-				ObtainSemaphore(&db->db_WriteListSem);
-				counter = 8;   // Max of 8 per loop      
-				for(struct IOSana2Req *ior = (struct IOSana2Req *)db->db_WriteList.lh_Head; (nextwrite = (struct IOSana2Req *) ior->ios2_Req.io_Message.mn_Node.ln_Succ) != NULL; ior = nextwrite ) {
-					ULONG res = write_frame(ior, packetData, scsiDevice, db);
-					Remove((struct Node*)ior);
-					DevTermIO(db, (struct IORequest *)ior);
-					morePackets=1;
-					counter--;
-					if (!counter) break;
-				}
-				ReleaseSemaphore(&db->db_WriteListSem);
+				txDeficit -= bytesSent;
+				if ((!txPending) || (!bytesSent)) break;
 			}
+			if (!txPending) txDeficit = 0;
+			PROFILE_MARK(profiler, PROF_OTHER);
+
+			recv = SetSignal(0, SIGBREAKF_CTRL_C|SIGBREAKF_CTRL_F);
+
+			// Prevent delaying if there was data incoming, or anything is still waiting
+			UBYTE morePackets = (rxPending) || ((txPending) && (!txBlocked)) || (counter >= 2);
 			
 			if (recv & SIGBREAKF_CTRL_C) {
 				D(("Terminate Requested"));
 			} else {
-				if (!morePackets) {
+				// While the disk is busy every cycle gives it the bus for a while, and polls with nothing to do get
+				// further apart up to BUSSHARE
+				if (busShare.bs_Busy) {
+					time_req->tr_time.tv_micro = busShare.bs_Wait;
+					if (morePackets) time_req->tr_time.tv_micro = BUS_FIRST_WAIT; else {
+						busShare.bs_Wait <<= 1;
+						if (busShare.bs_Wait > busShare.bs_MaxWait) busShare.bs_Wait = busShare.bs_MaxWait;
+					}
+					PROFILE_MARK(profiler, PROF_IDLE);
+					SendIO((struct IORequest *)time_req);
+					recv = Wait(SIGBREAKF_CTRL_C | timerSignalMask | SIGBREAKF_CTRL_F | settingsSignalMask);
+					AbortIO((struct IORequest *)time_req);
+					WaitIO((struct IORequest *)time_req);
+				} else if (!morePackets) {
 					// we use unit VBLANK therefore the granularity of our wait will be 1/50th (1/60th)
 					// of a second. So essentially this will wait until the next vblank, unless
 					// signaled, which is good enough to yield.
 					time_req->tr_time.tv_micro = 1L;
+					PROFILE_MARK(profiler, PROF_IDLE);
 					SendIO((struct IORequest *)time_req);
-					recv = Wait(SIGBREAKF_CTRL_C | timerSignalMask | SIGBREAKF_CTRL_F);
+					recv = Wait(SIGBREAKF_CTRL_C | timerSignalMask | SIGBREAKF_CTRL_F | settingsSignalMask);
+					AbortIO((struct IORequest *)time_req);
+					WaitIO((struct IORequest *)time_req);
 				}
 			}
 			
 		} else {
 			// Not enabled? Pause for a decent amount of time
 			time_req->tr_time.tv_micro = 250 * 1000L;
+			PROFILE_MARK(profiler, PROF_IDLE);
 			SendIO((struct IORequest *)time_req);
-			recv = Wait(SIGBREAKF_CTRL_C | timerSignalMask | SIGBREAKF_CTRL_F);
+			recv = Wait(SIGBREAKF_CTRL_C | timerSignalMask | SIGBREAKF_CTRL_F | settingsSignalMask);
 			AbortIO((struct IORequest *)time_req);
+			WaitIO((struct IORequest *)time_req);
 		}
 	}
 	
@@ -1262,15 +2892,57 @@ __saveds void frame_proc() {
 	D(("scsidayna_task: i/o shutdown\n"));
 	logMessage(db,"PacketServer: Shutting down [2]");
 
+	if (controlPort) {
+		struct ScsiDaynaControl* ctrl;
+		RemPort(controlPort);
+		while (ctrl = (struct ScsiDaynaControl*)GetMsg(controlPort)) {
+			ctrl->sc_Error = S2ERR_OUTOFSERVICE;
+			ReplyMsg((struct Message*)ctrl);
+		}
+		DeleteMsgPort(controlPort);
+	}
+	if (notifying) EndNotify(&prefsNotify);
+	if (notifySignal >= 0) FreeSignal(notifySignal);
+
+	if (arpOffloadOn) {
+		readArpStats(du, scsiDevices, numTargets, arpStats);
+		updateArpOffload(db, du, scsiDevices, numTargets, 0, arpStats);
+		logMessagef(db,"PacketServer: ARP offload answered %ld requests, dropped %ld", du->du_ArpRepliesOffloaded, du->du_ArpRequestsDropped);
+	}
+	du->du_ArpOffload = 0;
+	du->du_LearnAddress = 0;
+	ObtainSemaphore(&du->du_WriteListSem);
+	du->du_TimerBase = NULL;
+	ReleaseSemaphore(&du->du_WriteListSem);
 	SCSIWifi_enable(scsiDevice, 0); 
-	DoEvent(db, S2EVENT_OFFLINE);
-	rejectAllPackets(db);
-	FreeVec(packetData);
+	if (scsiDevices[1]) SCSIWifi_enable(scsiDevices[1], 0); 
+	DoEvent(db, du, S2EVENT_OFFLINE);
+	rejectAllPackets(db, du);
+	ObtainSemaphore(&du->du_WifiListSem);
+	rejectList(db, &du->du_WifiList, NULL, S2ERR_OUTOFSERVICE, S2WERR_UNIT_OFFLINE);
+	du->du_WifiCache = NULL;
+	ReleaseSemaphore(&du->du_WifiListSem);
+	FreeVec(wifiCache);
+	freeDMABuffer(db, packetData);
 	if (pendingSends) FreeVec(pendingSends);
+	freeDMABuffer(db, bondData);
+	if (bondPendingSends) FreeVec(bondPendingSends);
 	
 	SCSIWifi_close(scsiDevice);
+	if (scsiDevices[1]) SCSIWifi_close(scsiDevices[1]);
+#ifdef PROFILE
+	if (profiler) FreeVec(profiler);
+#endif
 	
 	logMessage(db,"PacketServer: Shutting down [3]");
+
+	if (du->du_Capture) {
+		ULONG captured, dropped;
+		Capture_stats(du->du_Capture, &captured, &dropped);
+		Capture_close(du->du_Capture);
+		du->du_Capture = NULL;
+		logMessagef(db,"PacketServer: Capture finished, %ld frames captured, %ld dropped", captured, dropped);
+	}
 	
 	CloseDevice((struct IORequest *)time_req);
 	DeleteIORequest((struct IORequest *)time_req);
@@ -1279,5 +2951,5 @@ __saveds void frame_proc() {
 	logMessage(db,"PacketServer: Closed");
 	
 	Forbid();
-	ReleaseSemaphore(&db->db_ProcSem);
+	ReleaseSemaphore(&du->du_ProcSem);
 }
@@ -24,12 +24,127 @@
 #include <exec/semaphores.h>
 #include "debug.h"
 #include "sana2.h"
+#include "control.h"
 
 /* reassign Library bases from global definitions to own struct */
 #define SysBase       db->db_SysBase
 #define DOSBase       db->db_DOSBase
 #define UtilityBase   db->db_UtilityBase
 
+#define HW_ADDRFIELDSIZE          6
+#define HW_ETH_HDR_SIZE          14       /* ethernet header: dst, src, type */
+
+/* Number of units (DaynaPORT targets) one device can drive */
+#define SCSIDAYNA_MAX_UNITS       4
+
+/* Packet types the firmware receive filter can hold, matches SCSIWIFI_FILTER_MAX_TYPES */
+#define SCSIDAYNA_FILTER_MAX_TYPES 8
+
+/* Driver specific S2_GETSPECIALSTATS records */
+#define S2SS_SCSIDAYNA_ACKSTHINNED ((S2WireType_Ethernet << 16) | 0x8001)
+#define S2SS_SCSIDAYNA_ARPREPLIES  ((S2WireType_Ethernet << 16) | 0x8002)
+#define S2SS_SCSIDAYNA_ARPDROPPED  ((S2WireType_Ethernet << 16) | 0x8003)
+#define S2SS_SCSIDAYNA_ARPFILTERED ((S2WireType_Ethernet << 16) | 0x8004)
+#define S2SS_SCSIDAYNA_BCASTLIMITED ((S2WireType_Ethernet << 16) | 0x8005)
+#define S2SS_SCSIDAYNA_TXERRORS    ((S2WireType_Ethernet << 16) | 0x8006)
+#define S2SS_SCSIDAYNA_TXRETRIES   ((S2WireType_Ethernet << 16) | 0x8007)
+#define S2SS_SCSIDAYNA_TXQUEUEFULL ((S2WireType_Ethernet << 16) | 0x8008)
+#define S2SS_SCSIDAYNA_TXDELAYDROP ((S2WireType_Ethernet << 16) | 0x8009)
+
+/* Device specific commands for managing the Wifi connection. They work while the unit is offline, and are carried out
+   by the unit's task between packet cycles. ios2_StatData points to the structure from scsiwifi.h */
+#define S2_SCSIDAYNA_WIFISCAN      0xC100   /* Scan for networks, completes when the scan has finished. StatData is NULL or SCSIWifi_ScanResults */
+#define S2_SCSIDAYNA_SCANRESULTS   0xC101   /* Results of the last scan, scans first if there hasn't been one. StatData is SCSIWifi_ScanResults */
+#define S2_SCSIDAYNA_JOINNETWORK   0xC102   /* Ask to join a network, use S2_SCSIDAYNA_GETNETWORK to see if it worked. StatData is SCSIWifi_JoinRequest */
+#define S2_SCSIDAYNA_GETNETWORK    0xC103   /* The network currently joined, rssi is 0 if not connected. StatData is SCSIWifi_NetworkEntry */
+
+/* Packet types the broadcast rate limit tracks separately, the last bucket is shared by the rest */
+#define SCSIDAYNA_BCAST_BUCKETS    8
+
+/* Token bucket for one packet type's broadcasts */
+struct BcastBucket {
+	USHORT bb_Type;         // 0 if unused
+	ULONG bb_Tokens;        // in 1/16ths of a frame
+	ULONG bb_Slice;         // du_BcastSlice when last topped up
+};
+
+/* Per unit state. io_Unit of every opened request points to one of these */
+struct devunit {
+	struct Unit du_Unit;        /* unit_OpenCnt is the per unit open count */
+	USHORT du_UnitNum;
+	struct Sana2DeviceStats du_DevStats;
+	UBYTE du_MAC[HW_ADDRFIELDSIZE];
+
+	volatile USHORT du_online;
+	volatile USHORT du_currentWifiState;   // the *actual* online state
+	USHORT du_amigaNetMode;
+	ULONG du_maxPacketsSize;		// Maximum size of packet data (multiple packets), over 64KB needs the 10 byte commands
+	ULONG du_maxBatchLimit;			// What du_maxPacketsSize would be without the DATASIZE setting
+	USHORT du_maxPackets;			// Maximum number of supported packets per call
+	USHORT du_compactMode;			// Batches use compact packet headers
+	USHORT du_txCredits;			// Received batch headers say how much room the firmware has to send
+	USHORT du_bufferMem;			// Where packet buffers are allocated, BUFFERMEM_* but never BUFFERMEM_AUTO
+	USHORT du_cacheDMA;				// The CPU caches are flushed around packet transfers
+	ULONG du_busyBatchLimit;		// Largest batch while the disk is using the SCSI bus, 0 when it isn't
+
+    // SCSI device (in the unit's task)
+	void* du_scsiSettings;    // A pointer to this unit's ScsiDaynaSettings struct
+	struct MinList du_Openers;      // BufferManagement of everyone who has the unit open, each holds its own CMD_READ queue
+	struct SignalSemaphore du_ReadListSem;  // protects du_Openers and their read queues
+	struct List du_WriteList;
+	struct SignalSemaphore du_WriteListSem;
+	struct List du_EventList;
+	struct SignalSemaphore du_EventListSem;
+	struct List du_ReadOrphanList;
+	struct SignalSemaphore du_ReadOrphanListSem;
+	struct List du_WifiList;        // Wifi management requests waiting for the unit's task
+	struct SignalSemaphore du_WifiListSem;  // protects du_WifiList and du_WifiCache
+	void* du_WifiCache;      // The unit's task's WifiCache struct while it's running
+	char du_LastSSID[64];    // The network the link was last up on, kept while the device is loaded so joining it again is quicker
+	UBYTE du_LastBSSID[6];
+	UBYTE du_LastChannel;
+	struct Process* du_Proc;
+	struct SignalSemaphore du_ProcSem;
+	char du_ProcName[32];
+	void* du_Capture;        // CAPTUREHandle while frames are being captured to a pcap file (only used by the unit's task)
+
+	// Firmware receive filter, rebuilt by the unit's task from the packet types being read
+	volatile UBYTE du_FilterActive;     // 0 while the firmware is passing every packet type
+	volatile UBYTE du_FilterChanged;    // Set when a CMD_READ is queued for a type the filter doesn't pass
+	USHORT du_FilterCount;
+	USHORT du_FilterTypes[SCSIDAYNA_FILTER_MAX_TYPES];
+
+	ULONG du_AcksThinned;     // Pure ACKs completed without sending because a newer one was queued
+
+	// ARP offload, our IPv4 address is picked up from what's sent and handed to the firmware
+	UBYTE du_ArpOffload;               // Set while the firmware should be given our address
+	volatile UBYTE du_IPAddressChanged;
+	UBYTE du_IPAddress[4];
+	ULONG du_ArpRepliesOffloaded;      // ARP requests the firmware answered for us
+	ULONG du_ArpRequestsDropped;       // ARP requests for other hosts the firmware dropped
+	UBYTE du_LearnAddress;             // Set while the IPv4 address should be watched for
+
+	// Broadcast filter for received frames (only used by the unit's task)
+	UBYTE du_BcastFilter;              // Drop ARP requests for other hosts
+	USHORT du_BcastRate;               // Broadcast frames per second let through for each packet type, 0 for no limit
+	ULONG du_BcastSlice;               // The time in 1/16ths of a second
+	struct BcastBucket du_BcastBuckets[SCSIDAYNA_BCAST_BUCKETS];
+	ULONG du_ArpFiltered;              // ARP requests for other hosts dropped
+	ULONG du_BcastLimited;             // Broadcasts dropped by the rate limit
+
+	ULONG du_TxErrors;                 // Batch sends the device failed
+	ULONG du_TxRetries;                // Batch sends tried again after a failure that was worth retrying
+
+	// Transmit queue, the counts and limits are protected by du_WriteListSem. A limit of 0 means there isn't one
+	USHORT du_TxQueued;                // Writes waiting in du_WriteList
+	ULONG du_TxQueuedBytes;            // and how many bytes they'll send
+	USHORT du_TxQueueLimit;
+	ULONG du_TxQueueByteLimit;
+	struct Library* du_TimerBase;      // The unit's task's timer.device while it's running, queued writes are stamped with the EClock
+	ULONG du_TxQueueFull;              // Writes failed because the queue was full
+	ULONG du_TxDelayDropped;           // Writes dropped because the queue stayed slow
+};
+
 struct devbase {
 	struct Library db_Lib;
 	BPTR db_SegList;            /* from Device Init */
@@ -37,29 +152,12 @@ struct devbase {
 	struct Library *db_SysBase; /* Exec Base */
 	struct Library *db_DOSBase;
 	struct Library *db_UtilityBase;
-	struct Sana2DeviceStats db_DevStats;
 	
 	BPTR db_debugConsole;  // I couldnt get any form of S2_SANA2HOOK working	
 	BOOL db_decrementCountOnFail;
-		
-	volatile USHORT db_online;
-	volatile USHORT db_currentWifiState;   // the *actual* online state
-	USHORT db_amigaNetMode;
-	USHORT db_maxPacketsSize;		// Maximum size of packet data (multiple packets)
-	USHORT db_maxPackets;			// Maximum number of supported packets per call
-	
-    // SCSI device (in the main task)
-	void* db_scsiSettings;    // A pointer to a ScsiDaynaSettings struct  
-	struct List db_ReadList;
-	struct SignalSemaphore db_ReadListSem;
-	struct List db_WriteList;
-	struct SignalSemaphore db_WriteListSem;
-	struct List db_EventList;
-	struct SignalSemaphore db_EventListSem;   
-	struct List db_ReadOrphanList;
-	struct SignalSemaphore db_ReadOrphanListSem;
-	struct Process* db_Proc;
-	struct SignalSemaphore db_ProcSem;
+
+	void* db_scsiSettings;    // Array of SCSIDAYNA_MAX_UNITS ScsiDaynaSettings structs, unit 0 holds the global ones (eg: DEBUG)
+	struct devunit db_Units[SCSIDAYNA_MAX_UNITS];
 };
 
 #ifndef DEVBASETYPE
@@ -68,6 +166,9 @@ struct devbase {
 #ifndef DEVBASEP
 #define DEVBASEP DEVBASETYPE *db
 #endif
+#ifndef DEVUNITP
+#define DEVUNITP struct devunit *du
+#endif
 
 /* PROTOS */
 
@@ -100,9 +201,6 @@ void DevTermIO( DEVBASETYPE*, struct IORequest * );
 
 #endif /* DEVICE_MAIN */
 
-#define HW_ADDRFIELDSIZE          6
-#define HW_ETH_HDR_SIZE          14       /* ethernet header: dst, src, type */
-
 typedef BOOL (*BMFunc)(__reg("a0") void* a, __reg("a1") void* b, __reg("d0") long c);
 
 typedef struct BufferManagement
@@ -110,6 +208,8 @@ typedef struct BufferManagement
   struct MinNode   bm_Node;
   BMFunc           bm_CopyFromBuffer;
   BMFunc           bm_CopyToBuffer;
+  struct Hook*     bm_PacketFilter;  // Optional S2_PacketFilter, called before a frame is copied to this opener
+  struct List      bm_ReadList;      // CMD_READ requests queued by this opener
 } BufferManagement;
 
 #endif /* _INC_DEVICE_H */
@@ -0,0 +1,92 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * EClock profiling of the packet scheduler, only built in with profile=1
+ *
+ * The scheduler marks the start of each phase of its cycle, and the time between marks is charged
+ * to the phase being left. Nothing here divides, so it's safe to call in the middle of a cycle.
+ */
+
+#include <proto/exec.h>
+#include <exec/execbase.h>
+#include <devices/timer.h>
+#include <proto/timer.h>
+#include <exec/types.h>
+#include <string.h>
+#include "profile.h"
+
+#define TimerBase prof->pr_TimerBase
+
+// Adds ticks to a 64-bit total
+static void addTime(struct ProfileTime* time, ULONG ticks) {
+	ULONG lo = time->pt_Lo + ticks;
+	if (lo < time->pt_Lo) time->pt_Hi++;
+	time->pt_Lo = lo;
+}
+
+// Clears everything collected and starts timing PROF_OTHER
+void Profile_reset(struct Profiler* prof, struct Library* timerBase) {
+	struct EClockVal now;
+	memset(prof, 0, sizeof(struct Profiler));
+	prof->pr_TimerBase = timerBase;
+	prof->pr_Profile.sp_EClockFreq = ReadEClock(&now);
+	// About 1/32 of a second, a bit over one frame
+	prof->pr_Profile.sp_StallThreshold = prof->pr_Profile.sp_EClockFreq >> 5;
+	prof->pr_Mark = now.ev_lo;
+	prof->pr_Phase = PROF_OTHER;
+}
+
+// Charges the time since the last mark to the current phase and moves on to phase
+void Profile_mark(struct Profiler* prof, UWORD phase) {
+	struct EClockVal now;
+	if (!prof) return;
+	ReadEClock(&now);
+	ULONG ticks = now.ev_lo - prof->pr_Mark;
+	struct ProfilePhase* pp = &prof->pr_Profile.sp_Phases[prof->pr_Phase];
+
+	pp->pp_Count++;
+	addTime(&pp->pp_Total, ticks);
+	if (ticks > pp->pp_Max) pp->pp_Max = ticks;
+	prof->pr_Cycle[prof->pr_Phase] += ticks;
+	prof->pr_Mark = now.ev_lo;
+	prof->pr_Phase = phase;
+}
+
+// Ends a scheduler cycle, recording it as a stall if it was over the threshold
+void Profile_endCycle(struct Profiler* prof) {
+	if (!prof) return;
+	struct ScsiDaynaProfile* profile = &prof->pr_Profile;
+	ULONG total = 0;
+
+	for (UWORD phase=0; phase<PROF_NUM_PHASES; phase++)
+		if (phase != PROF_IDLE) total += prof->pr_Cycle[phase];
+	if (total > profile->sp_StallThreshold) {
+		struct ProfileStall* stall = &profile->sp_LastStalls[profile->sp_Stalls & (PROF_NUM_STALLS - 1)];
+		stall->ps_Cycle = profile->sp_Cycles;
+		stall->ps_Total = total;
+		memcpy(stall->ps_Phases, prof->pr_Cycle, sizeof(stall->ps_Phases));
+		profile->sp_Stalls++;
+	}
+	memset(prof->pr_Cycle, 0, sizeof(prof->pr_Cycle));
+	profile->sp_Cycles++;
+}
+
+// Adds the latency of a SCSI command to its distribution
+void Profile_cdb(struct ScsiDaynaProfile* profile, UBYTE opcode, UBYTE subCommand, ULONG ticks) {
+	struct ProfileCdb* cdb = profile->sp_Cdbs;
+	UWORD i;
+
+	for (i=0; i<profile->sp_NumCdbs; i++, cdb++)
+		if ((cdb->pc_Opcode == opcode) && (cdb->pc_SubCommand == subCommand)) break;
+	if (i == profile->sp_NumCdbs) {
+		if (profile->sp_NumCdbs >= PROF_MAX_CDBS) return;
+		profile->sp_NumCdbs++;
+		cdb->pc_Opcode = opcode;
+		cdb->pc_SubCommand = subCommand;
+	}
+
+	UWORD bucket = 0;
+	for (ULONG t = ticks; (t > 1) && (bucket < PROF_NUM_BUCKETS - 1); t >>= 1) bucket++;
+	cdb->pc_Buckets[bucket]++;
+	cdb->pc_Count++;
+	if (ticks > cdb->pc_Max) cdb->pc_Max = ticks;
+}
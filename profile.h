@@ -0,0 +1,101 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * EClock profiling of the packet scheduler, only built in with profile=1
+ *
+ */
+#ifndef PROFILE_H
+#define PROFILE_H 1
+
+#include <exec/types.h>
+#include <exec/libraries.h>
+
+// Phases of a scheduler cycle that time is charged to
+#define PROF_RX_DOIO        0      // SCSI commands reading packets
+#define PROF_RX_DISPATCH    1      // Unpacking received batches and handing packets to readers
+#define PROF_TX_BUILD       2      // Packing queued writes into a batch
+#define PROF_TX_DOIO        3      // SCSI commands sending packets
+#define PROF_WIFI_CHECK     4      // The Wifi status check and the housekeeping every 5 seconds
+#define PROF_IDLE           5      // Waiting for something to do
+#define PROF_OTHER          6      // Everything else, eg: settings, state changes and Wifi management
+#define PROF_NUM_PHASES     7
+
+// SCSI command latencies are counted in buckets of powers of 2 EClock ticks (1, 2-3, 4-7...), the last takes the rest
+#define PROF_NUM_BUCKETS    16
+// Different commands tracked, by opcode and sub command
+#define PROF_MAX_CDBS       12
+// Cycles over the stall threshold kept, must be a power of 2
+#define PROF_NUM_STALLS     8
+
+// A 64-bit count of EClock ticks
+struct ProfileTime {
+	ULONG pt_Hi;
+	ULONG pt_Lo;
+};
+
+struct ProfilePhase {
+	ULONG pp_Count;                 // Number of times the phase was entered
+	struct ProfileTime pp_Total;
+	ULONG pp_Max;                   // Longest single stay in the phase
+};
+
+// Latency of one kind of SCSI command
+struct ProfileCdb {
+	UBYTE pc_Opcode;
+	UBYTE pc_SubCommand;            // Byte 1 of the CDB, which picks the command for the DaynaPORT vendor opcodes
+	UWORD pc_Padding;
+	ULONG pc_Count;
+	ULONG pc_Max;
+	ULONG pc_Buckets[PROF_NUM_BUCKETS];
+};
+
+// A cycle that took longer than the stall threshold, with where the time went
+struct ProfileStall {
+	ULONG ps_Cycle;
+	ULONG ps_Total;
+	ULONG ps_Phases[PROF_NUM_PHASES];
+};
+
+// Everything collected, as returned through the control port with SCSIDAYNA_CTRL_PROFILE
+struct ScsiDaynaProfile {
+	ULONG sp_EClockFreq;            // EClock ticks per second
+	ULONG sp_Cycles;
+	ULONG sp_StallThreshold;        // Cycles over this many ticks (not counting idle) are stalls
+	ULONG sp_Stalls;                // Total number of stalls, the newest is at (sp_Stalls - 1) & (PROF_NUM_STALLS - 1)
+	struct ProfilePhase sp_Phases[PROF_NUM_PHASES];
+	struct ProfileStall sp_LastStalls[PROF_NUM_STALLS];
+	UWORD sp_NumCdbs;
+	UWORD sp_Padding;
+	struct ProfileCdb sp_Cdbs[PROF_MAX_CDBS];
+};
+
+// The scheduler's profiler. Only ever used from the unit's task
+struct Profiler {
+	struct Library* pr_TimerBase;
+	ULONG pr_Mark;                  // EClock (low word) when the current phase started
+	ULONG pr_Cycle[PROF_NUM_PHASES];    // Time spent in each phase this cycle
+	UWORD pr_Phase;
+	UWORD pr_Padding;
+	struct ScsiDaynaProfile pr_Profile;
+};
+
+// Clears everything collected and starts timing PROF_OTHER
+void Profile_reset(struct Profiler* prof, struct Library* timerBase);
+
+// Charges the time since the last mark to the current phase and moves on to phase. Does nothing if prof is NULL
+void Profile_mark(struct Profiler* prof, UWORD phase);
+
+// Ends a scheduler cycle, recording it as a stall if it was over the threshold. Does nothing if prof is NULL
+void Profile_endCycle(struct Profiler* prof);
+
+// Adds the latency of a SCSI command to its distribution
+void Profile_cdb(struct ScsiDaynaProfile* profile, UBYTE opcode, UBYTE subCommand, ULONG ticks);
+
+#ifdef PROFILE
+#define PROFILE_MARK(prof, phase)   Profile_mark(prof, phase)
+#define PROFILE_END_CYCLE(prof)     Profile_endCycle(prof)
+#else
+#define PROFILE_MARK(prof, phase)
+#define PROFILE_END_CYCLE(prof)
+#endif
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Measures the SCSI link to an AmigaNET device on its own, without the Wifi or a TCP/IP stack in the way
+ *
+ * Usage: scsidaynalink [UNIT=n] [DEVICE=name] [ID=n] [MODE=n] [TEST=SINK|SOURCE|ECHO] [SIZES=n,n,...] [SECONDS=n]
+ */
+
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <proto/timer.h>
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/execbase.h>
+#include <devices/timer.h>
+#include <dos/dos.h>
+#include <string.h>
+#include "scsiwifi.h"
+
+#define NUM_DEFAULT_SIZES 9
+static const ULONG defaultSizes[NUM_DEFAULT_SIZES] = {512, 1024, 1524, 4096, 8192, 16384, 32768, 65536, 131072};
+#define MAX_SIZES 16
+
+static const char* testNames[3] = {"Sink", "Source", "Echo"};
+static const char* modeNames[3] = {"DaynaPORT", "24 byte blocks", "One block"};
+
+// One size of one test
+struct LinkResult {
+	ULONG lr_Commands;      // SCSI commands that worked, an echo is two
+	ULONG lr_Bytes;         // Bytes moved across the bus, both ways for an echo
+	ULONG lr_Ticks;         // EClock ticks it took
+	ULONG lr_Failed;        // Commands that failed or moved less than asked
+	ULONG lr_Mismatched;    // Echoes that came back different
+};
+
+// EClock ticks to microseconds, without overflowing for anything under an hour
+static ULONG ticksToUs(ULONG ticks, ULONG freq) {
+	ULONG perMs = freq / 1000;
+	return (ticks / perMs) * 1000 + ((ticks % perMs) * 1000) / perMs;
+}
+
+// Reads a list of sizes like 1024,8192,65536. Returns how many were found
+static UWORD parseSizes(const char* text, ULONG* sizes) {
+	UWORD count = 0;
+	ULONG value = 0;
+	BOOL digits = FALSE;
+	for (;;) {
+		if ((*text >= '0') && (*text <= '9')) {
+			value = (value * 10) + (*text - '0');
+			digits = TRUE;
+		} else {
+			if ((digits) && (value) && (count < MAX_SIZES)) sizes[count++] = value;
+			value = 0;
+			digits = FALSE;
+			if (!*text) break;
+		}
+		text++;
+	}
+	return count;
+}
+
+// Runs one test at one size for the given number of EClock ticks, or until CTRL-C
+static void runTest(struct Library* TimerBase, SCSIWIFIDevice device, UWORD test, UBYTE* buffer, UBYTE* echoBuffer, ULONG size, ULONG duration, struct LinkResult* result) {
+	struct EClockVal start, now;
+	memset(result, 0, sizeof(struct LinkResult));
+	for (ULONG i=0; i<size; i++) buffer[i] = (UBYTE)i;
+
+	ReadEClock(&start);
+	do {
+		switch (test) {
+			case AMIGANET_TEST_SINK:
+			case AMIGANET_TEST_SOURCE:
+				if ((ULONG)SCSIWifi_AmigaNetLinkTest(device, test, buffer, size) == size) {
+					result->lr_Commands++;
+					result->lr_Bytes += size;
+				} else result->lr_Failed++;
+				break;
+
+			default:
+				// The first byte changes each time so a stale echo is spotted
+				buffer[0] = (UBYTE)result->lr_Commands;
+				if ((ULONG)SCSIWifi_AmigaNetLinkTest(device, AMIGANET_TEST_ECHO_WRITE, buffer, size) != size) {
+					result->lr_Failed++;
+					break;
+				}
+				if ((ULONG)SCSIWifi_AmigaNetLinkTest(device, AMIGANET_TEST_ECHO_READ, echoBuffer, size) != size) {
+					result->lr_Failed++;
+					break;
+				}
+				if (memcmp(buffer, echoBuffer, size)) result->lr_Mismatched++;
+				result->lr_Commands += 2;
+				result->lr_Bytes += size << 1;
+				break;
+		}
+		ReadEClock(&now);
+		result->lr_Ticks = now.ev_lo - start.ev_lo;
+	} while ((result->lr_Ticks < duration) && (result->lr_Failed < 10) && (!(SetSignal(0L, 0L) & SIGBREAKF_CTRL_C)));
+}
+
+// Shows a result line as MB/s and commands/s
+static void showResult(ULONG size, struct LinkResult* result, ULONG freq) {
+	ULONG ms = ticksToUs(result->lr_Ticks, freq) / 1000;
+	if (!ms) ms = 1;
+	ULONG bytesPerSec = (result->lr_Bytes / ms) * 1000 + ((result->lr_Bytes % ms) * 1000) / ms;
+	ULONG cmdsPerSec = (result->lr_Commands * 1000) / ms;
+	ULONG usPerCmd = result->lr_Commands ? ticksToUs(result->lr_Ticks, freq) / result->lr_Commands : 0;
+	Printf("%8lu %5lu.%02lu %10lu %9lu %7lu", size, bytesPerSec >> 20, ((bytesPerSec & 0xFFFFF) * 100) >> 20, cmdsPerSec, usPerCmd, result->lr_Failed);
+	if (result->lr_Mismatched) Printf("  %lu echoes didn't match", result->lr_Mismatched);
+	Printf("\n");
+}
+
+int main(void) {
+	LONG args[7] = {0, 0, 0, 0, 0, 0, 0};
+	struct RDArgs* rdargs = ReadArgs("UNIT/K/N,DEVICE/K,ID/K/N,MODE/K/N,TEST/K,SIZES/K,SECONDS/K/N", args, NULL);
+	if (!rdargs) {
+		PrintFault(IoErr(), "scsidaynalink");
+		return RETURN_FAIL;
+	}
+
+	struct Library* UtilityBase = OpenLibrary("utility.library", 37);
+	if (!UtilityBase) {
+		FreeArgs(rdargs);
+		Printf("Needs utility.library V37\n");
+		return RETURN_FAIL;
+	}
+
+	// Start with the same settings the device would use for this unit
+	struct ScsiDaynaSettings settings;
+	LONG unit = args[0] ? *(LONG*)args[0] : 0;
+	SCSIWifi_loadUnitSettings(UtilityBase, DOSBase, &settings, (USHORT)(unit & 7));
+	if (args[1]) {
+		strncpy(settings.deviceName, (char*)args[1], sizeof(settings.deviceName) - 1);
+		settings.deviceName[sizeof(settings.deviceName) - 1] = '\0';
+	}
+	if (args[2]) settings.deviceID = *(LONG*)args[2];
+	if (args[3]) settings.scsiMode = *(LONG*)args[3];
+
+	UWORD firstTest = AMIGANET_TEST_SINK, lastTest = AMIGANET_TEST_ECHO_WRITE;
+	if (args[4]) {
+		if (Stricmp((char*)args[4], "SINK") == 0) firstTest = lastTest = AMIGANET_TEST_SINK; else
+		if (Stricmp((char*)args[4], "SOURCE") == 0) firstTest = lastTest = AMIGANET_TEST_SOURCE; else
+		if (Stricmp((char*)args[4], "ECHO") == 0) firstTest = lastTest = AMIGANET_TEST_ECHO_WRITE; else {
+			Printf("TEST must be SINK, SOURCE or ECHO\n");
+			FreeArgs(rdargs);
+			CloseLibrary(UtilityBase);
+			return RETURN_ERROR;
+		}
+	}
+
+	ULONG sizes[MAX_SIZES];
+	UWORD numSizes = NUM_DEFAULT_SIZES;
+	memcpy(sizes, defaultSizes, sizeof(defaultSizes));
+	if (args[5]) numSizes = parseSizes((char*)args[5], sizes);
+	LONG seconds = args[6] ? *(LONG*)args[6] : 2;
+	if (seconds < 1) seconds = 1;
+	FreeArgs(rdargs);
+
+	// Find and open the target as the device does
+	struct SCSIDevice_OpenData openData;
+	openData.sysBase = (struct ExecBase*)SysBase;
+	openData.utilityBase = (void*)UtilityBase;
+	openData.dosBase = (void*)DOSBase;
+	openData.deviceDriverName = settings.deviceName;
+	openData.deviceID = settings.deviceID;
+	openData.scsiMode = (settings.scsiMode > SCSIMODE_ONEBLOCK) ? SCSIMODE_DAYNAPORT : settings.scsiMode;
+	enum SCSIWifi_OpenResult scsiResult = sworOpenDeviceFailed;
+	SCSIWIFIDevice device = NULL;
+	if ((settings.deviceID<0) || (settings.deviceID>7)) {
+		for (USHORT deviceID=4; (!device) && (deviceID<4+8); deviceID++) {
+			openData.deviceID = deviceID & 7;
+			device = SCSIWifi_open(&openData, &scsiResult);
+		}
+	} else device = SCSIWifi_open(&openData, &scsiResult);
+
+	if (!device) {
+		Printf("No DaynaPORT device found on %s\n", settings.deviceName);
+		CloseLibrary(UtilityBase);
+		return RETURN_WARN;
+	}
+
+	struct SCSIWifi_DeviceInfo devInfo;
+	if ((scsiResult != sworGreat) || (!SCSIWifi_getDeviceInfo(device, &devInfo)) || (!(devInfo.capabilities & SCSIWIFI_CAP_LINKTEST))) {
+		Printf("%s ID %ld needs AmigaNET firmware with the link test commands\n", settings.deviceName, openData.deviceID);
+		SCSIWifi_close(device);
+		CloseLibrary(UtilityBase);
+		return RETURN_WARN;
+	}
+
+	// MODE=3 uses whatever the device found last time, this doesn't probe itself. The mode is set when it's opened
+	USHORT probing = 0;
+	if (settings.scsiMode > SCSIMODE_ONEBLOCK) {
+		settings.scsiMode = SCSIWifi_getRememberedMode(device, settings.deviceName, &probing);
+		if ((settings.scsiMode > SCSIMODE_ONEBLOCK) || (probing)) {
+			Printf("The device hasn't found a MODE for %s yet, using 0\n", settings.deviceName);
+			settings.scsiMode = SCSIMODE_DAYNAPORT;
+		}
+		if (settings.scsiMode != openData.scsiMode) {
+			SCSIWifi_close(device);
+			openData.scsiMode = settings.scsiMode;
+			device = SCSIWifi_open(&openData, &scsiResult);
+			if (!device) {
+				Printf("Failed to reopen %s ID %ld\n", settings.deviceName, openData.deviceID);
+				CloseLibrary(UtilityBase);
+				return RETURN_WARN;
+			}
+		}
+	}
+
+	// Transfers can't be bigger than the firmware or the controller take
+	ULONG maxSize = devInfo.maxBatchSize;
+	if (!(devInfo.capabilities & SCSIWIFI_CAP_LARGEBATCH) && (maxSize > 0xFFFF)) maxSize = 0xFFFF;
+	ULONG maxTransfer = SCSIWifi_getMaxTransfer(device, settings.deviceName);
+	if ((maxTransfer) && (maxSize > maxTransfer)) maxSize = maxTransfer;
+	ULONG largest = 0;
+	for (UWORD i=0; i<numSizes; i++)
+		if ((sizes[i] <= maxSize) && (sizes[i] > largest)) largest = sizes[i];
+
+	// Buffers go where the device would put its own
+	ULONG memType = (SCSIWifi_getDMAMask(device, settings.deviceName) & 0xFF000000UL) ? MEMF_PUBLIC|MEMF_FAST : MEMF_PUBLIC|MEMF_FAST|MEMF_24BITDMA;
+	UBYTE* buffer = largest ? AllocVec(largest, memType) : NULL;
+	UBYTE* echoBuffer = largest ? AllocVec(largest, memType) : NULL;
+	if (!buffer) buffer = largest ? AllocVec(largest, MEMF_PUBLIC) : NULL;
+	if (!echoBuffer) echoBuffer = largest ? AllocVec(largest, MEMF_PUBLIC) : NULL;
+	struct MsgPort* timerPort = CreateMsgPort();
+	struct timerequest* timeReq = timerPort ? (struct timerequest*)CreateIORequest(timerPort, sizeof(struct timerequest)) : NULL;
+	int result = RETURN_OK;
+
+	if ((!buffer) || (!echoBuffer) || (!timeReq) || (OpenDevice(TIMERNAME, UNIT_ECLOCK, (struct IORequest*)timeReq, 0))) {
+		if (!largest) Printf("None of the sizes fit in the largest transfer of %lu bytes\n", maxSize);
+			else Printf("Out of memory\n");
+		if (timeReq) DeleteIORequest(timeReq);
+		timeReq = NULL;
+		result = RETURN_FAIL;
+	}
+
+	if (result == RETURN_OK) {
+		struct Library* TimerBase = (struct Library*)timeReq->tr_node.io_Device;
+		struct EClockVal now;
+		ULONG freq = ReadEClock(&now);
+		struct LinkResult linkResult;
+
+		SCSIWifi_setCacheDMA(device, (settings.cacheDMA == CACHEDMA_ON) || ((settings.cacheDMA == CACHEDMA_AUTO) && (((struct ExecBase*)SysBase)->AttnFlags & (AFF_68040 | AFF_68060))));
+		Printf("%s ID %ld, MODE=%ld (%s), largest transfer %lu bytes\n", settings.deviceName, openData.deviceID, settings.scsiMode, modeNames[settings.scsiMode], maxSize);
+		for (UWORD test=firstTest; (test<=lastTest) && (result == RETURN_OK); test++) {
+			Printf("\n%s%s\n    Size   MB/s   Commands/s  us/command  Failed\n", testNames[test], (test == AMIGANET_TEST_ECHO_WRITE) ? " (both ways, a write and a read each time)" : "");
+			for (UWORD i=0; i<numSizes; i++) {
+				if (sizes[i] > maxSize) {
+					Printf("%8lu  too big\n", sizes[i]);
+					continue;
+				}
+				runTest(TimerBase, device, test, buffer, echoBuffer, sizes[i], seconds * freq, &linkResult);
+				showResult(sizes[i], &linkResult, freq);
+				if (SetSignal(0L, SIGBREAKF_CTRL_C) & SIGBREAKF_CTRL_C) {
+					Printf("***Break\n");
+					result = RETURN_WARN;
+					break;
+				}
+			}
+		}
+		CloseDevice((struct IORequest*)timeReq);
+		DeleteIORequest(timeReq);
+	}
+
+	if (timerPort) DeleteMsgPort(timerPort);
+	if (buffer) FreeVec(buffer);
+	if (echoBuffer) FreeVec(echoBuffer);
+	SCSIWifi_close(device);
+	CloseLibrary(UtilityBase);
+	return result;
+}
@@ -0,0 +1,142 @@
+/*
+ * SCSI DaynaPORT Device (scsidayna.device) Copyright (C) 2024-2026 RobSmithDev
+ * Shows the profile collected by a profile=1 build of the device
+ *
+ * Usage: scsidaynaprof [UNIT=n] [RESET]
+ */
+
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/ports.h>
+#include <dos/dos.h>
+#include <string.h>
+#include "sana2.h"
+#include "control.h"
+#include "profile.h"
+
+static const char* phaseNames[PROF_NUM_PHASES] = { "SCSI receive", "Receive dispatch", "Send batch build", "SCSI send", "Wifi status check", "Idle", "Other" };
+
+// Divides a 64-bit count of EClock ticks down to milliseconds
+static ULONG ticksToMs(ULONG hi, ULONG lo, ULONG freq) {
+	ULONG perMs = freq / 1000;
+	ULONG remainder = 0, quotient = 0;
+	for (WORD bit=63; bit>=0; bit--) {
+		remainder = (remainder << 1) | (((bit >= 32) ? (hi >> (bit - 32)) : (lo >> bit)) & 1);
+		quotient <<= 1;
+		if (remainder >= perMs) {
+			remainder -= perMs;
+			quotient |= 1;
+		}
+	}
+	return quotient;
+}
+
+// EClock ticks to microseconds, without overflowing for anything under an hour
+static ULONG ticksToUs(ULONG ticks, ULONG freq) {
+	ULONG perMs = freq / 1000;
+	return (ticks / perMs) * 1000 + ((ticks % perMs) * 1000) / perMs;
+}
+
+int main(void) {
+	LONG args[2] = {0, 0};
+	struct RDArgs* rdargs = ReadArgs("UNIT/N,RESET/S", args, NULL);
+	if (!rdargs) {
+		PrintFault(IoErr(), "scsidaynaprof");
+		return RETURN_FAIL;
+	}
+	LONG unit = args[0] ? *(LONG*)args[0] : 0;
+	BOOL reset = args[1] ? TRUE : FALSE;
+	FreeArgs(rdargs);
+
+	char portName[24];
+	strcpy(portName, SCSIDAYNA_CONTROL_PORT);
+	if (unit) {
+		USHORT len = strlen(portName);
+		portName[len] = '.';
+		portName[len+1] = '0' + (unit & 7);
+		portName[len+2] = '\0';
+	}
+
+	struct ScsiDaynaProfile* profile = (struct ScsiDaynaProfile*)AllocVec(sizeof(struct ScsiDaynaProfile), MEMF_PUBLIC|MEMF_CLEAR);
+	struct MsgPort* replyPort = CreateMsgPort();
+	if ((!profile) || (!replyPort)) {
+		if (profile) FreeVec(profile);
+		if (replyPort) DeleteMsgPort(replyPort);
+		Printf("Out of memory\n");
+		return RETURN_FAIL;
+	}
+
+	struct ScsiDaynaControl ctrl;
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.sc_Msg.mn_ReplyPort = replyPort;
+	ctrl.sc_Msg.mn_Length = sizeof(ctrl);
+	ctrl.sc_Command = SCSIDAYNA_CTRL_PROFILE;
+	ctrl.sc_Value = reset;
+	ctrl.sc_Data = profile;
+	ctrl.sc_DataLength = sizeof(struct ScsiDaynaProfile);
+
+	Forbid();
+	struct MsgPort* port = FindPort(portName);
+	if (port) PutMsg(port, (struct Message*)&ctrl);
+	Permit();
+
+	int result = RETURN_OK;
+	if (!port) {
+		Printf("%s not found, is unit %ld open?\n", portName, unit);
+		result = RETURN_WARN;
+	} else {
+		WaitPort(replyPort);
+		GetMsg(replyPort);
+		if (ctrl.sc_Error == S2ERR_NOT_SUPPORTED) {
+			Printf("The device wasn't built with profile=1\n");
+			result = RETURN_WARN;
+		} else if (ctrl.sc_Error) {
+			Printf("Failed to read the profile (error %ld)\n", ctrl.sc_Error);
+			result = RETURN_WARN;
+		}
+	}
+
+	if (result == RETURN_OK) {
+		ULONG freq = profile->sp_EClockFreq;
+		ULONG totalMs = 0;
+		for (UWORD phase=0; phase<PROF_NUM_PHASES; phase++)
+			totalMs += ticksToMs(profile->sp_Phases[phase].pp_Total.pt_Hi, profile->sp_Phases[phase].pp_Total.pt_Lo, freq);
+
+		Printf("Unit %ld: %lu cycles over %lu ms, EClock %lu Hz\n\n", unit, profile->sp_Cycles, totalMs, freq);
+		Printf("Phase                   Count    Total ms     %%   Max us\n");
+		for (UWORD phase=0; phase<PROF_NUM_PHASES; phase++) {
+			struct ProfilePhase* pp = &profile->sp_Phases[phase];
+			ULONG ms = ticksToMs(pp->pp_Total.pt_Hi, pp->pp_Total.pt_Lo, freq);
+			Printf("%-20s %8lu %11lu %5lu %8lu\n", phaseNames[phase], pp->pp_Count, ms, totalMs ? (ms * 100) / totalMs : 0, ticksToUs(pp->pp_Max, freq));
+		}
+
+		Printf("\nSCSI command latency (count by upper bound in us)\n");
+		for (UWORD i=0; i<profile->sp_NumCdbs; i++) {
+			struct ProfileCdb* cdb = &profile->sp_Cdbs[i];
+			Printf("CDB %02lx/%02lx: %lu commands, max %lu us\n ", cdb->pc_Opcode, cdb->pc_SubCommand, cdb->pc_Count, ticksToUs(cdb->pc_Max, freq));
+			for (UWORD bucket=0; bucket<PROF_NUM_BUCKETS; bucket++) {
+				if (!cdb->pc_Buckets[bucket]) continue;
+				if (bucket == PROF_NUM_BUCKETS - 1) Printf(" more:%lu", cdb->pc_Buckets[bucket]);
+					else Printf(" <%lu:%lu", ticksToUs(2UL << bucket, freq), cdb->pc_Buckets[bucket]);
+			}
+			Printf("\n");
+		}
+
+		Printf("\n%lu cycles took over %lu us (not counting idle)\n", profile->sp_Stalls, ticksToUs(profile->sp_StallThreshold, freq));
+		ULONG shown = (profile->sp_Stalls < PROF_NUM_STALLS) ? profile->sp_Stalls : PROF_NUM_STALLS;
+		for (ULONG i=0; i<shown; i++) {
+			struct ProfileStall* stall = &profile->sp_LastStalls[(profile->sp_Stalls - 1 - i) & (PROF_NUM_STALLS - 1)];
+			Printf("Cycle %lu: %lu us -", stall->ps_Cycle, ticksToUs(stall->ps_Total, freq));
+			for (UWORD phase=0; phase<PROF_NUM_PHASES; phase++)
+				if ((phase != PROF_IDLE) && (stall->ps_Phases[phase])) Printf(" %s %lu", phaseNames[phase], ticksToUs(stall->ps_Phases[phase], freq));
+			Printf("\n");
+		}
+		if (reset) Printf("\nProfile cleared\n");
+	}
+
+	DeleteMsgPort(replyPort);
+	FreeVec(profile);
+	return result;
+}
@@ -11,6 +11,8 @@
 #include <proto/dos.h>
 #include <proto/utility.h>
 #include <devices/scsidisk.h>
+#include <dos/dosextens.h>
+#include <dos/filehandler.h>
 #include <proto/exec.h>
 #include <exec/types.h>
 #include <exec/memory.h>
@@ -21,6 +23,11 @@
 #include <stdlib.h>
 #include "debug.h"
 #include "scsiwifi.h"
+#ifdef PROFILE
+#include <devices/timer.h>
+#include <proto/timer.h>
+#include "profile.h"
+#endif
 
 
 #define SCSI_INQUIRY                        0x12
@@ -43,23 +50,47 @@
 #define SCSI_NETWORK_WIFI_CMD_AMIGANET_INFO 0x0B
 #define SCSI_NETWORK_WIFI_OPT_ALTREAD2      0x0C
 #define SCSI_NETWORK_WIFI_OPT_ALTWRITE2     0x0D    
+#define SCSI_NETWORK_WIFI_OPT_AMIGANET_FILTER 0x0E
+#define SCSI_NETWORK_WIFI_OPT_AMIGANET_ARPOFFLOAD 0x0F
+#define SCSI_NETWORK_WIFI_OPT_AMIGANET_ARPSTATS   0x10
+#define SCSI_NETWORK_WIFI_OPT_AMIGANET_LINKTEST   0x11
+
+// 10 byte versions of the batch commands, for batches over 64KB. Group 1/2 opcodes so the target knows the command is 10 bytes
+#define SCSI_NETWORK_WIFI_READFRAME10       0x28
+#define SCSI_NETWORK_WIFI_WRITEFRAME10      0x2A
+#define SCSI_NETWORK_WIFI_CMD10             0x5C
 
 #define AMIGENET_MODE 1
 #define AMIGASCSI_PATCH_24BYTE_BLOCKSIZE  0xA8		// When receiving keep to blocks of 24 bytes
 #define AMIGASCSI_PATCH_ONEBLOCK          0xA9		// Write in one command, not two
+// The batch flags below go in the same byte as the patches above, so they only use bits that are clear in both
 #define AMIGASCSI_BATCHMODE               0x40      // Batch Mode Bitmask
+#define AMIGASCSI_CREDITMODE              0x10      // Receive batch header includes the transmit credits
+#define AMIGASCSI_COMPACTMODE             0x04      // Batch uses compact packet headers
 
 
 #define INQUIRE_BUFFER_SIZE                 64
 
-#define NUM_TOKENS 9
-static char* CONFIG_TOKENS[NUM_TOKENS] = {"DEVICE","DEVICEID","PRIORITY","MODE","AUTOCONNECT","SSID","KEY","DATASIZE","DEBUG"};
+#define NUM_TOKENS 25
+static char* CONFIG_TOKENS[NUM_TOKENS] = {"DEVICE","DEVICEID","PRIORITY","MODE","AUTOCONNECT","SSID","KEY","DATASIZE","DEBUG","BONDID","CAPTURE","FILTER","RXQUANTUM","TXQUANTUM","TXPRIORITY","ACKTHIN","ARPOFFLOAD","BCASTFILTER","BCASTRATE","BUFFERMEM","CACHEDMA","BUSSHARE","TXQPACKETS","TXQBYTES","TXQDELAY"};
 
 // Prepares the SCSI command and resets some of the result values
 #define SCSI_PREPCMD(device, cmd, sub, a, b, c, d) \
                 device->scsiCommand[0] = cmd; device->scsiCommand[1] = sub; \
                 device->scsiCommand[2] = a;   device->scsiCommand[3] = b;     \
                 device->scsiCommand[4] = c;   device->scsiCommand[5] = d;     \
+                device->Cmd.scsi_CmdLength = 6;                                 \
+                device->Cmd.scsi_SenseActual = 0; device->Cmd.scsi_Actual = 0;  \
+                device->Cmd.scsi_Status = 1;   // Default to error
+
+// As above, but for a 10 byte command with a 32-bit length in bytes 3-6
+#define SCSI_PREPCMD10(device, cmd, sub, a, length) \
+                device->scsiCommand[0] = cmd; device->scsiCommand[1] = sub; \
+                device->scsiCommand[2] = a;                                     \
+                device->scsiCommand[3] = (UBYTE)((length) >> 24); device->scsiCommand[4] = (UBYTE)((length) >> 16); \
+                device->scsiCommand[5] = (UBYTE)((length) >> 8);  device->scsiCommand[6] = (UBYTE)(length);         \
+                device->scsiCommand[7] = 0; device->scsiCommand[8] = 0; device->scsiCommand[9] = 0;                 \
+                device->Cmd.scsi_CmdLength = 10;                                \
                 device->Cmd.scsi_SenseActual = 0; device->Cmd.scsi_Actual = 0;  \
                 device->Cmd.scsi_Status = 1;   // Default to error
 
@@ -75,6 +106,13 @@ struct SCSIDevice {
     UBYTE* scsiCommand;    // buffer to hold command, 16-bit aligned (12 bytes)
     USHORT scsiMode;
 	USHORT isAmigaWIFI;    // Set to 1 if this uses the new AmigaWIFI interface rather than the Daynaport one
+	UBYTE compactMode;     // AMIGASCSI_COMPACTMODE if batches use compact packet headers
+	UBYTE creditMode;      // AMIGASCSI_CREDITMODE if received batches report the transmit credits
+	UBYTE cacheDMA;        // Set to 1 if the CPU caches are flushed around packet transfers
+#ifdef PROFILE
+	struct Library* timerBase;
+	struct ScsiDaynaProfile* profile;   // Where command latencies are counted, NULL if they're not
+#endif
 };
 
 #define SysBase dev->sc_SysBase
@@ -84,6 +122,41 @@ struct SCSIDevice {
 
 typedef struct SCSIDevice* LSCSIDevice;
 
+#ifdef PROFILE
+#define TimerBase dev->timerBase
+
+// Runs the prepared command, counting how long it took
+static void profileDoIO(LSCSIDevice dev) {
+    struct EClockVal start, end;
+    if (!dev->profile) {
+        DoIO( (struct IORequest*)dev->SCSIReq );
+        return;
+    }
+    ReadEClock(&start);
+    DoIO( (struct IORequest*)dev->SCSIReq );
+    ReadEClock(&end);
+    Profile_cdb(dev->profile, dev->scsiCommand[0], dev->scsiCommand[1], end.ev_lo - start.ev_lo);
+}
+#define SCSI_DOIO(dev) profileDoIO(dev)
+#else
+#define SCSI_DOIO(dev) DoIO( (struct IORequest*)dev->SCSIReq )
+#endif
+
+// Runs a command that transfers packet data. Controllers that DMA but don't look after the 040/060
+// copyback cache themselves need it flushed before a write and invalidated after a read
+static void dmaDoIO(LSCSIDevice dev) {
+    if (!dev->cacheDMA) {
+        SCSI_DOIO(dev);
+        return;
+    }
+    APTR data = dev->Cmd.scsi_Data;
+    ULONG length = dev->Cmd.scsi_Length;
+    ULONG flags = (dev->Cmd.scsi_Flags & SCSIF_READ) ? 0 : DMA_ReadFromRAM;
+    CachePreDMA(data, &length, flags);
+    SCSI_DOIO(dev);
+    CachePostDMA(data, &length, flags);
+}
+
 // not ideal but couldn't get the compiler to give me __lmodu and __ldivu
 // I'm sure someone who knows what they're doing can do this much better :)
 void muldiv(USHORT num, USHORT divide, USHORT* result, USHORT* mod) {
@@ -111,6 +184,24 @@ void _ustoa(USHORT num, char* str) {
     *str++ = '\0';
 }
 
+// convert ULONG to string. Digits are found by subtracting powers of 10 as there's no 32-bit divide available
+void _ultoa(ULONG num, char* str) {
+    static const ULONG powers[10] = {1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL, 10000UL, 1000UL, 100UL, 10UL, 1UL};
+    USHORT started = 0;
+    for (USHORT i=0; i<10; i++) {
+        char digit = '0';
+        while (num >= powers[i]) {
+            num -= powers[i];
+            digit++;
+        }
+        if ((digit != '0') || (started) || (i == 9)) {
+            *str++ = digit;
+            started = 1;
+        }
+    }
+    *str++ = '\0';
+}
+
 // convert SHORT to string and appends a new line character
 void _stoa(SHORT num, char* str) {
     char buffer[10];
@@ -145,6 +236,19 @@ USHORT _atous(char* str) {
     return out;
 }
 
+// Ansi to Unsigned Long. x*10 is done with shifts as there's no 32-bit multiply available
+ULONG _atoul(char* str) {
+    ULONG out = 0;
+    while (*str) {
+        if ((*str >= '0') && (*str <= '9')) {
+            out = (out << 3) + (out << 1);
+            out += *str - '0';
+        } 
+        str++;
+    }
+    return out;
+}
+
 // Ansi to Signed Short
 SHORT _atos(char* str) {
     LONG out = 0;
@@ -200,68 +304,125 @@ void SCSIWifi_defaultSettings(struct ScsiDaynaSettings* settings) {
     strcpy(settings->deviceName, "scsi.device");
     settings->deviceID = -1;  // auto detect
     settings->taskPriority = 0;  // -128 to 127  - probably should be 0 but works faster set as 1!
-    settings->scsiMode = 1;      // Driver mode. 0=DynaPORT, 1=24 Byte Patch (scsi.device), 2=Single Write Mode (gvpscsi.device)
+    settings->scsiMode = SCSIMODE_AUTO;  // Driver mode, probed when the unit opens unless it's set
     settings->autoConnect = 0;   // auto connect to the WIFI?
     strcpy(settings->ssid, "");
     strcpy(settings->key, "");
 	settings->debug = 1;       // Logging by default
 	settings->maxDataSize = 8192;
+    settings->bondDeviceID = -1;  // not bonded
+    strcpy(settings->captureFile, "");  // not capturing
+    settings->recvFilter = 1;    // let the firmware drop packet types nothing wants
+    settings->rxQuantum = 8192;  // equal share for receive and send
+    settings->txQuantum = 8192;
+    settings->txPriority = TXPRIORITY_ARP | TXPRIORITY_ICMP | TXPRIORITY_ACK;
+    settings->ackThin = 0;
+    settings->arpOffload = 1;
+    settings->bcastFilter = 1;
+    settings->bcastRate = 50;
+    settings->bufferMem = BUFFERMEM_AUTO;
+    settings->cacheDMA = CACHEDMA_AUTO;
+    settings->busShare = 100;    // back off for up to 100ms when the disk is busy
+    settings->txQueuePackets = 200;
+    settings->txQueueBytes = 262144;
+    settings->txQueueDelay = 20; // aim to keep writes waiting no longer than 20ms
+}
+
+// Applies the TOKEN=VALUE lines in fh to settings. If unit is <0 only the plain lines are applied,
+// otherwise only the lines prefixed with UNITn. for that unit are applied (eg: UNIT1.DEVICEID=5)
+USHORT applySettingsFile(LSCSIDevice dev, BPTR fh, struct ScsiDaynaSettings* settings, SHORT unit) {
+    char buffer[128];
+    USHORT matches = 0;
+    while (FGets(fh, buffer, 128)) {
+        char* value;
+        if (tokeniseSetting(buffer, &value)) {
+            char* name = buffer;
+            // Per-unit setting?
+            if ((Strnicmp(name, "UNIT", 4) == 0) && (name[4] >= '0') && (name[4] <= '9') && (name[5] == '.')) {
+                if (name[4] - '0' != unit) continue;
+                name += 6;
+            } else if (unit >= 0) continue;
+
+            // find a match
+            for (USHORT token = 0; token < NUM_TOKENS; token++) {
+                matches++;
+                if (Stricmp(CONFIG_TOKENS[token], name) == 0) {
+                    switch (token) {
+                        case 0: strcpy_s(settings->deviceName, value, 108); break;
+                        case 1: settings->deviceID = _atos(value); break;
+                        case 2: settings->taskPriority = _atos(value); 
+                                if (settings->taskPriority>127) settings->taskPriority = 127;
+                                if (settings->taskPriority<-128) settings->taskPriority = -128;
+                                break;
+                        case 3: settings->scsiMode = _atous(value); 
+                                if (settings->scsiMode>SCSIMODE_AUTO) settings->scsiMode=SCSIMODE_AUTO;
+                                break;
+                        case 4: settings->autoConnect = _atous(value); break;
+                        case 5: strcpy_s(settings->ssid, value, 64); break;
+                        case 6: strcpy_s(settings->key, value, 64); break;
+						case 7: settings->maxDataSize = _atoul(value);
+                                // A batch has to hold at least one full frame
+                                if (settings->maxDataSize < SCSIWIFI_PACKET_MAX_SIZE + 4) settings->maxDataSize = SCSIWIFI_PACKET_MAX_SIZE + 4;
+                                if (settings->maxDataSize > 0x7FFFFFFFUL) settings->maxDataSize = 0x7FFFFFFFUL;
+                                break;
+						case 8: settings->debug = _atos(value) != 0; break;							
+                        case 9: settings->bondDeviceID = _atos(value); break;
+                        case 10: strcpy_s(settings->captureFile, value, 108); break;
+                        case 11: settings->recvFilter = _atous(value); break;
+                        case 12: settings->rxQuantum = _atous(value); break;
+                        case 13: settings->txQuantum = _atous(value); break;
+                        case 14: settings->txPriority = _atous(value); break;
+                        case 15: settings->ackThin = _atous(value) != 0; break;
+                        case 16: settings->arpOffload = _atous(value) != 0; break;
+                        case 17: settings->bcastFilter = _atous(value) != 0; break;
+                        case 18: settings->bcastRate = _atous(value); break;
+                        case 19: settings->bufferMem = _atous(value); break;
+                        case 20: settings->cacheDMA = _atous(value); break;
+                        case 21: settings->busShare = _atous(value);
+                                 if (settings->busShare > 999) settings->busShare = 999;
+                                 break;
+                        case 22: settings->txQueuePackets = _atous(value); break;
+                        case 23: settings->txQueueBytes = _atoul(value); break;
+                        case 24: settings->txQueueDelay = _atous(value);
+                                 if (settings->txQueueDelay > 99) settings->txQueueDelay = 99;
+                                 break;
+                        default: matches--; break;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    return matches;
 }
 
 // Loads settings from the ENV, returns 0 if the settings were bad and defaults were setup
 LONG SCSIWifi_loadSettings(void *utilityBase, void* dosBase, struct ScsiDaynaSettings* settings) {
+    return SCSIWifi_loadUnitSettings(utilityBase, dosBase, settings, 0);
+}
+
+// Loads the settings for a specific unit from the ENV.  The plain settings are used as the defaults
+// for every unit, and any UNITn. settings then override them for unit n
+LONG SCSIWifi_loadUnitSettings(void *utilityBase, void* dosBase, struct ScsiDaynaSettings* settings, USHORT unit) {
     struct SCSIDevice devTmp;
     LSCSIDevice dev = &devTmp;
     devTmp.sc_dosBase = dosBase;
     devTmp.sc_UtilityBase = utilityBase;
 
-    USHORT modeConfigured = 0;
     SCSIWifi_defaultSettings(settings);
     BPTR fh;
     if (fh = Open("ENV:scsidayna.prefs",MODE_OLDFILE)) {
-        char buffer[128];
 		settings->debug = 0;    // If file exists turn off logging by default
-        USHORT matches = 0;
-        while (FGets(fh, buffer, 128)) {
-            char* value;
-            if (tokeniseSetting(buffer, &value)) {
-                // find a match
-                for (USHORT token = 0; token < NUM_TOKENS; token++) {
-                    matches++;
-                    if (Stricmp(CONFIG_TOKENS[token], buffer) == 0) {
-                        switch (token) {
-                            case 0: strcpy_s(settings->deviceName, value, 108); break;
-                            case 1: settings->deviceID = _atos(value); break;
-                            case 2: settings->taskPriority = _atos(value); 
-                                    if (settings->taskPriority>127) settings->taskPriority = 127;
-                                    if (settings->taskPriority<-128) settings->taskPriority = -128;
-                                    break;
-                            case 3: settings->scsiMode = _atous(value); 
-                                    if (settings->scsiMode>2) settings->scsiMode=2;
-                                    modeConfigured = 1;
-                                    break;
-                            case 4: settings->autoConnect = _atous(value); break;
-                            case 5: strcpy_s(settings->ssid, value, 64); break;
-                            case 6: strcpy_s(settings->key, value, 64); break;
-							case 7: settings->maxDataSize = _atous(value); break;
-							case 8: settings->debug = _atos(value) != 0; break;							
-                            default: matches--; break;
-                        }
-                        break;
-                    }
-                }
-            }
+        USHORT matches = applySettingsFile(dev, fh, settings, -1);
+        if (matches < 1) SCSIWifi_defaultSettings(settings); else {
+            // Now apply the overrides for this unit
+            Seek(fh, 0, OFFSET_BEGINNING);
+            applySettingsFile(dev, fh, settings, unit);
         }
-        if (matches < 1) SCSIWifi_defaultSettings(settings);
         Close(fh);
         return matches > 0;
     }
 
-    // If no mode was set, but a GVP device was specified then jump to mode 2. It will default to 1 anyway
-    if (!modeConfigured) {
-        if ((ToUpper(settings->deviceName[0]) == 'G') && (ToUpper(settings->deviceName[0]) == 'V') && (ToUpper(settings->deviceName[0]) == 'P')) settings->scsiMode = 2;
-    }
-
     return 0;
 }
 
@@ -286,8 +447,24 @@ LONG SCSIWifi_saveSettings(struct DosBase *dosBase, struct ScsiDaynaSettings* se
                 case 4:  _ustoa(settings->autoConnect, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
                 case 5:  if (!FPuts(fh, settings->ssid)) good = 0; break;
                 case 6:  if (!FPuts(fh, settings->key)) good = 0; break;
-				case 7:  _ustoa(settings->maxDataSize, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+				case 7:  _ultoa(settings->maxDataSize, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
 				case 8:  _ustoa(settings->debug, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 9:  _stoa(settings->bondDeviceID, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 10: if (!FPuts(fh, settings->captureFile)) good = 0; break;
+                case 11: _ustoa(settings->recvFilter, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 12: _ustoa(settings->rxQuantum, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 13: _ustoa(settings->txQuantum, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 14: _ustoa(settings->txPriority, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 15: _ustoa(settings->ackThin, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 16: _ustoa(settings->arpOffload, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 17: _ustoa(settings->bcastFilter, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 18: _ustoa(settings->bcastRate, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 19: _ustoa(settings->bufferMem, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 20: _ustoa(settings->cacheDMA, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 21: _ustoa(settings->busShare, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 22: _ustoa(settings->txQueuePackets, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 23: _ultoa(settings->txQueueBytes, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
+                case 24: _ustoa(settings->txQueueDelay, tmp);  if (!FPuts(fh, tmp)) good = 0; break;
             }
             if (!FPuts(fh, "\n")) good = 0;
         }
@@ -298,6 +475,84 @@ LONG SCSIWifi_saveSettings(struct DosBase *dosBase, struct ScsiDaynaSettings* se
     return 0;
 }
 
+// Probed modes are kept in here, one SCSI driver per line as NAME=MODE. A mode starting with ? was being probed
+// when the line was written, and if it's still there that probe never finished
+#define MODES_FILE "scsidayna.modes"
+#define MODES_FILE_SIZE 1024
+
+// Returns the mode remembered for deviceDriverName, or SCSIMODE_AUTO if there isn't one. If *probing is set the
+// mode returned was being probed and never finished, eg: because the machine hung
+USHORT SCSIWifi_getRememberedMode(SCSIWIFIDevice device, char* deviceDriverName, USHORT* probing) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    USHORT mode = SCSIMODE_AUTO;
+    char buffer[128];
+
+    *probing = 0;
+    BPTR fh = Open("ENV:" MODES_FILE, MODE_OLDFILE);
+    if (!fh) return mode;
+    while (FGets(fh, buffer, 128)) {
+        char* value;
+        removeNL(buffer);
+        if ((!tokeniseSetting(buffer, &value)) || (Stricmp(buffer, deviceDriverName))) continue;
+        *probing = (*value == '?');
+        mode = _atous(value);
+        if (mode > SCSIMODE_AUTO) mode = SCSIMODE_AUTO;
+    }
+    Close(fh);
+    return mode;
+}
+
+// Remembers the mode for deviceDriverName in ENV: and ENVARC:, keeping the other drivers' lines. If probing is set
+// it's the mode about to be probed, and SCSIMODE_AUTO forgets it
+LONG SCSIWifi_rememberMode(SCSIWIFIDevice device, char* deviceDriverName, USHORT mode, USHORT probing) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    char buffer[128];
+
+    char* lines = AllocVec(MODES_FILE_SIZE, MEMF_PUBLIC);
+    if (!lines) return 0;
+    ULONG used = 0;
+    BPTR fh = Open("ENV:" MODES_FILE, MODE_OLDFILE);
+    if (fh) {
+        while (FGets(fh, buffer, 128)) {
+            char* value;
+            removeNL(buffer);
+            if (!tokeniseSetting(buffer, &value)) continue;
+            if (!Stricmp(buffer, deviceDriverName)) continue;
+            USHORT nameLen = strlen(buffer);
+            USHORT valueLen = strlen(value);
+            if (used + nameLen + valueLen + 2 > MODES_FILE_SIZE - 128) break;
+            memcpy(&lines[used], buffer, nameLen); used += nameLen;
+            lines[used++] = '=';
+            memcpy(&lines[used], value, valueLen); used += valueLen;
+            lines[used++] = '\n';
+        }
+        Close(fh);
+    }
+    // SCSIMODE_AUTO forgets the driver's mode
+    if (mode != SCSIMODE_AUTO) {
+        USHORT nameLen = strlen(deviceDriverName);
+        if (nameLen > 107) nameLen = 107;
+        memcpy(&lines[used], deviceDriverName, nameLen); used += nameLen;
+        lines[used++] = '=';
+        if (probing) lines[used++] = '?';
+        lines[used++] = '0' + mode;
+        lines[used++] = '\n';
+    }
+
+    // ENVARC: as well so it's still known after a reboot, which is when an unfinished probe matters
+    LONG good = 1;
+    if (fh = Open("ENV:" MODES_FILE, MODE_NEWFILE)) {
+        if (Write(fh, lines, used) != used) good = 0;
+        Close(fh);
+    } else good = 0;
+    if (fh = Open("ENVARC:" MODES_FILE, MODE_NEWFILE)) {
+        if (Write(fh, lines, used) != used) good = 0;
+        Close(fh);
+    } else good = 0;
+    FreeVec(lines);
+    return good;
+}
+
 struct IORequest* _CreateExtIO(LSCSIDevice dev, struct MsgPort *replyPort, long size) {
     struct IORequest *io = NULL;
 
@@ -441,7 +696,7 @@ SCSIWIFIDevice SCSIWifi_open(struct SCSIDevice_OpenData* openData, enum SCSIWifi
         dev->Cmd.scsi_Length = INQUIRE_BUFFER_SIZE;        
         dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-        DoIO( (struct IORequest*)dev->SCSIReq );  
+        SCSI_DOIO(dev);  
 
         // Failed
         if (dev->Cmd.scsi_Status) {
@@ -498,7 +753,7 @@ LONG SCSIWifi_scan(SCSIWIFIDevice device, enum SCSIWifi_ScanStatus* status) {
     dev->Cmd.scsi_Length = 4;                       // NEEDS to be 4
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );   
+    SCSI_DOIO(dev);   
 
     // Failed
     if (dev->Cmd.scsi_Status) return 0;
@@ -526,7 +781,7 @@ LONG SCSIWifi_scanComplete(SCSIWIFIDevice device, enum SCSIWifi_ScanStatus* stat
     dev->Cmd.scsi_Length = 4;                       // NEEDS to be 4
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );   
+    SCSI_DOIO(dev);   
 
     // Failed
     if (dev->Cmd.scsi_Status) return 0;
@@ -554,7 +809,7 @@ LONG SCSIWifi_getScanResults(SCSIWIFIDevice device, struct SCSIWifi_ScanResults*
     dev->Cmd.scsi_Length = sizeof(struct SCSIWifi_ScanResults);       
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );   
+    SCSI_DOIO(dev);   
 
     // Failed
     if (dev->Cmd.scsi_Status) return 0;
@@ -581,7 +836,7 @@ LONG SCSIWifi_enable(SCSIWIFIDevice device, LONG setEnable) {
     dev->Cmd.scsi_Length = 0;
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq ); 
+    SCSI_DOIO(dev); 
 
     if (dev->Cmd.scsi_Status) return 0;
 
@@ -599,7 +854,7 @@ LONG SCSIWifi_getMACAddress(SCSIWIFIDevice device, struct SCSIWifi_MACAddress* m
     dev->Cmd.scsi_Length = 6;
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );   
+    SCSI_DOIO(dev);   
 
     if (dev->Cmd.scsi_Status) return 0;
 
@@ -624,7 +879,7 @@ LONG SCSIWifi_joinNetwork(SCSIWIFIDevice device, struct SCSIWifi_JoinRequest* wi
     dev->Cmd.scsi_Length = sizeof(struct SCSIWifi_JoinRequest);         
     dev->Cmd.scsi_Flags = SCSIF_WRITE | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );   
+    SCSI_DOIO(dev);   
 
     if (dev->Cmd.scsi_Status) return 0;
     
@@ -645,7 +900,7 @@ LONG SCSIWifi_getNetwork(SCSIWIFIDevice device, struct SCSIWifi_NetworkEntry* co
     dev->Cmd.scsi_Length = sizeof(struct SCSIWifi_NetworkEntry) + 2;   
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );   
+    SCSI_DOIO(dev);   
 
     if (dev->Cmd.scsi_Status) {
         FreeVec(netBuffer);
@@ -678,7 +933,7 @@ LONG SCSIWifi_addMulticastAddress(SCSIWIFIDevice device, struct SCSIWifi_MACAddr
     dev->Cmd.scsi_Length = 6;
     dev->Cmd.scsi_Flags = SCSIF_WRITE | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );  
+    SCSI_DOIO(dev);  
 
     LONG ret = 1;
     if (dev->Cmd.scsi_Status) ret = 0;    
@@ -695,7 +950,7 @@ LONG SCSIWifi_sendFrame(SCSIWIFIDevice device, UBYTE* packet, UWORD packetSize)
     dev->Cmd.scsi_Length = packetSize;
     dev->Cmd.scsi_Flags = SCSIF_WRITE | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );     
+    dmaDoIO(dev);     
 
     if (dev->Cmd.scsi_Status) return 0;
     return 1;
@@ -732,7 +987,7 @@ LONG SCSIWifi_receiveFrame(SCSIWIFIDevice device, UBYTE* packetBuffer, UWORD pac
     dev->Cmd.scsi_Length = packetSize;
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq ); 
+    dmaDoIO(dev); 
 
     if ((dev->Cmd.scsi_Status) || (dev->Cmd.scsi_Actual < 6)) return 0;
 
@@ -749,17 +1004,22 @@ LONG SCSIWifi_getDeviceInfo(SCSIWIFIDevice device, struct SCSIWifi_DeviceInfo* d
 
     devInfo->valid = 0;
     dev->Cmd.scsi_Data = (APTR)result;
-    dev->Cmd.scsi_Length = 12;
+    dev->Cmd.scsi_Length = 16;      // Older firmware only sends the first 12 bytes
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 		
-    DoIO( (struct IORequest*)dev->SCSIReq );   
+    SCSI_DOIO(dev);   
 
     if (dev->Cmd.scsi_Status) return 0;
 
-    if (dev->Cmd.scsi_Actual == 12) {
+    if (dev->Cmd.scsi_Actual >= 12) {
         memcpy(devInfo->macAddress, &result[6], 6);
 		devInfo->maxPacketsSize = (result[0] << 8) | result[1];
 		devInfo->maxPackets = (result[2] << 8) | result[3];
+		devInfo->capabilities = (result[4] << 8) | result[5];
+		devInfo->maxBatchSize = devInfo->maxPacketsSize;
+		if ((devInfo->capabilities & SCSIWIFI_CAP_LARGEBATCH) && (dev->Cmd.scsi_Actual >= 16))
+			devInfo->maxBatchSize = ((ULONG)result[12] << 24) | ((ULONG)result[13] << 16) | ((ULONG)result[14] << 8) | (ULONG)result[15];
+		if (devInfo->maxBatchSize < devInfo->maxPacketsSize) devInfo->maxBatchSize = devInfo->maxPacketsSize;
         devInfo->valid = 1;
         return 1;
     }
@@ -773,53 +1033,348 @@ LONG SCSIWifi_getDeviceInfo(SCSIWIFIDevice device, struct SCSIWifi_DeviceInfo* d
 // Then for each packet
 // 0/1 High/Low Byte: Packet Size (MAX upto MTU)
 //     2+ Packet Data
-LONG SCSIWifi_AmigaNetSendFrames(SCSIWIFIDevice device, UBYTE* packets, USHORT totalSize) {
+// Batches over 64KB use the 10 byte command with the size in bytes 3-6
+LONG SCSIWifi_AmigaNetSendFrames(SCSIWIFIDevice device, UBYTE* packets, ULONG totalSize) {
 	LSCSIDevice dev = (LSCSIDevice)device;
     
-    SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_WRITEFRAME, 0, AMIGASCSI_BATCHMODE, totalSize >> 8, totalSize & 0xFF, 0);
+    if (totalSize > 0xFFFF) {
+        SCSI_PREPCMD10(dev, SCSI_NETWORK_WIFI_WRITEFRAME10, 0, AMIGASCSI_BATCHMODE|dev->compactMode, totalSize);
+    } else {
+        SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_WRITEFRAME, 0, AMIGASCSI_BATCHMODE|dev->compactMode, totalSize >> 8, totalSize & 0xFF, 0);
+    }
     dev->Cmd.scsi_Data = (APTR)packets;
     dev->Cmd.scsi_Length = totalSize;
     dev->Cmd.scsi_Flags = SCSIF_WRITE | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq );     
+    dmaDoIO(dev);     
 
     if (dev->Cmd.scsi_Status) return 0;
     return 1;
 }
 
 
+// Compact headers are requested with a flag on each batch command, so there's nothing to send here
+LONG SCSIWifi_AmigaNetSetCompact(SCSIWIFIDevice device, LONG enable) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    if (!dev->isAmigaWIFI) return 0;
+    dev->compactMode = enable ? AMIGASCSI_COMPACTMODE : 0;
+    return 1;
+}
+
+// Cache maintenance is done by the driver, so this just says whether it's needed
+void SCSIWifi_setCacheDMA(SCSIWIFIDevice device, LONG enable) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    dev->cacheDMA = enable ? 1 : 0;
+}
+
+// Transmit credits are also requested with a flag on each receive command
+LONG SCSIWifi_AmigaNetSetCredits(SCSIWIFIDevice device, LONG enable) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    if (!dev->isAmigaWIFI) return 0;
+    dev->creditMode = enable ? AMIGASCSI_CREDITMODE : 0;
+    return 1;
+}
+
+// Sets the AmigaNET receive filter. The structure is sent as is
+LONG SCSIWifi_AmigaNetSetFilter(SCSIWIFIDevice device, struct SCSIWifi_Filter* filter) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+
+    SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_AMIGANET_FILTER, 0,
+        sizeof(struct SCSIWifi_Filter) >> 8,
+        sizeof(struct SCSIWifi_Filter) & 0xFF,
+        0);
+
+    dev->Cmd.scsi_Data = (APTR)filter;
+    dev->Cmd.scsi_Length = sizeof(struct SCSIWifi_Filter);
+    dev->Cmd.scsi_Flags = SCSIF_WRITE | SCSIF_AUTOSENSE;
+
+    SCSI_DOIO(dev);
+
+    if (dev->Cmd.scsi_Status) return 0;
+    return 1;
+}
+
+// Sets up ARP offload. The structure is sent as is
+LONG SCSIWifi_AmigaNetSetArpOffload(SCSIWIFIDevice device, struct SCSIWifi_ArpOffload* offload) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+
+    SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_AMIGANET_ARPOFFLOAD, 0,
+        sizeof(struct SCSIWifi_ArpOffload) >> 8,
+        sizeof(struct SCSIWifi_ArpOffload) & 0xFF,
+        0);
+
+    dev->Cmd.scsi_Data = (APTR)offload;
+    dev->Cmd.scsi_Length = sizeof(struct SCSIWifi_ArpOffload);
+    dev->Cmd.scsi_Flags = SCSIF_WRITE | SCSIF_AUTOSENSE;
+
+    SCSI_DOIO(dev);
+
+    if (dev->Cmd.scsi_Status) return 0;
+    return 1;
+}
+
+// Fetch the ARP offload counters, both are big endian ULONGs
+LONG SCSIWifi_AmigaNetGetArpStats(SCSIWIFIDevice device, struct SCSIWifi_ArpStats* stats) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+
+    SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_AMIGANET_ARPSTATS, 0,
+        sizeof(struct SCSIWifi_ArpStats) >> 8,
+        sizeof(struct SCSIWifi_ArpStats) & 0xFF,
+        0);
+    UBYTE* result = &dev->scsiCommand[6];
+
+    dev->Cmd.scsi_Data = (APTR)result;
+    dev->Cmd.scsi_Length = sizeof(struct SCSIWifi_ArpStats);
+    dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
+
+    SCSI_DOIO(dev);
+
+    if ((dev->Cmd.scsi_Status) || (dev->Cmd.scsi_Actual != sizeof(struct SCSIWifi_ArpStats))) return 0;
+    stats->repliesSent = ((ULONG)result[0] << 24) | ((ULONG)result[1] << 16) | ((ULONG)result[2] << 8) | (ULONG)result[3];
+    stats->requestsDropped = ((ULONG)result[4] << 24) | ((ULONG)result[5] << 16) | ((ULONG)result[6] << 8) | (ULONG)result[7];
+    return 1;
+}
+
+// Moves test data across the bus without touching the network, see AMIGANET_TEST_*. Byte 2 is the test and the last
+// byte the read patch for the current mode, so the data comes back the same way received batches do. Returns how many
+// bytes were transferred, or 0 if it failed
+LONG SCSIWifi_AmigaNetLinkTest(SCSIWIFIDevice device, UBYTE test, UBYTE* buffer, ULONG length) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    const BOOL isRead = (test == AMIGANET_TEST_SOURCE) || (test == AMIGANET_TEST_ECHO_READ);
+    UBYTE patch = 0;
+
+    if (isRead) switch (dev->scsiMode) {
+        case 1: patch = AMIGASCSI_PATCH_24BYTE_BLOCKSIZE; break;
+        case 2: patch = AMIGASCSI_PATCH_ONEBLOCK; break;
+    }
+    if (length > 0xFFFF) {
+        SCSI_PREPCMD10(dev, SCSI_NETWORK_WIFI_CMD10, SCSI_NETWORK_WIFI_OPT_AMIGANET_LINKTEST, test, length);
+        dev->scsiCommand[9] = patch;
+    } else {
+        SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_AMIGANET_LINKTEST, test, length >> 8, length & 0xFF, patch);
+    }
+    dev->Cmd.scsi_Data = (APTR)buffer;
+    dev->Cmd.scsi_Length = length;
+    dev->Cmd.scsi_Flags = (isRead ? SCSIF_READ : SCSIF_WRITE) | SCSIF_AUTOSENSE;
+
+    dmaDoIO(dev);
+
+    if (dev->Cmd.scsi_Status) return 0;
+    return dev->Cmd.scsi_Actual;
+}
+
 // New faster command for receiving packets. The amount of data received actually is returned. 
 // The format of this buffer is
 // 0/1 High Byte, Low Byte: Number of Packets Received
 // 2   Set to 1 if there are more packets waiting
-// 3   Reserved.
+// 3   Reserved, or the top of the transmit byte credit with SCSIWIFI_CAP_LARGEBATCH and credits on
+// 4-7 Transmit credits, only if turned on with SCSIWifi_AmigaNetSetCredits
 // Then, for each packet
 //    0 High Byte of packet size
 //    1 Low Byte of packet size
 //    2+ Packet Data
-LONG SCSIWifi_AmigaNetRecvFrames(SCSIWIFIDevice device, UBYTE* packetBuffer, UWORD bufferSize) {
+// Buffers over 64KB use the 10 byte commands, as with sending
+LONG SCSIWifi_AmigaNetRecvFrames(SCSIWIFIDevice device, UBYTE* packetBuffer, ULONG bufferSize) {
     LSCSIDevice dev = (LSCSIDevice)device;
 
-   switch (dev->scsiMode) {
+   if (bufferSize > 0xFFFF) switch (dev->scsiMode) {
+       case 1:  // scsi.device mode
+            SCSI_PREPCMD10(dev, SCSI_NETWORK_WIFI_CMD10, SCSI_NETWORK_WIFI_OPT_ALTREAD,  AMIGASCSI_PATCH_24BYTE_BLOCKSIZE|AMIGASCSI_BATCHMODE|dev->compactMode|dev->creditMode, bufferSize);
+            break;
+
+        case 2:  // gvpscsi.device mode
+            SCSI_PREPCMD10(dev, SCSI_NETWORK_WIFI_CMD10, SCSI_NETWORK_WIFI_OPT_ALTREAD,  AMIGASCSI_PATCH_ONEBLOCK|AMIGASCSI_BATCHMODE|dev->compactMode|dev->creditMode, bufferSize);
+            break;
+
+        default:
+            SCSI_PREPCMD10(dev, SCSI_NETWORK_WIFI_READFRAME10, 0, AMIGASCSI_BATCHMODE|dev->compactMode|dev->creditMode, bufferSize);
+            break;
+   } else switch (dev->scsiMode) {
        case 1:  // scsi.device mode
-            SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_ALTREAD,  AMIGASCSI_PATCH_24BYTE_BLOCKSIZE|AMIGASCSI_BATCHMODE, bufferSize >> 8, bufferSize & 0xFF, 0);
+            SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_ALTREAD,  AMIGASCSI_PATCH_24BYTE_BLOCKSIZE|AMIGASCSI_BATCHMODE|dev->compactMode|dev->creditMode, bufferSize >> 8, bufferSize & 0xFF, 0);
             break;
 
         case 2:  // gvpscsi.device mode
-            SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_ALTREAD,  AMIGASCSI_PATCH_ONEBLOCK|AMIGASCSI_BATCHMODE,  bufferSize >> 8, bufferSize & 0xFF, 0);
+            SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_CMD, SCSI_NETWORK_WIFI_OPT_ALTREAD,  AMIGASCSI_PATCH_ONEBLOCK|AMIGASCSI_BATCHMODE|dev->compactMode|dev->creditMode,  bufferSize >> 8, bufferSize & 0xFF, 0);
             break;
 
         default:
-            SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_READFRAME, 0, AMIGASCSI_BATCHMODE, bufferSize >> 8, bufferSize & 0xFF, 0);
+            SCSI_PREPCMD(dev, SCSI_NETWORK_WIFI_READFRAME, 0, AMIGASCSI_BATCHMODE|dev->compactMode|dev->creditMode, bufferSize >> 8, bufferSize & 0xFF, 0);
             break;
     }
     dev->Cmd.scsi_Data = (APTR)packetBuffer;
     dev->Cmd.scsi_Length = bufferSize;
     dev->Cmd.scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
 
-    DoIO( (struct IORequest*)dev->SCSIReq ); 
+    dmaDoIO(dev); 
 
     if ((dev->Cmd.scsi_Status) || (dev->Cmd.scsi_Actual < 4)) return 0;
 
     return dev->Cmd.scsi_Actual;
 }
+
+// The probe fills its buffer with this first, so anything written past what the target says it sent shows up
+#define PROBE_PATTERN  0xA5
+#define PROBE_REPEATS  3
+// Bytes after each read that must still hold the pattern, enough to catch a 24 byte block of padding
+#define PROBE_GUARD    32
+
+// What the probe echoes in byte i of a length byte transfer, different for each length so a stale echo shows up
+#define PROBE_BYTE(i, length) ((UBYTE)((i) + ((length) >> 1) + 1))
+
+// Checks a probe read finished cleanly, came back as it was written, and nothing landed after it
+static LONG probeReadIntact(LSCSIDevice dev, UBYTE* buffer, ULONG length) {
+    if ((dev->SCSIReq->io_Error) || (dev->Cmd.scsi_Status) || (dev->Cmd.scsi_Actual != length)) return 0;
+    for (ULONG i=0; i<length; i++)
+        if (buffer[i] != PROBE_BYTE(i, length)) return 0;
+    for (ULONG i=length; i<length + PROBE_GUARD; i++)
+        if (buffer[i] != PROBE_PATTERN) return 0;
+    return 1;
+}
+
+// Tries scsiMode by echoing data through the link test at several lengths, keeping it if every read came back intact.
+// Only use it if SCSIWIFI_CAP_LINKTEST was reported, as receive reads with nothing waiting are too short to show
+// up the odd lengths and padding the modes are for. buffer holds bufferSize bytes
+LONG SCSIWifi_probeMode(SCSIWIFIDevice device, USHORT scsiMode, UBYTE* buffer, ULONG bufferSize) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    // Lengths that aren't a multiple of 24 or of each other, which is where the controllers that need a patch go wrong.
+    // The last is as near the whole buffer as fits
+    const ULONG lengths[6] = {1, 23, 25, SCSIWIFI_PACKET_MAX_SIZE + 5, 4097, (bufferSize - PROBE_GUARD - 1) | 1};
+    const USHORT oldMode = dev->scsiMode;
+    LONG good = 1;
+
+    if (bufferSize <= PROBE_GUARD + 1) return 0;
+    dev->scsiMode = scsiMode;
+    for (USHORT repeat=0; (good) && (repeat<PROBE_REPEATS); repeat++) {
+        for (USHORT i=0; (good) && (i<6); i++) {
+            ULONG length = lengths[i];
+            if (length + PROBE_GUARD > bufferSize) continue;
+            // Writes don't use the mode's patch, so what's sent is known to arrive as it is
+            for (ULONG b=0; b<length; b++) buffer[b] = PROBE_BYTE(b, length);
+            if ((ULONG)SCSIWifi_AmigaNetLinkTest(device, AMIGANET_TEST_ECHO_WRITE, buffer, length) != length) {
+                good = 0;
+                break;
+            }
+            memset(buffer, PROBE_PATTERN, length + PROBE_GUARD);
+            SCSIWifi_AmigaNetLinkTest(device, AMIGANET_TEST_ECHO_READ, buffer, length);
+            good = probeReadIntact(dev, buffer, length);
+        }
+    }
+    if (!good) dev->scsiMode = oldMode;
+    return good;
+}
+
+// Walks the partitions mounted through deviceDriverName, finding the smallest MaxTransfer and the combined DMA Mask.
+// Returns FALSE if no partitions use it
+static BOOL scanPartitions(LSCSIDevice dev, char* deviceDriverName, ULONG* maxTransfer, ULONG* mask) {
+    BOOL found = FALSE;
+    char name[108];
+
+    *maxTransfer = 0;
+    *mask = 0xFFFFFFFF;
+    struct DosList* dol = LockDosList(LDF_DEVICES | LDF_READ);
+    while (dol = NextDosEntry(dol, LDF_DEVICES)) {
+        // dol_Startup isn't always a FileSysStartupMsg, eg: for some handlers it's just a number
+        struct FileSysStartupMsg* fssm = (struct FileSysStartupMsg*)BADDR(dol->dol_Startup);
+        if (((ULONG)dol->dol_Startup < 64) || (!TypeOfMem(fssm))) continue;
+        UBYTE* devName = (UBYTE*)BADDR(fssm->fssm_Device);
+        struct DosEnvec* env = (struct DosEnvec*)BADDR(fssm->fssm_Environ);
+        if ((!devName) || (!env) || (!TypeOfMem(devName)) || (!TypeOfMem(env))) continue;
+        if (env->de_TableSize < DE_BUFMEMTYPE) continue;
+
+        USHORT len = devName[0];
+        if (len > 107) len = 107;
+        memcpy(name, &devName[1], len);
+        name[len] = '\0';
+        if (Stricmp(name, deviceDriverName)) continue;
+        found = TRUE;
+
+        // Some controllers are set up with BufMemType rather than a Mask to keep buffers in 24-bit memory
+        if (env->de_BufMemType & MEMF_24BITDMA) *mask &= 0x00FFFFFE;
+        if (env->de_TableSize < DE_MAXTRANSFER) continue;
+        if ((!*maxTransfer) || (env->de_MaxTransfer < *maxTransfer)) *maxTransfer = env->de_MaxTransfer;
+        if (env->de_TableSize >= DE_MASK) *mask &= env->de_Mask;
+    }
+    UnLockDosList(LDF_DEVICES | LDF_READ);
+
+    return found;
+}
+
+// Finds the smallest MaxTransfer of the partitions mounted through deviceDriverName. A single transfer bigger than
+// that might not work with this controller. Returns 0 if no partitions use it
+ULONG SCSIWifi_getMaxTransfer(SCSIWIFIDevice device, char* deviceDriverName) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    ULONG maxTransfer, mask;
+
+    scanPartitions(dev, deviceDriverName, &maxTransfer, &mask);
+    return maxTransfer;
+}
+
+// Returns the addresses the controller can DMA to, from the Mask of the partitions mounted through deviceDriverName.
+// Returns 0xFFFFFFFF if no partitions use it, as nothing is known about the controller
+ULONG SCSIWifi_getDMAMask(SCSIWIFIDevice device, char* deviceDriverName) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    ULONG maxTransfer, mask;
+
+    if (!scanPartitions(dev, deviceDriverName, &maxTransfer, &mask)) return 0xFFFFFFFF;
+    return mask;
+}
+
+// Decodes why the last command failed from io_Error, the status byte and the sense data.
+// Bus problems and a busy or not ready target are worth retrying, anything the target rejected isn't
+enum SCSIWifi_ErrorClass SCSIWifi_getLastError(SCSIWIFIDevice device, struct SCSIWifi_Error* error) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    UBYTE* sense = (UBYTE*)dev->senseData;
+
+    error->ioError = dev->SCSIReq->io_Error;
+    error->status = dev->Cmd.scsi_Status;
+    error->senseKey = error->asc = error->ascq = error->infoValid = 0;
+    error->information = 0;
+
+    // Fixed format sense data (0x70/0x71), the ASC/ASCQ are only there if enough was returned
+    if ((dev->Cmd.scsi_SenseActual >= 3) && ((sense[0] & 0x7E) == 0x70)) {
+        error->senseKey = sense[2] & 0x0F;
+        if (dev->Cmd.scsi_SenseActual >= 7) {
+            error->infoValid = (sense[0] & 0x80) != 0;
+            error->information = ((ULONG)sense[3] << 24) | ((ULONG)sense[4] << 16) | ((ULONG)sense[5] << 8) | (ULONG)sense[6];
+        }
+        if (dev->Cmd.scsi_SenseActual >= 14) {
+            error->asc = sense[12];
+            error->ascq = sense[13];
+        }
+    }
+
+    switch (error->ioError) {
+        case 0: if (!error->status) return swecNone; break;
+        case HFERR_DMA:
+        case HFERR_Phase:
+        case HFERR_Parity: return swecTransient;      // Glitch on the bus
+        case HFERR_BadStatus: break;
+        default: return swecFatal;                     // eg: selection timeout, the target has gone
+    }
+
+    switch (error->status) {
+        case 0x08:                                     // Busy
+        case 0x18: return swecTransient;               // Reservation conflict
+        case 0x02: break;                              // Check condition, look at the sense key
+        default: return swecFatal;
+    }
+
+    switch (error->senseKey) {
+        case 0x00:                                     // No sense
+        case 0x01:                                     // Recovered error
+        case 0x02:                                     // Not ready
+        case 0x06:                                     // Unit attention
+        case 0x0B: return swecTransient;               // Aborted command
+        default: return swecFatal;                     // eg: illegal request or hardware error
+    }
+}
+
+#ifdef PROFILE
+// Starts counting the latency of every SCSI command into profile, or stops if it's NULL
+void SCSIWifi_setProfile(SCSIWIFIDevice device, struct Library* timerBase, struct ScsiDaynaProfile* profile) {
+    LSCSIDevice dev = (LSCSIDevice)device;
+    dev->timerBase = timerBase;
+    dev->profile = profile;
+}
+#endif
@@ -26,6 +26,9 @@
 // Result from calling SCSIWifi_open - sworGreat means its using the new AmigaNET driver
 enum SCSIWifi_OpenResult {sworOK, sworGreat, sworOpenDeviceFailed, sworOutOfMem, sworInquireFail, sworNotDaynaDevice};
 
+// How bad the last failed command was, from SCSIWifi_getLastError
+enum SCSIWifi_ErrorClass {swecNone, swecTransient, swecFatal};
+
 // Current status of a WIFI scan
 enum SCSIWifi_ScanStatus {swssBusy, swssComplete, swssNotRunning, swssError};
 
@@ -38,13 +41,84 @@ enum SCSIWifi_ScanStatus {swssBusy, swssComplete, swssNotRunning, swssError};
 #define STRUCT_ALIGN16 __attribute__((aligned (16)))
 #endif
 
+// Firmware can use compact packet headers in batches, see SCSIWifi_AmigaNetSetCompact
+#define SCSIWIFI_CAP_COMPACT        0x0001
+// Firmware takes 10 byte batch commands with 32-bit lengths, so batches can be bigger than 64KB (see maxBatchSize)
+#define SCSIWIFI_CAP_LARGEBATCH     0x0002
+// Firmware can report free space in its transmit queue in the receive batch header, see SCSIWifi_AmigaNetSetCredits
+#define SCSIWIFI_CAP_TXCREDIT       0x0004
+// Firmware takes the link test commands, see SCSIWifi_AmigaNetLinkTest
+#define SCSIWIFI_CAP_LINKTEST       0x0008
+
+// Link tests, which move data across the SCSI bus without it going near the Wifi. SINK throws away what's written,
+// SOURCE returns as many bytes as are asked for, ECHO_WRITE keeps what's written and ECHO_READ sends it back
+#define AMIGANET_TEST_SINK          0
+#define AMIGANET_TEST_SOURCE        1
+#define AMIGANET_TEST_ECHO_WRITE    2
+#define AMIGANET_TEST_ECHO_READ     3
+
+// Size of the header at the front of a received batch, and with transmit credits turned on. With credits, bytes 4-5 are
+// how many more packets the firmware can queue to send, and bytes 3 and 6-7 how many bytes of batch data. Byte 3 is the
+// top 8 bits, which is only sent by firmware with SCSIWIFI_CAP_LARGEBATCH, older firmware caps it at 65535
+#define AMIGANET_RECV_HEADER_SIZE   4
+#define AMIGANET_RECV_CREDIT_HEADER_SIZE 8
+
+// Byte 2 of the batch read and write commands is a read patch (0xA8 or 0xA9, ALTREAD only) ORed with the batch flags:
+// 0x40 batch mode, 0x10 transmit credits in the receive header and 0x04 compact headers. The firmware masks out
+// 0x54 to get the patch back, as none of those bits are set in either patch value
+
+// In compact mode the top bit of a packet's size in a batch is set if its header is compact. The size is then the
+// number of bytes that follow. Sent packets leave out the source address (the firmware fills it in), received
+// packets have the destination address replaced by one of the AMIGANET_DEST_* bytes
+#define AMIGANET_COMPACT_HEADER     0x8000
+#define AMIGANET_DEST_OURS          0x00
+#define AMIGANET_DEST_BROADCAST     0x01
+
 // Structure for MAC addresses from WIFI scsi
 struct STRUCT_PACKED SCSIWifi_DeviceInfo {
     UBYTE valid;
     UBYTE _padding;
 	USHORT maxPacketsSize;		// Maximum size of packet data (multiple packets)
 	USHORT maxPackets;			// Maximum number of supported packets per call
+	USHORT capabilities;		// SCSIWIFI_CAP_* flags, 0 on older firmware
     UBYTE macAddress[6];			// Device mac address
+	ULONG maxBatchSize;			// Largest batch in one command. Same as maxPacketsSize unless SCSIWIFI_CAP_LARGEBATCH
+};
+
+// Receive filter for AmigaNET mode, frames it doesn't allow are dropped by the firmware and never cross the SCSI bus
+#define SCSIWIFI_FILTER_MAX_TYPES   8
+#define SCSIWIFI_FILTER_BROADCAST   0x01      // Allow broadcast frames
+#define SCSIWIFI_FILTER_MULTICAST   0x02      // Allow multicast frames
+#define SCSIWIFI_FILTER_ALLTYPES    0x04      // Ignore etherTypes and allow every type
+struct STRUCT_PACKED SCSIWifi_Filter {
+	UBYTE flags;                                    // SCSIWIFI_FILTER_*, frames sent to our own MAC are always allowed
+	UBYTE count;                                    // Number of entries used in etherTypes
+	UWORD etherTypes[SCSIWIFI_FILTER_MAX_TYPES];    // Allowed ethernet packet types
+};
+
+// ARP offload for AmigaNET mode. The firmware answers ARP requests for ipAddress itself, and drops ARP requests
+// for any other address. ARP replies are still passed on. Setting it resets the SCSIWifi_ArpStats counters
+struct STRUCT_PACKED SCSIWifi_ArpOffload {
+	UBYTE enable;                                   // 0 turns offloading off
+	UBYTE _padding;
+	UBYTE ipAddress[4];                             // Our IPv4 address
+};
+
+// Counters kept by the firmware while ARP offload is on
+struct STRUCT_PACKED SCSIWifi_ArpStats {
+	ULONG repliesSent;                              // ARP requests for our address the firmware answered
+	ULONG requestsDropped;                          // ARP requests for other addresses that were dropped
+};
+
+// Details of why the last command failed
+struct SCSIWifi_Error {
+	BYTE ioError;              // io_Error from the SCSI driver, eg: HFERR_SelTimeout
+	UBYTE status;              // SCSI status byte
+	UBYTE senseKey;            // From the sense data if there was any, else 0
+	UBYTE asc;                 // Additional sense code
+	UBYTE ascq;                // Additional sense code qualifier
+	UBYTE infoValid;           // Set if information is valid
+	ULONG information;         // For batch sends, how many packets the firmware accepted before it failed
 };
 
 // Structure for MAC addresses from WIFI scsi
@@ -72,6 +146,29 @@ struct STRUCT_PACKED SCSIWifi_NetworkEntry {
 	UBYTE _padding;
 };
 
+// Packets that can jump the send queue, for the txPriority setting
+#define TXPRIORITY_ARP     0x01     // ARP
+#define TXPRIORITY_ICMP    0x02     // ICMP and ICMPv6
+#define TXPRIORITY_ACK     0x04     // TCP ACKs with no data
+#define TXPRIORITY_DNS     0x08     // DNS over UDP
+
+// How packets are read, for the scsiMode setting
+#define SCSIMODE_DAYNAPORT 0        // Plain DaynaPORT reads
+#define SCSIMODE_24BYTE    1        // Reads padded to 24 byte blocks (scsi.device - A590/A2091)
+#define SCSIMODE_ONEBLOCK  2        // Reads in a single transfer (gvpscsi.device)
+#define SCSIMODE_AUTO      3        // Probed when the unit opens, and remembered for the SCSI driver
+
+// Where the packet buffers are allocated, for the bufferMem setting
+#define BUFFERMEM_AUTO     0        // Fast RAM, kept below 16MB if the controller's partitions say it can only DMA there
+#define BUFFERMEM_ANY      1        // Any public memory, as older versions did
+#define BUFFERMEM_FAST     2        // Fast RAM anywhere
+#define BUFFERMEM_24BIT    3        // Fast RAM below 16MB
+
+// If the CPU caches are flushed around packet transfers, for the cacheDMA setting
+#define CACHEDMA_AUTO      0        // Only on a 68040 or 68060
+#define CACHEDMA_ON        1
+#define CACHEDMA_OFF       2
+
 // Disk settings
 struct ScsiDaynaSettings {
   // SCSI device driver
@@ -90,6 +187,36 @@ struct ScsiDaynaSettings {
   ULONG maxDataSize;
   // If debug is enabled - creates a console window and shows the output
   UBYTE debug;
+  // Second AmigaNET device ID on the same bus to share the transmit load with, <0 or >7 disables it
+  SHORT bondDeviceID;
+  // If set, every frame sent and received is written to this pcap file
+  char captureFile[108];
+  // If the AmigaNET firmware should drop frames of packet types nothing is reading
+  USHORT recvFilter;
+  // Bytes received and sent per scheduling cycle when both directions are busy
+  USHORT rxQuantum;
+  USHORT txQuantum;
+  // Which kinds of packet are sent ahead of the rest, TXPRIORITY_* flags
+  USHORT txPriority;
+  // If older queued TCP ACKs are dropped when a newer one for the same connection is waiting
+  UBYTE ackThin;
+  // If the AmigaNET firmware should answer ARP requests for our address itself
+  UBYTE arpOffload;
+  // If received ARP requests for other hosts are dropped by the driver
+  UBYTE bcastFilter;
+  // Received broadcast frames per second passed on for each packet type, 0 for no limit
+  USHORT bcastRate;
+  // Where the packet buffers are allocated, BUFFERMEM_*
+  UBYTE bufferMem;
+  // If the CPU caches are flushed around packet transfers, CACHEDMA_*
+  UBYTE cacheDMA;
+  // Longest wait in ms between polls while the disk is using the SCSI bus, 0 to never back off
+  USHORT busShare;
+  // Most writes and bytes queued to send, 0 for no limit
+  USHORT txQueuePackets;
+  ULONG txQueueBytes;
+  // Longest wait in ms for queued writes before the oldest start being dropped, 0 to never drop them
+  USHORT txQueueDelay;
 };
 
 #ifdef __VBCC__
@@ -128,9 +255,19 @@ void SCSIWifi_defaultSettings(struct ScsiDaynaSettings* settings);
 // Loads settings from the ENV, returns 0 if the settings were bad and defaults were setup
 LONG SCSIWifi_loadSettings(void *utilityBase, void *dosBase, struct ScsiDaynaSettings* settings);
 
+// As above, but also applies any UNITn. prefixed settings for the specified unit
+LONG SCSIWifi_loadUnitSettings(void *utilityBase, void *dosBase, struct ScsiDaynaSettings* settings, USHORT unit);
+
 // Saves settings back to ENV or ENVARC - returns 0 if it failed
 LONG SCSIWifi_saveSettings(struct DosBase *dosBase, struct ScsiDaynaSettings* settings, LONG saveToENV);
 
+// Returns the mode probed before for deviceDriverName, or SCSIMODE_AUTO. *probing is set if that probe never finished
+USHORT SCSIWifi_getRememberedMode(SCSIWIFIDevice device, char* deviceDriverName, USHORT* probing);
+
+// Remembers the mode for deviceDriverName in ENV: and ENVARC:, or forgets it if mode is SCSIMODE_AUTO. Set probing
+// before trying a mode, in case it hangs
+LONG SCSIWifi_rememberMode(SCSIWIFIDevice device, char* deviceDriverName, USHORT mode, USHORT probing);
+
 // Attempt to open the DAYNA scsi device. 
 SCSIWIFIDevice SCSIWifi_open(struct SCSIDevice_OpenData* openData, enum SCSIWifi_OpenResult* errorCode);
 
@@ -179,11 +316,54 @@ LONG SCSIWifi_receiveFrame(SCSIWIFIDevice device, UBYTE* packetBuffer, UWORD pac
 // Fetch details about the system
 LONG SCSIWifi_getDeviceInfo(SCSIWIFIDevice device, struct SCSIWifi_DeviceInfo* devInfo);
 
-// New faster command for sending multiple packets.
-LONG SCSIWifi_AmigaNetSendFrames(SCSIWIFIDevice device, UBYTE* packets, USHORT totalSize);
+// New faster command for sending multiple packets. Sizes over 64KB use a 10 byte command, only if SCSIWIFI_CAP_LARGEBATCH was reported
+LONG SCSIWifi_AmigaNetSendFrames(SCSIWIFIDevice device, UBYTE* packets, ULONG totalSize);
+
+// New faster command for receiving packets. The actual buffer size is returned. Sizes over 64KB are as above
+LONG SCSIWifi_AmigaNetRecvFrames(SCSIWIFIDevice device, UBYTE* packetBuffer, ULONG bufferSize);
+
+// Tries scsiMode by echoing data of several lengths through the link test, switching to it if every read came back
+// intact. Only use it if SCSIWIFI_CAP_LINKTEST was reported. buffer holds bufferSize bytes
+LONG SCSIWifi_probeMode(SCSIWIFIDevice device, USHORT scsiMode, UBYTE* buffer, ULONG bufferSize);
+
+// Decodes why the last command failed, returning if it's worth trying again
+enum SCSIWifi_ErrorClass SCSIWifi_getLastError(SCSIWIFIDevice device, struct SCSIWifi_Error* error);
+
+// Returns the smallest MaxTransfer of the partitions mounted through deviceDriverName, or 0 if there aren't any
+ULONG SCSIWifi_getMaxTransfer(SCSIWIFIDevice device, char* deviceDriverName);
+
+// Returns the combined DMA Mask of the partitions mounted through deviceDriverName, or 0xFFFFFFFF if there aren't any
+ULONG SCSIWifi_getDMAMask(SCSIWIFIDevice device, char* deviceDriverName);
+
+// Switches flushing the CPU caches around packet data transfers on or off
+void SCSIWifi_setCacheDMA(SCSIWIFIDevice device, LONG enable);
 
-// New faster command for receiving packets. The actual buffer size is returned.
-LONG SCSIWifi_AmigaNetRecvFrames(SCSIWIFIDevice device, UBYTE* packetBuffer, UWORD bufferSize);
+// Switches compact packet headers on or off for SCSIWifi_AmigaNetSendFrames and SCSIWifi_AmigaNetRecvFrames. Only
+// turn it on if SCSIWIFI_CAP_COMPACT was reported. Returns 0 if it failed
+LONG SCSIWifi_AmigaNetSetCompact(SCSIWIFIDevice device, LONG enable);
+
+// Switches the transmit credits in the receive batch header on or off. Only turn it on if SCSIWIFI_CAP_TXCREDIT was
+// reported. Returns 0 if it failed
+LONG SCSIWifi_AmigaNetSetCredits(SCSIWIFIDevice device, LONG enable);
+
+// Sets which frames the firmware passes on. Returns 0 if it failed, eg: the firmware doesn't support it
+LONG SCSIWifi_AmigaNetSetFilter(SCSIWIFIDevice device, struct SCSIWifi_Filter* filter);
+
+// Turns ARP offload on or off. Returns 0 if it failed, eg: the firmware doesn't support it
+LONG SCSIWifi_AmigaNetSetArpOffload(SCSIWIFIDevice device, struct SCSIWifi_ArpOffload* offload);
+
+// Fetch the ARP offload counters. Returns 0 if it failed
+LONG SCSIWifi_AmigaNetGetArpStats(SCSIWIFIDevice device, struct SCSIWifi_ArpStats* stats);
+
+// Runs one of the AMIGANET_TEST_* link tests on length bytes of buffer. Reads use the patch for the current mode.
+// Only use it if SCSIWIFI_CAP_LINKTEST was reported. Returns the bytes transferred, or 0 if it failed
+LONG SCSIWifi_AmigaNetLinkTest(SCSIWIFIDevice device, UBYTE test, UBYTE* buffer, ULONG length);
+
+#ifdef PROFILE
+// Starts counting the latency of every SCSI command into profile (see profile.h), or stops if it's NULL
+struct ScsiDaynaProfile;
+void SCSIWifi_setProfile(SCSIWIFIDevice device, struct Library* timerBase, struct ScsiDaynaProfile* profile);
+#endif
 
 
 